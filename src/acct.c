@@ -31,6 +31,7 @@
 #include <logging.h>
 #include <acct.h>
 #include <json.h>
+#include <cmd_defs.h>
 
 #include <ctype.h>
 #include <glob.h>
@@ -78,6 +79,8 @@ int handleAcctClientConnection(struct connectionType * conn) {
 		error_die("Failed to malloc memory for client: %s\n", strerror(errno));
 	}
 
+	a->journal.fd = -1;
+
 	/* Get the client UID off the socket */
 	struct ucred creds;
 	socklen_t len = sizeof(struct ucred);
@@ -221,13 +224,13 @@ int locateJournal(acctClient *a, char *id) {
 	*sep = '\0';
 	sep++;
 
-	if (strlen(id) > 8) //YYYYMMDD
+	if (strlen(id) >= sizeof(a->datetime)) //YYYYMMDD[.NNNNNN]
 		return 1;
 
 	strcpy(a->datetime, id);
 
 	while(*id) {
-		if (!isdigit(*id))
+		if (!isdigit(*id) && *id != '.')
 			return 1;
 
 		id++;
@@ -238,27 +241,15 @@ int locateJournal(acctClient *a, char *id) {
 	char journal[PATH_MAX];
 	sprintf(journal, "%s/journal.%s", server.state_dir, a->datetime);
 
-	a->journal = fopen(journal, "rb");
+	journalReaderClose(&a->journal);
 
-	if (a->journal == NULL)
+	if (journalReaderOpen(&a->journal, journal) != 0)
 		error_die("Failed to open journal file '%s': %s", journal, strerror(errno));
 
 	/* Now locate to the requested record */
-	char *record = NULL;
-	size_t record_size = 0;
-	ssize_t record_len = 0;
-
-	off_t current = 0;
-
-	while ((record_len = getline(&record, &record_size, a->journal)) != -1) {
-		if (*record == '\0')
-			break;
+	struct journalEntry e;
 
-		if (++current == a->record)
-			break;
-	}
-
-	free(record);
+	while (a->journal.record < a->record && journalReaderNext(&a->journal, &e) == JOURNAL_RECORD) {}
 
 	return 0;
 }
@@ -325,7 +316,9 @@ static int checkRequests(acctClient *a) {
 		start++;
 	}
 
-	a->pos = cmd - a->request.data;
+	/* Drop the processed requests, remembering that what's left has been scanned */
+	buffRemove(&a->request, cmd - a->request.data, 0);
+	a->pos = a->request.used;
 
 	return 0;
 }
@@ -343,11 +336,7 @@ static void acctMain(acctClient *a) {
 	setproctitle("jersd_acct[%d]", a->connection.socket);
 	buff_t b;
 
-	char *record = NULL;
-	size_t record_size = 0;
-	ssize_t record_len = 0;
 	char id[32];
-	off_t current_pos = 0;
 
 	/* Termination handler */
 	struct sigaction sigact;
@@ -416,13 +405,18 @@ static void acctMain(acctClient *a) {
 		/* Read the current journal, sending any new messages.
 		 * We need to also check if we need to open the next journal. */
 
-		current_pos = ftell(a->journal);
+		journalReaderRefresh(&a->journal);
+
+		while (1) {
+			struct journalEntry e;
+			int rc = journalReaderNext(&a->journal, &e);
 
-		while ((record_len = getline(&record, &record_size, a->journal)) != -1) {
-			if (*record == '\0') {
-				fseek(a->journal, current_pos, SEEK_SET);
+			if (rc == JOURNAL_CORRUPT)
+				error_die("Failed to load journal record at offset %ld", a->journal.offset);
 
-				/* Check if we need to switch to a new journal file */
+			/* Nothing more written yet (or only part of the next record), check
+			 * if we need to switch to a new journal file */
+			if (rc != JOURNAL_RECORD) {
 				/* Get a list of all journal files, find the one we currently have open */
 				char glob_pattern[PATH_MAX];
 				char current_journal[PATH_MAX];
@@ -442,20 +436,18 @@ static void acctMain(acctClient *a) {
 
 					if (i < glob_buff.gl_pathc) {
 						/* Have a new journal to open */
-						FILE *new_journal = fopen(glob_buff.gl_pathv[i], "rb");
+						struct journalReader new_journal;
 
-						if (new_journal == NULL)
+						if (journalReaderOpen(&new_journal, glob_buff.gl_pathv[i]) != 0)
 							error_die("Failed to open journal file '%s': %s", glob_buff.gl_pathv[i], strerror(errno));
 
 						/* Opened a new journal. Reset the current stats */
-						fclose(a->journal);
+						journalReaderClose(&a->journal);
 						a->record = 0;
-						char *dot = strchr(glob_buff.gl_pathv[i], '.');
-						dot++;
-						strcpy(a->datetime, dot);
+						const char *name = strrchr(glob_buff.gl_pathv[i], '/') + 1;
+						strcpy(a->datetime, name + CONST_STRLEN("journal."));
 
 						a->journal = new_journal;
-						current_pos = 0;
 
 						print_msg_info("Switched to new journal %s\n", a->datetime);
 					}
@@ -466,27 +458,14 @@ static void acctMain(acctClient *a) {
 				break;
 			}
 
-			current_pos = ftell(a->journal);
-
-			if (record[record_len - 1] == '\n')
-				record[record_len - 1] = '\0';
-
 			a->record++;
 
 			/* Load this message */
 			char timestamp[64];
-			int64_t revision;
-			char command[64];
-			uid_t uid;
-			jobid_t jobid;
-			int msg_offset;
-
-			int field_count = sscanf(record, "%*c%64s\t%d\t%64s\t%u\t%ld\t%n", timestamp, (int *)&uid, command, &jobid, &revision, &msg_offset);
 
-			if (field_count != 5)
-				error_die("Failed to load 5 required fields from message");
+			sprintf(timestamp, "%ld.%03d", e.time_ms / 1000, (int)(e.time_ms % 1000));
 
-			if (strcmp(command, "REPLAY_COMPLETE") == 0)
+			if (strcmp(e.command, "REPLAY_COMPLETE") == 0 || strcmp(e.command, CMD_CHECKPOINT) == 0)
 				continue;
 
 			/* Serialize this message */
@@ -497,14 +476,14 @@ static void acctMain(acctClient *a) {
 
 			JSONAddString(&b, ACCT_ID, id);
 			JSONAddString(&b, TIMESTAMP, timestamp);
-			JSONAddString(&b, COMMAND, command);
-			JSONAddInt(&b, UID, uid);
+			JSONAddString(&b, COMMAND, e.command);
+			JSONAddInt(&b, UID, e.uid);
 
-			if (jobid)
-				JSONAddInt(&b, JOBID, jobid);
+			if (e.jobid)
+				JSONAddInt(&b, JOBID, e.jobid);
 
 			buffAdd(&b, "\"MESSAGE\":", 10);
-			buffAdd(&b, record + msg_offset, strlen(record + msg_offset));
+			buffAdd(&b, e.payload, e.payload_len);
 
 			JSONEndObject(&b);
 			JSONEnd(&b);
@@ -523,7 +502,7 @@ static void acctMain(acctClient *a) {
 		}
 	}
 
-	free(record);
+	journalReaderClose(&a->journal);
 	free(a->id);
 
 	exit(0);
@@ -34,6 +34,7 @@
 #include "fields.h"
 
 #include <server.h>
+#include "journal.h"
 
 enum acctStates {
 	ACCT_STOPPED = 0,
@@ -55,9 +56,9 @@ typedef struct _acctClient {
 	int state;
 	char *id;
 
-	FILE *journal;
+	struct journalReader journal;
 	off_t record;
-	char datetime[10]; // YYYYMMDD
+	char datetime[16]; // YYYYMMDD[.NNNNNN]
 
 	int initalised;
 
@@ -35,11 +35,15 @@
 
 #include "agent.h"
 #include "logging.h"
+#include "uring.h"
+
+#include <utlist.h>
 
 void markJobsUnknown(agent *a);
 void markQueueStopped(agent *a);
 
 agent * agentList = NULL;
+agent * agentReadyList = NULL;
 
 void addAgent(agent * a) {
 	if (agentList) {
@@ -59,6 +63,25 @@ void removeAgent(agent * a) {
 
 	if (a == agentList)
 		agentList = a->next;
+
+	clearAgentReady(a);
+}
+
+/* Queue an agent that has a complete message to be processed */
+void setAgentReady(agent *a) {
+	if (a->ready)
+		return;
+
+	DL_APPEND2(agentReadyList, a, ready_prev, ready_next);
+	a->ready = 1;
+}
+
+void clearAgentReady(agent *a) {
+	if (!a->ready)
+		return;
+
+	DL_DELETE2(agentReadyList, a, ready_prev, ready_next);
+	a->ready = 0;
 }
 
 int handleAgentConnection(struct connectionType * conn) {
@@ -114,6 +137,7 @@ int handleAgentConnection(struct connectionType * conn) {
 			pollSetReadable(&a->connection);
 			buffNew(&a->requests, 0);
 			buffNew(&a->responses, 0);
+			a->requests_scanned = 0;
 			a->sent = 0;
 
 			print_msg(JERS_LOG_INFO, "New agent connection from '%s' initalised", host);
@@ -153,6 +177,7 @@ int handleAgentDisconnect(agent * a) {
 	free(a->nonce);
 	a->nonce = NULL;
 
+	clearAgentReady(a);
 	buffFree(&a->requests);
 	buffFree(&a->responses);
 	return 0;
@@ -160,12 +185,16 @@ int handleAgentDisconnect(agent * a) {
 
 /* Handle read activity on a agent socket */
 int handleAgentRead(agent * a) {
-	int len = 0;
-
 	buffResize(&a->requests, 0);
 
-	len = _recv(a->connection.socket, a->requests.data + a->requests.used, a->requests.size - a->requests.used);
+	/* Read along with everything else this iteration, see handleAgentReadResult() */
+	if (uringActive() && uringQueueRecv(a->connection.socket, a->requests.data + a->requests.used, a->requests.size - a->requests.used, &a->connection) == 0)
+		return 0;
+
+	return handleAgentReadResult(a, _recv(a->connection.socket, a->requests.data + a->requests.used, a->requests.size - a->requests.used));
+}
 
+int handleAgentReadResult(agent * a, ssize_t len) {
 	if (len < 0) {
  		if ((errno == EAGAIN || errno == EWOULDBLOCK))
 			return 0;
@@ -181,26 +210,50 @@ int handleAgentRead(agent * a) {
 
 	a->requests.used += len;
 
+	/* Only the newly read data needs to be checked for the end of a message */
+	if (!a->ready && buffFind(&a->requests, '\n', &a->requests_scanned))
+		setAgentReady(a);
+
 	return 0;
 }
 
 int handleAgentWrite(agent * a) {
-	int len = 0;
+	/* Anything held for group commit is left for later */
+	size_t len = a->responses.used - heldOutput(&a->connection) - a->sent;
+
+	if (len == 0)
+		return handleAgentWriteResult(a, 0);
 
-	len = _send(a->connection.socket, a->responses.data + a->sent, a->responses.used - a->sent);
+	if (uringActive() && uringQueueSend(a->connection.socket, a->responses.data + a->sent, len, &a->connection) == 0)
+		return 0;
+
+	return handleAgentWriteResult(a, _send(a->connection.socket, a->responses.data + a->sent, len));
+}
 
+int handleAgentWriteResult(agent * a, ssize_t len) {
 	if (len == -1) {
-		print_msg(JERS_LOG_WARNING, "send to agent failed: %s", strerror(errno));
-		return 1;
+		if (errno != EAGAIN && errno != EWOULDBLOCK) {
+			print_msg(JERS_LOG_WARNING, "send to agent failed: %s", strerror(errno));
+			return 1;
+		}
+
+		len = 0;
 	}
 
 	a->sent += len;
 
-	/* Sent everything, remove EPOLLOUT */
+	/* Sent everything, remove EPOLLOUT. Otherwise wait until we can send the rest */
 	if (a->sent == a->responses.used) {
 		a->responses.used = 0;
 		a->sent = 0;
 		pollSetReadable(&a->connection);
+	} else if (a->sent + heldOutput(&a->connection) == a->responses.used) {
+		/* The rest is held until its journal records are flushed */
+		pollSetReadable(&a->connection);
+		buffRemove(&a->responses, a->sent, 0);
+		a->sent = 0;
+	} else {
+		pollSetWritable(&a->connection);
 	}
 
 	return 0;
@@ -52,6 +52,7 @@ typedef struct _agent {
 
 	/* Requests to send to this agent */
 	buff_t requests;
+	size_t requests_scanned;  // Bytes at the start of 'requests' known not to contain a newline
 	size_t sent;
 
 	/* Data we've read from this agent */
@@ -59,16 +60,26 @@ typedef struct _agent {
 
 	struct _agent * next;
 	struct _agent * prev;
+
+	/* Agents with at least one complete message to process */
+	int ready;
+	struct _agent * ready_next;
+	struct _agent * ready_prev;
 } agent;
 
 extern agent *agentList;
+extern agent *agentReadyList;
 
 int handleAgentConnection(struct connectionType * connection);
 int handleAgentDisconnect(agent *a);
 int handleAgentRead(agent *a);
+int handleAgentReadResult(agent *a, ssize_t len);
 int handleAgentWrite(agent *a);
+int handleAgentWriteResult(agent *a, ssize_t len);
 
 void addAgent(agent *a);
 void removeAgent(agent *a);
+void setAgentReady(agent *a);
+void clearAgentReady(agent *a);
 
 #endif
\ No newline at end of file
@@ -782,6 +782,25 @@ JERS_EXPORT int jersClearCache(void) {
 	return 0;
 }
 
+JERS_EXPORT int jersCheckpoint(void) {
+	if (jersInitAPI(NULL))
+		return 1;
+
+	buff_t b;
+
+	initRequest(&b, CMD_CHECKPOINT, 1);
+
+	if (sendRequest(&b))
+		return 1;
+
+	if (readResponse())
+		return 1;
+
+	free_message(&msg);
+
+	return 0;
+}
+
 
 JERS_EXPORT void jersInitQueueMod(jersQueueMod *q) {
 	q->name = NULL;
@@ -38,6 +38,7 @@
 int buffNew(buff_t * b, size_t initial_size) {
 	b->size = initial_size ? initial_size : BUFF_DEFAULT_SIZE;
 	b->used = 0;
+	b->consumed = 0;
 
 	b->data = malloc(b->size);
 
@@ -50,10 +51,24 @@ int buffNew(buff_t * b, size_t initial_size) {
 }
 
 void buffFree(buff_t * b) {
-	free(b->data);
+	free(b->data ? b->data - b->consumed : NULL);
 	b->data = NULL;
 	b->used = 0;
 	b->size = 0;
+	b->consumed = 0;
+}
+
+/* Move the unconsumed data back to the start of the allocation */
+void buffCompact(buff_t * b) {
+	if (b->consumed == 0)
+		return;
+
+	if (b->used)
+		memmove(b->data - b->consumed, b->data, b->used);
+
+	b->data -= b->consumed;
+	b->size += b->consumed;
+	b->consumed = 0;
 }
 
 /* Resize the buffer to be able to store at least an extra 'length' bytes */
@@ -66,6 +81,15 @@ int buffResize(buff_t * b, size_t length) {
 	if (new_size >= b->used + length)
 		return 0;
 
+	/* Reclaim the consumed space first, it might be enough */
+	if (b->consumed) {
+		buffCompact(b);
+		new_size = b->size;
+
+		if (new_size >= b->used + length)
+			return 0;
+	}
+
 	if (new_size == 0)
 		new_size = BUFF_DEFAULT_SIZE;
 
@@ -90,6 +114,8 @@ int buffResize(buff_t * b, size_t length) {
  * The buffer can't be shrunk smaller than used size */
 
 void buffShrink(buff_t * b, size_t min_size) {
+	buffCompact(b);
+
 	size_t size = b->used > BUFF_DEFAULT_SIZE ? b->used : BUFF_DEFAULT_SIZE;
 
 	if (min_size > size)
@@ -116,19 +142,60 @@ int buffAdd(buff_t * b, const char * new_data, size_t data_size) {
 	return 0;
 }
 
+/* Append formatted output to the buffer */
+int buffPrintf(buff_t * b, const char * fmt, ...) {
+	va_list args;
+	int len;
+
+	va_start(args, fmt);
+	len = vsnprintf(b->data ? b->data + b->used : NULL, b->data ? b->size - b->used : 0, fmt, args);
+	va_end(args);
+
+	if (len < 0)
+		return 1;
+
+	if (b->data == NULL || (size_t)len >= b->size - b->used) {
+		if (buffResize(b, len + 1))
+			return 1;
+
+		va_start(args, fmt);
+		vsnprintf(b->data + b->used, b->size - b->used, fmt, args);
+		va_end(args);
+	}
+
+	b->used += len;
+
+	return 0;
+}
+
 /* Add the data from a buffer to the this buffer */
 int buffAddBuff(buff_t *b, buff_t *new_data) {
 	return buffAdd(b, new_data->data, new_data->used);
 }
 
-/* Remove the data at start of the buffer of length 'data_size' if
- * its over a threshold */
+/* Remove the data at start of the buffer of length 'data_size'
+ * The remaining data is only moved once the consumed space is over a
+ * threshold and larger than what's left, so removing many small requests
+ * from the front of a large buffer doesn't memmove the rest each time. */
 int buffRemove(buff_t * b, size_t data_size, int shrink) {
 	if (data_size == 0)
 		return 0;
 
-	memmove(b->data, b->data + data_size, b->used - data_size);
-	b->used -= data_size;
+	if (data_size >= b->used) {
+		/* Nothing left - Start from the beginning again */
+		b->data -= b->consumed;
+		b->size += b->consumed;
+		b->consumed = 0;
+		b->used = 0;
+	} else {
+		b->data += data_size;
+		b->size -= data_size;
+		b->used -= data_size;
+		b->consumed += data_size;
+
+		if (b->consumed >= BUFF_COMPACT_THRESHOLD && b->consumed >= b->used)
+			buffCompact(b);
+	}
 
 	if (shrink)
 		buffShrink(b, 0);
@@ -136,7 +203,30 @@ int buffRemove(buff_t * b, size_t data_size, int shrink) {
 	return 0;
 }
 
+/* Search the buffer for 'c', skipping the first 'scanned' bytes as they are already
+ * known not to contain it. If not found, 'scanned' is updated so the same data isn't
+ * searched again when more is added to the buffer. */
+char *buffFind(buff_t *b, char c, size_t *scanned) {
+	char *p;
+
+	if (*scanned >= b->used)
+		return NULL;
+
+	p = memchr(b->data + *scanned, c, b->used - *scanned);
+
+	if (p == NULL)
+		*scanned = b->used;
+
+	return p;
+}
+
 void buffClear(buff_t * b, size_t size) {
+	if (b->data) {
+		b->data -= b->consumed;
+		b->size += b->consumed;
+	}
+
+	b->consumed = 0;
 	b->used = 0;
 
 	if (size)
@@ -34,11 +34,17 @@
 
 #define BUFF_DEFAULT_SIZE 0x1000
 #define BUFF_USED_THRESHOLD 0x1000
+#define BUFF_COMPACT_THRESHOLD 0x10000
+
+/* 'data' always points to the first unconsumed byte and 'size' is the space available from there.
+ * Data removed from the front of the buffer just advances 'data', with the 'consumed' bytes
+ * before it only being reclaimed when the buffer needs the space, or enough has built up. */
 
 typedef struct buff_t {
 	char * data;
 	size_t size;
 	size_t used;
+	size_t consumed;
 } buff_t;
 
 int  buffNew(buff_t * b, size_t initial_size);
@@ -46,10 +52,13 @@ void buffFree(buff_t * b);
 void buffClear(buff_t * b, size_t size);
 
 int buffResize(buff_t * b, size_t length);
+void buffCompact(buff_t * b);
 void buffShrink(buff_t * b, size_t min_size);
 
 int buffAdd(buff_t * b, const char * new_data, size_t data_size);
 int buffAddBuff(buff_t *b, buff_t *new_data);
+int buffPrintf(buff_t * b, const char * fmt, ...) __attribute__((format(printf, 2, 3)));
 int buffRemove(buff_t * b, size_t data_size, int shrink);
+char *buffFind(buff_t *b, char c, size_t *scanned);
 
 #endif
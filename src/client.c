@@ -35,8 +35,13 @@
 
 #include "client.h"
 #include "logging.h"
+#include "io.h"
+#include "uring.h"
+
+#include <utlist.h>
 
 client * clientList = NULL;
+client * clientReadyList = NULL;
 
 void addClient(client * c) {
 	if (clientList) {
@@ -56,6 +61,25 @@ void removeClient(client * c) {
 
 	if (c == clientList)
 		clientList = c->next;
+
+	clearClientReady(c);
+}
+
+/* Queue a client that has a complete request to be processed */
+void setClientReady(client *c) {
+	if (c->ready)
+		return;
+
+	DL_APPEND2(clientReadyList, c, ready_prev, ready_next);
+	c->ready = 1;
+}
+
+void clearClientReady(client *c) {
+	if (!c->ready)
+		return;
+
+	DL_DELETE2(clientReadyList, c, ready_prev, ready_next);
+	c->ready = 0;
 }
 
 /* Accept a new client connection, adding to our existing list of clients and adding it
@@ -99,8 +123,8 @@ int handleClientConnection(struct connectionType * conn) {
 
 	addClient(c);
 
-	/* Add this client to our event polling */
-	if (pollSetReadable(&c->connection) != 0) {
+	/* Add this client to our event polling, or pass it to an I/O thread */
+	if ((ioThreadCount ? ioAddClient(c) : pollSetReadable(&c->connection)) != 0) {
 		print_msg(JERS_LOG_WARNING, "Failed to set client as readable: %s", strerror(errno));
 		handleClientDisconnect(c);
 		return 1;
@@ -110,13 +134,19 @@ int handleClientConnection(struct connectionType * conn) {
 }
 
 int handleClientDisconnect(client * c) {
-	/* Stop receiving events for this socket */
-	if (pollRemoveSocket(&c->connection) != 0)
-		fprintf(stderr, "Failed to remove event for disconnected client");
+	if (c->io == NULL) {
+		/* Stop receiving events for this socket */
+		if (pollRemoveSocket(&c->connection) != 0)
+			fprintf(stderr, "Failed to remove event for disconnected client");
+
+		close(c->connection.socket);
+		buffFree(&c->request);
+	} else {
+		cancelWrite(&c->connection);
+		cancelHeldOutput(&c->connection);
+	}
 
-	close(c->connection.socket);
 	buffFree(&c->response);
-	buffFree(&c->request);
 
 	if (c->blocking.data) {
 		if (c->blocking.free_callback)
@@ -126,18 +156,29 @@ int handleClientDisconnect(client * c) {
 	}
 
 	removeClient(c);
-	free(c);
+
+	/* Freed once the I/O thread acknowledges the close */
+	if (c->io)
+		ioCloseClient(c);
+	else
+		free(c);
 
 	return 0 ;
 }
 
 /* Handle read activity on a client socket */
 int handleClientRead(client * c) {
-	int len = 0;
-
 	buffResize(&c->request, 0);
 
-	len = _recv(c->connection.socket, c->request.data + c->request.used, c->request.size - c->request.used);
+	/* Read along with everything else this iteration, see handleClientReadResult() */
+	if (uringActive() && uringQueueRecv(c->connection.socket, c->request.data + c->request.used, c->request.size - c->request.used, &c->connection) == 0)
+		return 0;
+
+	return handleClientReadResult(c, _recv(c->connection.socket, c->request.data + c->request.used, c->request.size - c->request.used));
+}
+
+/* Process the result of reading into the end of the request buffer */
+int handleClientReadResult(client * c, ssize_t len) {
 	if (len < 0) {
  		if ((errno == EAGAIN || errno == EWOULDBLOCK))
 			return 0;
@@ -156,28 +197,59 @@ int handleClientRead(client * c) {
 	 * reader, so we can try to parse this request */
 	c->request.used += len;
 
+	/* Only the newly read data needs to be checked for the end of a request */
+	if (!c->ready && buffFind(&c->request, '\n', &c->request_scanned))
+		setClientReady(c);
+
 	return 0;
 }
 
 int handleClientWrite(client * c) {
-	int len = 0;
+	if (c->io) {
+		ioSendResponse(c);
+		return 0;
+	}
+
+	/* Anything held for group commit is left for later */
+	size_t len = c->response.used - heldOutput(&c->connection) - c->response_sent;
+
+	if (len == 0)
+		return handleClientWriteResult(c, 0);
 
-	len = _send(c->connection.socket, c->response.data + c->response_sent, c->response.used - c->response_sent);
+	if (uringActive() && uringQueueSend(c->connection.socket, c->response.data + c->response_sent, len, &c->connection) == 0)
+		return 0;
 
+	return handleClientWriteResult(c, _send(c->connection.socket, c->response.data + c->response_sent, len));
+}
+
+/* Process the result of sending from the response buffer */
+int handleClientWriteResult(client * c, ssize_t len) {
 	if (len == -1) {
-		print_msg(JERS_LOG_WARNING, "send to client failed: %s", strerror(errno));
-		handleClientDisconnect(c);
-		return 1;
+		if (errno != EAGAIN && errno != EWOULDBLOCK) {
+			print_msg(JERS_LOG_WARNING, "send to client failed: %s", strerror(errno));
+			handleClientDisconnect(c);
+			return 1;
+		}
+
+		len = 0;
 	}
 
 	c->response_sent += len;
 
 	/* If we have sent all our data, remove EPOLLOUT
 	 * from the event. Leave readable on, as we might read another request
-	 * from the client, or process their disconnect */
+	 * from the client, or process their disconnect.
+	 * Otherwise wait for the socket to become writable to send the rest */
 	if (c->response_sent == c->response.used) {
 		pollSetReadable(&c->connection);
 		c->response_sent = c->response.used = 0;
+	} else if (c->response_sent + heldOutput(&c->connection) == c->response.used) {
+		/* The rest is held until its journal records are flushed */
+		pollSetReadable(&c->connection);
+		buffRemove(&c->response, c->response_sent, 0);
+		c->response_sent = 0;
+	} else {
+		pollSetWritable(&c->connection);
 	}
 
 	return 0;
@@ -40,12 +40,15 @@
 #include "buffer.h"
 #include "fields.h"
 
+struct ioThread;
+
 typedef struct _client {
 	struct connectionType connection;
 
 	msg_t msg;
 
 	buff_t request;
+	size_t request_scanned;   // Bytes at the start of 'request' known not to contain a newline
 	buff_t response;
 	size_t response_sent;
 
@@ -62,16 +65,36 @@ typedef struct _client {
 
 	struct _client * next;
 	struct _client * prev;
+
+	/* Clients with at least one complete request to process */
+	int ready;
+	struct _client * ready_next;
+	struct _client * ready_prev;
+
+	/* Set if the socket is handled by an I/O thread. The request buffer and
+	 * these fields then belong to that thread */
+	struct ioThread * io;
+	int io_closing;
+	buff_t io_output;
+	size_t io_output_sent;
+
+	/* Main thread - Closed, waiting for the I/O thread to acknowledge it */
+	int io_closed;
 } client;
 
 extern client *clientList;
+extern client *clientReadyList;
 
 int handleClientConnection(struct connectionType * connection);
 int handleClientDisconnect(client *c);
 int handleClientRead(client *c);
+int handleClientReadResult(client *c, ssize_t len);
 int handleClientWrite(client *c);
+int handleClientWriteResult(client *c, ssize_t len);
 
 void addClient(client *c);
 void removeClient(client *c);
+void setClientReady(client *c);
+void clearClientReady(client *c);
 
 #endif
\ No newline at end of file
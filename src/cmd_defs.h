@@ -17,6 +17,7 @@
 #define CMD_STATS "STATS"
 #define CMD_GET_AGENT "AGENT_GET"
 #define CMD_CLEAR_CACHE "CLEAR_CACHE"
+#define CMD_CHECKPOINT "CHECKPOINT"
 
 #define AGENT_JOB_STARTED    "JOB_STARTED"
 #define AGENT_JOB_COMPLETED  "JOB_COMPLETED"
@@ -249,6 +249,9 @@ int command_agent_recon(agent * a, msg_t * msg) {
 
 	a->recon = 0;
 
+	/* Jobs on this agent's queues can now be started */
+	requestSchedule();
+
 	return 0;
 }
 
@@ -359,6 +362,9 @@ int command_agent_jobcompleted(agent * a, msg_t * msg) {
 		print_msg(JERS_LOG_WARNING, "Got completion (status:%d) for job without start: %d", j->exitcode, jobid);
 	}
 
+	/* The queue slot and any resources are now free */
+	requestSchedule();
+
 	if (exitcode)
 		server.stats.total.exited++;
 	else
@@ -454,6 +460,9 @@ int command_agent_proxydata(agent *a, msg_t *msg) {
 	buffAdd(&c->request, data, strlen(data));
 	free(data);
 
+	if (!c->ready && buffFind(&c->request, '\n', &c->request_scanned))
+		setClientReady(c);
+
 	return 0;
 }
 
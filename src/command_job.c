@@ -353,8 +353,10 @@ void serialize_jersJob(buff_t *b, struct job *j, int fields) {
 	JSONAddInt(b, EXITCODE, j->exitcode);
 	JSONAddInt(b, SIGNAL, j->signal);
 
-	if (j->pend_reason)
-		JSONAddInt(b, PENDREASON, j->pend_reason);
+	int pend_reason = getPendReason(j);
+
+	if (pend_reason)
+		JSONAddInt(b, PENDREASON, pend_reason);
 
 	if (j->fail_reason)
 		JSONAddInt(b, FAILREASON, j->fail_reason);
@@ -846,6 +848,7 @@ int command_mod_job(client *c, void *args) {
 
 	if (mj->priority != UNSET_32) {
 		j->priority = mj->priority;
+		updateCandidate(j);
 
 		dirty = 1;
 	}
@@ -920,6 +923,12 @@ int command_mod_job(client *c, void *args) {
 		dirty = 1;
 	}
 
+	/* The job may be waiting on a resource it no longer requires */
+	if (j->waiting_res) {
+		removeCandidate(j);
+		addCandidate(j);
+	}
+
 	/* Need to clear some fields if this job has previously been completed */
 	if (completed) {
 		if (mj->restart == 1) {
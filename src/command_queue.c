@@ -151,7 +151,13 @@ int command_add_queue(client * c, void * args) {
 			free(q->name);
 			free(q->desc);
 			free(q->host);
+			heapFree(&q->pending);
+
+			/* It might still be on the dirty list waiting to be saved */
+			jers_object obj = q->obj;
 			memset(q, 0, sizeof(struct queue));
+			q->obj.dirty = obj.dirty;
+			q->obj.dirty_next = obj.dirty_next;
 		}
 	} else {
 		q = calloc(sizeof(struct queue), 1);
@@ -347,8 +353,13 @@ int command_mod_queue(client *c, void * args) {
 		dirty = 1;
 	}
 
+	/* A started queue, higher limit or different agent may allow jobs to start */
+	if (qm->node || qm->state != UNSET_32 || qm->job_limit != UNSET_32)
+		requestSchedule();
+
 	if (qm->priority != UNSET_32 && q->priority != qm->priority) {
 		q->priority = qm->priority;
+		resortResourceWaiters();
 		dirty = 1;
 	}
 
@@ -406,6 +417,7 @@ int command_del_queue(client *c, void *args) {
 	}
 
 	q->internal_state |= JERS_FLAG_DELETED;
+	stateDelQueue(q);
 
 	return sendClientReturnCode(c, NULL, "0");
 }
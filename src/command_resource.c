@@ -131,6 +131,7 @@ int command_add_resource(client *c, void *args) {
 		/* We have a deleted version of this resource. Free the old name and reuse the resource */
 		HASH_DEL(server.resTable, r);
 		free(r->name);
+		heapFree(&r->waiting);
 		r->internal_state &= ~JERS_FLAG_DELETED;
 	} else {
 		r = calloc(sizeof(struct resource), 1);
@@ -210,6 +211,10 @@ int command_mod_resource(client *c, void *args) {
 	r->count = rm->count;
 	updateObject(&r->obj, 1);
 
+	/* Any increase can go straight to the jobs waiting on it */
+	wakeResourceWaiters(r);
+	requestSchedule();
+
 	return sendClientReturnCode(c, &r->obj, "0");
 }
 
@@ -248,8 +253,9 @@ int command_del_resource(client *c, void *args) {
 		}
 	}
 
-	/* Mark it as deleted and dirty. It will be cleaned up later */
+	/* Mark it as deleted. It will be cleaned up later */
 	r->internal_state |= JERS_FLAG_DELETED;
+	stateDelResource(r);
 
 	return sendClientReturnCode(c, NULL, "0");
 }
@@ -69,6 +69,7 @@ command_t commands[] = {
 	{CMD_GET_AGENT,    PERM_READ,             0,             command_get_agent,    deserialize_get_agent, free_get_agent},
 	{CMD_STATS,        PERM_READ,             0,             command_stats,        NULL, NULL},
 	{CMD_CLEAR_CACHE,  0,                     0,             command_clearcache,   NULL, NULL},
+	{CMD_CHECKPOINT,   PERM_WRITE,            0,             command_checkpoint,   NULL, NULL},
 };
 
 agent_command_t agent_commands[] = {
@@ -171,6 +172,7 @@ int runCommand(client *c) {
 			switch (server.readonly) {
 				case READONLY_ENOSPACE: errmsg = "JERS is in READONLY mode. - Check disk space"; break;
 				case READONLY_BGSAVE: errmsg = "JERS is in READONLY mode. - Check jersd logfile - Save failed"; break;
+				case READONLY_JOURNAL: errmsg = "JERS is in READONLY mode. - Check jersd logfile - Journal write failed"; break;
 			}
 
 			sendError(c, JERS_ERR_READONLY, errmsg);
@@ -266,7 +268,10 @@ static int _sendMessage(struct connectionType *connection, buff_t *b, buff_t *me
 
 	} else {
 		buffAddBuff(b, message);
-		pollSetWritable(connection);
+		queueWrite(connection);
+
+		if (server.flush.group)
+			holdOutput(connection, message->used);
 	}
 	buffFree(message);
 
@@ -501,6 +506,20 @@ int command_clearcache(client * c, void * args) {
 	return sendClientReturnCode(c, NULL, "0");
 }
 
+/* Start a checkpoint. The client isn't held until it's done, the outcome is logged */
+int command_checkpoint(client * c, void * args) {
+	UNUSED(args);
+
+	if (stateCheckpoint() != 0) {
+		sendError(c, JERS_ERR_INVSTATE, "Saving is disabled");
+		return 1;
+	}
+
+	print_msg_info("Checkpoint requested by uid %d", c->uid);
+
+	return sendClientReturnCode(c, NULL, "0");
+}
+
 /* Load a users permissions based on groups in the config file */
 static void loadPermissions(struct user * u) {
 	u->permissions = 0;
@@ -87,6 +87,7 @@ int command_del_tag(client *, void *);
 
 int command_get_agent(client *, void *);
 int command_clearcache(client *, void *);
+int command_checkpoint(client *, void *);
 
 
 void* deserialize_add_job(msg_t *);
@@ -854,6 +854,144 @@ void listSort(struct item_list *list, int (*compar)(const void *, const void *,
 	qsort_r(list->items, list->count, list->item_size, compar, arg);
 }
 
+/* Binary heap of pointers, with the 'smallest' item (as defined by cmp) at the top.
+ * If an index_offset is provided, each item has its position in the heap (+1) stored
+ * at that offset, which allows an arbitrary item to be removed or reordered in O(log n).
+ * A stored index of 0 signifies the item is not in a heap. */
+
+#define HEAP_SET_INDEX(_h, _i) do { \
+	if ((_h)->index_offset != HEAP_NO_INDEX) \
+		*(size_t *)((char *)(_h)->items[_i] + (_h)->index_offset) = (_i) + 1; \
+} while (0)
+
+#define HEAP_GET_INDEX(_h, _item) (*(size_t *)((char *)(_item) + (_h)->index_offset))
+
+static void heapSwap(struct heap *h, size_t a, size_t b) {
+	void *tmp = h->items[a];
+	h->items[a] = h->items[b];
+	h->items[b] = tmp;
+
+	HEAP_SET_INDEX(h, a);
+	HEAP_SET_INDEX(h, b);
+}
+
+static size_t heapSiftUp(struct heap *h, size_t pos) {
+	while (pos > 0) {
+		size_t parent = (pos - 1) / 2;
+
+		if (h->cmp(h->items[pos], h->items[parent]) >= 0)
+			break;
+
+		heapSwap(h, pos, parent);
+		pos = parent;
+	}
+
+	return pos;
+}
+
+static void heapSiftDown(struct heap *h, size_t pos) {
+	while (1) {
+		size_t smallest = pos;
+		size_t left = (pos * 2) + 1;
+		size_t right = left + 1;
+
+		if (left < h->count && h->cmp(h->items[left], h->items[smallest]) < 0)
+			smallest = left;
+
+		if (right < h->count && h->cmp(h->items[right], h->items[smallest]) < 0)
+			smallest = right;
+
+		if (smallest == pos)
+			break;
+
+		heapSwap(h, pos, smallest);
+		pos = smallest;
+	}
+}
+
+void heapNew(struct heap *h, int (*cmp)(const void *, const void *), size_t index_offset) {
+	memset(h, 0, sizeof(struct heap));
+	h->cmp = cmp;
+	h->index_offset = index_offset;
+}
+
+/* Note: The items themselves are not touched, so may already have been freed */
+void heapFree(struct heap *h) {
+	free(h->items);
+	h->items = NULL;
+	h->size = h->count = 0;
+}
+
+int heapAdd(struct heap *h, void *item) {
+	if (h->count == h->size) {
+		size_t new_size = h->size == 0 ? DEFAULT_ITEM_SIZE : (h->size * 2);
+		void **new_items = realloc(h->items, new_size * sizeof(void *));
+
+		if (new_items == NULL)
+			return 1;
+
+		h->items = new_items;
+		h->size = new_size;
+	}
+
+	h->items[h->count] = item;
+	HEAP_SET_INDEX(h, h->count);
+	heapSiftUp(h, h->count++);
+
+	return 0;
+}
+
+/* Remove the item at position 'pos' in the heap */
+static void heapRemoveAt(struct heap *h, size_t pos) {
+	if (h->index_offset != HEAP_NO_INDEX)
+		HEAP_GET_INDEX(h, h->items[pos]) = 0;
+
+	if (pos != --h->count) {
+		h->items[pos] = h->items[h->count];
+		HEAP_SET_INDEX(h, pos);
+
+		if (heapSiftUp(h, pos) == pos)
+			heapSiftDown(h, pos);
+	}
+}
+
+void *heapPop(struct heap *h) {
+	if (h->count == 0)
+		return NULL;
+
+	void *item = h->items[0];
+	heapRemoveAt(h, 0);
+
+	return item;
+}
+
+/* Remove an item from the heap. Requires the heap to be tracking indexes */
+void heapRemove(struct heap *h, void *item) {
+	size_t index = HEAP_GET_INDEX(h, item);
+
+	if (index == 0 || index > h->count || h->items[index - 1] != item)
+		return;
+
+	heapRemoveAt(h, index - 1);
+}
+
+/* Restore the heap ordering after an items key has been changed */
+void heapUpdate(struct heap *h, void *item) {
+	size_t index = HEAP_GET_INDEX(h, item);
+
+	if (index == 0 || index > h->count || h->items[index - 1] != item)
+		return;
+
+	if (heapSiftUp(h, index - 1) == index - 1)
+		heapSiftDown(h, index - 1);
+}
+
+/* Restore the heap ordering after the keys of any number of items have changed */
+void heapRebuild(struct heap *h) {
+	for (size_t i = h->count / 2; i > 0; i--)
+		heapSiftDown(h, i - 1);
+}
+
 /* Return a key/value from the provided line
  * 'line' is modified and the pointers returned should not be freed */
 
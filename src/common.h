@@ -164,4 +164,24 @@ void listSort(struct item_list *list, int (*compar)(const void *, const void *,
 
 #define LIST_ITER(_list, _ptr) for (((_ptr) = (_list)->items); (void *)(_ptr) < (_list)->end; (_ptr) = (void *) ((char *)(_ptr) + (_list)->item_size))
 
+#define HEAP_NO_INDEX ((size_t)-1)
+
+struct heap {
+	size_t size;
+	size_t count;
+	void **items;
+	size_t index_offset;	// Offset of a size_t in each item to store its heap position, or HEAP_NO_INDEX
+	int (*cmp)(const void *, const void *);
+};
+
+void heapNew(struct heap *h, int (*cmp)(const void *, const void *), size_t index_offset);
+void heapFree(struct heap *h);
+int heapAdd(struct heap *h, void *item);
+void *heapPop(struct heap *h);
+void heapRemove(struct heap *h, void *item);
+void heapUpdate(struct heap *h, void *item);
+void heapRebuild(struct heap *h);
+
+#define heapPeek(_h) ((_h)->count ? (_h)->items[0] : NULL)
+
 #endif
@@ -36,6 +36,8 @@
 #include "server.h"
 #include "comms.h"
 
+#include <utlist.h>
+
 #include "client.h"
 #include "agent.h"
 #include "proxy.h"
@@ -100,6 +102,10 @@ int _accept(int sockfd) {
 int pollSetWritable(struct connectionType * connection) {
 	struct epoll_event ee;
 
+	/* Already waiting to write, ie. Multiple responses queued in one iteration */
+	if (connection->events & EPOLLOUT)
+		return 0;
+
 	int action = connection->events == 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
 	ee.events = connection->events | EPOLLOUT;
 	ee.data.ptr = connection;
@@ -117,6 +123,10 @@ int pollSetWritable(struct connectionType * connection) {
 int pollSetReadable(struct connectionType * connection) {
 	struct epoll_event ee;
 
+	/* Nothing to change */
+	if (connection->events == EPOLLIN)
+		return 0;
+
 	int action = connection->events == 0 ? EPOLL_CTL_ADD: EPOLL_CTL_MOD;
 
 	ee.events = EPOLLIN;
@@ -135,12 +145,93 @@ int pollSetReadable(struct connectionType * connection) {
 int pollRemoveSocket(struct connectionType * connection) {
 	struct epoll_event ee = {0};
 
+	cancelWrite(connection);
+	cancelHeldOutput(connection);
+
 	if (epoll_ctl(connection->event_fd, EPOLL_CTL_DEL, connection->socket, &ee))
 		return -1;
 
 	return 0;
 }
 
+/* Connections with output waiting to be sent.
+ * Rather than registering for EPOLLOUT on every response, the output is written
+ * directly once all the requests for this iteration have been processed.
+ * EPOLLOUT is only used if the socket can't take everything straight away. */
+
+struct connectionType *writeQueue = NULL;
+
+void queueWrite(struct connectionType * connection) {
+	if (connection->write_queued || connection->socket < 0)
+		return;
+
+	connection->write_queued = 1;
+	DL_APPEND2(writeQueue, connection, write_prev, write_next);
+}
+
+void cancelWrite(struct connectionType * connection) {
+	if (!connection->write_queued)
+		return;
+
+	connection->write_queued = 0;
+	DL_DELETE2(writeQueue, connection, write_prev, write_next);
+}
+
+/* Group commit - Output is held until the journal records generated before it have been flushed.
+ * Only the trailing bytes of each connections output buffer are held, the
+ * senders stop short of them. */
+
+static struct connectionType *heldList = NULL;
+
+void holdOutput(struct connectionType * connection, size_t len) {
+	connection->held += len;
+
+	if (connection->held_listed)
+		return;
+
+	connection->held_listed = 1;
+	DL_APPEND2(heldList, connection, held_prev, held_next);
+}
+
+/* The pending records have been written and are being flushed, the output so far only depends on those */
+void commitHeldOutput(void) {
+	struct connectionType *connection;
+
+	DL_FOREACH2(heldList, connection, held_next) {
+		connection->held_commit += connection->held;
+		connection->held = 0;
+	}
+}
+
+/* The commit has reached the disk, send the output that was waiting on it */
+void releaseHeldOutput(void) {
+	struct connectionType *connection, *tmp;
+
+	DL_FOREACH_SAFE2(heldList, connection, tmp, held_next) {
+		if (connection->held_commit == 0)
+			continue;
+
+		connection->held_commit = 0;
+		queueWrite(connection);
+
+		if (connection->held == 0) {
+			connection->held_listed = 0;
+			DL_DELETE2(heldList, connection, held_prev, held_next);
+		}
+	}
+}
+
+/* The connection has gone away along with its output */
+void cancelHeldOutput(struct connectionType * connection) {
+	connection->held = connection->held_commit = 0;
+
+	if (!connection->held_listed)
+		return;
+
+	connection->held_listed = 0;
+	DL_DELETE2(heldList, connection, held_prev, held_next);
+}
+
 int createSocket(const char * path, int port, int perm) {
 	int fd = -1;
 	int enable = 1;
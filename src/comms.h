@@ -47,7 +47,9 @@ enum connectionTypes {
 	ACCT_CONN,
 	ACCT_CLIENT,
 	JOB_ADOPT_CONN,
-	JOB_ADOPT
+	JOB_ADOPT,
+	IO_NOTIFY,
+	SYNC_NOTIFY
 };
 
 struct connectionType {
@@ -61,14 +63,38 @@ struct connectionType {
 		void *agent;
 		pid_t pid;
 	} proxy;
+
+	/* Queued to have its pending output sent directly at the end of the event loop iteration */
+	int write_queued;
+	struct connectionType *write_next;
+	struct connectionType *write_prev;
+
+	/* Group commit - Trailing output that can't be sent until the journal records it depends on are on disk */
+	size_t held;         // Generated since the last commit
+	size_t held_commit;  // Covered by the commit currently being flushed
+	int held_listed;
+	struct connectionType *held_next;
+	struct connectionType *held_prev;
 };
 
+#define heldOutput(_c) ((_c)->held + (_c)->held_commit)
+
+extern struct connectionType *writeQueue;
+
 int createSocket(const char * path, int port, int perm);
 
 int pollSetReadable(struct connectionType * connection);
 int pollSetWritable(struct connectionType * connection);
 int pollRemoveSocket(struct connectionType * connection);
 
+void queueWrite(struct connectionType * connection);
+void cancelWrite(struct connectionType * connection);
+
+void holdOutput(struct connectionType * connection, size_t len);
+void commitHeldOutput(void);
+void releaseHeldOutput(void);
+void cancelHeldOutput(struct connectionType * connection);
+
 //void handleReadable(struct epoll_event * e);
 //void handleWriteable(struct epoll_event * e);
 
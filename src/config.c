@@ -41,6 +41,16 @@
 
 extern agent *agentList;
 
+/* Check if two paths refer to the same directory */
+static int sameDir(const char *a, const char *b) {
+	struct stat sa, sb;
+
+	if (stat(a, &sa) != 0 || stat(b, &sb) != 0)
+		return strcmp(a, b) == 0;
+
+	return sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+}
+
 static gid_t getGroup(char * name) {
 	struct group * g = getgrnam(name);
 
@@ -188,6 +198,7 @@ void loadQueueACL(char *in_acl) {
 
 void freeConfig(void) {
 	free(server.state_dir);
+	free(server.journal_archive_dir);
 	free(server.socket_path);
 	free(server.agent_socket_path);
 
@@ -217,12 +228,24 @@ void loadConfig(char * config) {
 	server.state_dir = strdup(DEFAULT_CONFIG_STATEDIR);
 	server.background_save_ms = DEFAULT_CONFIG_BACKGROUNDSAVEMS;
 	server.logging_mode = DEFAULT_CONFIG_LOGGINGMODE;
-	server.event_freq = DEFAULT_CONFIG_EVENTFREQ;
 	server.sched_freq = DEFAULT_CONFIG_SCHEDFREQ;
 	server.sched_max = DEFAULT_CONFIG_SCHEDMAX;
+	server.sched_mode = DEFAULT_CONFIG_SCHEDMODE;
 	server.max_run_jobs = DEFAULT_CONFIG_MAXJOBS;
 	server.max_cleanup = DEFAULT_CONFIG_MAXCLEAN;
 	server.max_jobid = DEFAULT_CONFIG_MAXJOBID;
+	server.client_budget = DEFAULT_CONFIG_CLIENTBUDGET;
+	server.io_threads = DEFAULT_CONFIG_IOTHREADS;
+	server.load_threads = DEFAULT_CONFIG_LOADTHREADS;
+	server.io_backend = DEFAULT_CONFIG_IOBACKEND;
+	server.journal_format = DEFAULT_CONFIG_JOURNALFORMAT;
+	server.state_format = DEFAULT_CONFIG_STATEFORMAT;
+	server.truncate_journals = DEFAULT_CONFIG_TRUNCATEJOURNALS;
+	server.save_mode = DEFAULT_CONFIG_SAVEMODE;
+	server.object_segment_size = (off_t)DEFAULT_CONFIG_OBJECTSEGMENTSIZE * 1024 * 1024;
+	server.journal_max_size = (off_t)DEFAULT_CONFIG_JOURNALMAXSIZE * 1024 * 1024;
+	server.checkpoint_interval = DEFAULT_CONFIG_CHECKPOINTINTERVAL;
+	server.journal_archive_days = DEFAULT_CONFIG_JOURNALARCHIVEDAYS;
 	server.socket_path = strdup(DEFAULT_CONFIG_SOCKETPATH);
 	server.agent_socket_path = strdup(DEFAULT_CONFIG_AGENTSOCKETPATH);
 	server.acct_socket_path = strdup(DEFAULT_CONFIG_ACCTSOCKETPATH);
@@ -231,6 +254,7 @@ void loadConfig(char * config) {
 
 	server.flush.defer = DEFAULT_CONFIG_FLUSHDEFER;
 	server.flush.defer_ms = DEFAULT_CONFIG_FLUSHDEFERMS;
+	server.flush.group_ms = DEFAULT_CONFIG_FLUSHGROUPMS;
 
 	server.email_freq_ms = DEFAULT_CONFIG_EMAIL_FREQ;
 
@@ -257,18 +281,90 @@ void loadConfig(char * config) {
 			free(server.state_dir);
 			server.state_dir = strdup(value);
 		} else if (strcmp(key, "flush_defer") == 0) {
+			server.flush.defer = 0;
+			server.flush.group = 0;
+
 			if (strcasecmp(value, "yes") == 0)
 				server.flush.defer = 1;
+			else if (strcasecmp(value, "group") == 0)
+				server.flush.group = 1;
+		} else if (strcmp(key, "journal_format") == 0) {
+			if (strcasecmp(value, "binary") == 0)
+				server.journal_format = JOURNAL_FORMAT_BINARY;
+			else if (strcasecmp(value, "text") == 0)
+				server.journal_format = JOURNAL_FORMAT_TEXT;
+			else
+				print_msg(JERS_LOG_WARNING, "Unknown journal_format '%s' specified in config file. Defaulting to 'text'", value);
+		} else if (strcmp(key, "state_format") == 0) {
+			if (strcasecmp(value, "snapshot") == 0)
+				server.state_format = STATE_FORMAT_SNAPSHOT;
+			else if (strcasecmp(value, "log") == 0)
+				server.state_format = STATE_FORMAT_LOG;
+			else if (strcasecmp(value, "directory") == 0)
+				server.state_format = STATE_FORMAT_DIRECTORY;
 			else
-				server.flush.defer = 0;
+				print_msg(JERS_LOG_WARNING, "Unknown state_format '%s' specified in config file. Defaulting to 'directory'", value);
+		} else if (strcmp(key, "truncate_journals") == 0) {
+			server.truncate_journals = strcasecmp(value, "yes") == 0;
+		} else if (strcmp(key, "save_mode") == 0) {
+			if (strcasecmp(value, "thread") == 0)
+				server.save_mode = SAVE_MODE_THREAD;
+			else if (strcasecmp(value, "fork") == 0)
+				server.save_mode = SAVE_MODE_FORK;
+			else
+				print_msg(JERS_LOG_WARNING, "Unknown save_mode '%s' specified in config file. Defaulting to 'fork'", value);
+		} else if (strcmp(key, "journal_max_size") == 0) {
+			server.journal_max_size = (off_t)atoi(value) * 1024 * 1024;
+
+			if (server.journal_max_size < 0)
+				server.journal_max_size = 0;
+		} else if (strcmp(key, "checkpoint_interval") == 0) {
+			server.checkpoint_interval = atoi(value);
+
+			if (server.checkpoint_interval < 0)
+				server.checkpoint_interval = 0;
+		} else if (strcmp(key, "journal_archive_dir") == 0) {
+			free(server.journal_archive_dir);
+			server.journal_archive_dir = strdup(value);
+		} else if (strcmp(key, "journal_archive_days") == 0) {
+			server.journal_archive_days = atoi(value);
+
+			if (server.journal_archive_days < 0)
+				server.journal_archive_days = 0;
+		} else if (strcmp(key, "journal_extend_size") == 0) {
+			server.journal.extend_block_size = (off_t)atoi(value) * 1024;
+
+			if (server.journal.extend_block_size < 65536) {
+				print_msg(JERS_LOG_WARNING, "journal_extend_size '%s' is below the minimum of 64. Using the minimum", value);
+				server.journal.extend_block_size = 65536;
+			}
+		} else if (strcmp(key, "object_segment_size") == 0) {
+			server.object_segment_size = (off_t)atoi(value) * 1024 * 1024;
+
+			if (server.object_segment_size <= 0) {
+				print_msg(JERS_LOG_WARNING, "Invalid object_segment_size '%s' specified in config file. Defaulting to %d", value, DEFAULT_CONFIG_OBJECTSEGMENTSIZE);
+				server.object_segment_size = (off_t)DEFAULT_CONFIG_OBJECTSEGMENTSIZE * 1024 * 1024;
+			}
 		} else if (strcmp(key, "flush_defer_ms") == 0) {
 			server.flush.defer_ms = atoi(value);
+		} else if (strcmp(key, "flush_group_ms") == 0) {
+			server.flush.group_ms = atoi(value);
+
+			if (server.flush.group_ms < 0)
+				server.flush.group_ms = 0;
 		} else if (strcmp(key, "background_save_ms") == 0) {
 			server.background_save_ms = atoi(value);
 		} else if (strcmp(key, "event_freq") == 0) {
-			server.event_freq = atoi(value);
+			/* No longer used - The event loop sleeps until the next timed event is due */
 		} else if (strcmp(key, "sched_freq") == 0) {
 			server.sched_freq = atoi(value);
+		} else if (strcmp(key, "sched_mode") == 0) {
+			if (strcasecmp(value, "event") == 0)
+				server.sched_mode = SCHED_MODE_EVENT;
+			else if (strcasecmp(value, "poll") == 0)
+				server.sched_mode = SCHED_MODE_POLL;
+			else
+				print_msg(JERS_LOG_WARNING, "Unknown sched_mode '%s' specified in config file. Defaulting to 'poll'", value);
 		} else if (strcmp(key, "sched_max") == 0) {
 			server.sched_max = atoi(value);
 		} else if (strcmp(key, "max_system_jobs") == 0) {
@@ -277,6 +373,34 @@ void loadConfig(char * config) {
 			server.max_jobid = atoi(value);
 		} else if (strcmp(key, "max_clean_job") == 0) {
 			server.max_cleanup = atoi(value);
+		} else if (strcmp(key, "client_request_budget") == 0) {
+			server.client_budget = atoi(value);
+
+			if (server.client_budget <= 0) {
+				print_msg(JERS_LOG_WARNING, "Invalid client_request_budget '%s' specified in config file. Defaulting to %d", value, DEFAULT_CONFIG_CLIENTBUDGET);
+				server.client_budget = DEFAULT_CONFIG_CLIENTBUDGET;
+			}
+		} else if (strcmp(key, "io_threads") == 0) {
+			server.io_threads = atoi(value);
+
+			if (server.io_threads < 0 || server.io_threads > MAX_IO_THREADS) {
+				print_msg(JERS_LOG_WARNING, "Invalid io_threads '%s' specified in config file. Must be between 0 and %d - Defaulting to %d", value, MAX_IO_THREADS, DEFAULT_CONFIG_IOTHREADS);
+				server.io_threads = DEFAULT_CONFIG_IOTHREADS;
+			}
+		} else if (strcmp(key, "load_threads") == 0) {
+			server.load_threads = atoi(value);
+
+			if (server.load_threads < 0 || server.load_threads > MAX_LOAD_THREADS) {
+				print_msg(JERS_LOG_WARNING, "Invalid load_threads '%s' specified in config file. Must be between 0 and %d - Defaulting to %d", value, MAX_LOAD_THREADS, DEFAULT_CONFIG_LOADTHREADS);
+				server.load_threads = DEFAULT_CONFIG_LOADTHREADS;
+			}
+		} else if (strcmp(key, "io_backend") == 0) {
+			if (strcasecmp(value, "io_uring") == 0)
+				server.io_backend = IO_BACKEND_URING;
+			else if (strcasecmp(value, "epoll") == 0)
+				server.io_backend = IO_BACKEND_EPOLL;
+			else
+				print_msg(JERS_LOG_WARNING, "Unknown io_backend '%s' specified in config file. Defaulting to 'epoll'", value);
 		} else if (strcmp(key, "client_listen_socket") == 0) {
 			free(server.socket_path);
 			server.socket_path = strdup(value);
@@ -370,6 +494,17 @@ void loadConfig(char * config) {
 		print_msg(JERS_LOG_WARNING, "No agents in config file. Only allowing an agent from localhost");
 	}
 
+	/* A threaded save formats everything it writes on the main thread first,
+	 * which for a snapshot is every object */
+	if (server.save_mode == SAVE_MODE_THREAD && server.state_format == STATE_FORMAT_SNAPSHOT) {
+		print_msg(JERS_LOG_WARNING, "save_mode 'thread' is not supported with state_format 'snapshot'. Defaulting to 'fork'");
+		server.save_mode = SAVE_MODE_FORK;
+	}
+
+	/* The archives are named journal.<datetime>.gz, so they would be taken for journals */
+	if (server.journal_archive_dir && server.state_dir && sameDir(server.journal_archive_dir, server.state_dir))
+		error_die("journal_archive_dir can't be the state directory %s", server.state_dir);
+
 	/* Sort the loaded queue ACLs */
 	if (server.queue_acls.count != 0)
 		listSort(&server.queue_acls, cmp_queue_acl, NULL);
@@ -31,6 +31,10 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
 
 #include "client.h"
 #include "agent.h"
@@ -42,21 +46,44 @@
 struct event {
 	void (*func)(void);
 	int interval;    // Milliseconds between event triggering
-	int64_t last_fire;
+	int64_t next_fire;
+	size_t heap_index;
 	struct event * next;
 };
 
 struct event * eventList = NULL;
 
+/* Timed events, ordered by when they are next due to fire */
+static struct heap eventHeap;
+
+static int eventCompare(const void *a_, const void *b_) {
+	const struct event *a = a_;
+	const struct event *b = b_;
+
+	if (a->next_fire == b->next_fire)
+		return 0;
+
+	return a->next_fire < b->next_fire ? -1 : 1;
+}
+
 void registerEvent(void(*func)(void), int interval) {
 	struct event * e = calloc(sizeof(struct event), 1);
 
+	if (eventHeap.cmp == NULL)
+		heapNew(&eventHeap, eventCompare, offsetof(struct event, heap_index));
+
+	/* Events fire on the first check, then every 'interval' milliseconds */
 	e->func = func;
-	e->interval = interval;
+	e->interval = interval > 0 ? interval : 1;
+	e->next_fire = 0;
 
 	/* Add it to the linked list of events */
 	e->next = eventList;
 	eventList = e;
+
+	if (heapAdd(&eventHeap, e) != 0)
+		error_die("Failed to register event: %s", strerror(errno));
+
 	return;
 }
 
@@ -68,6 +95,9 @@ void freeEvents(void) {
 		free(e);
 		e = next;
 	}
+
+	eventList = NULL;
+	heapFree(&eventHeap);
 }
 
 void checkBlockingClientEvent(void) {
@@ -93,53 +123,69 @@ void checkBlockingClientEvent(void) {
 }
 
 void checkClientEvent(void) {
-	client * c = clientList;
+	client * c;
+	client * last = clientReadyList ? clientReadyList->ready_prev : NULL;
+
+	/* Run the pipelined requests for each of the clients that have a complete request,
+	 * up to client_budget requests per client so a single client streaming requests
+	 * can't starve everyone else. The responses are accumulated in the clients
+	 * response buffer and sent together once the socket is writable.
+	 * Clients with requests left over will be checked again next iteration. */
+
+	while ((c = clientReadyList) != NULL) {
+		int done = (c == last);
+		int disconnected = 0;
+		size_t consumed = 0;
+		char *p = c->request.data;
 
-	/* Check the connected clients for commands to action,
-	 * we can limit the amount of time we spend running command here. */
+		clearClientReady(c);
 
-	while (c) {
-		if (c->request.used == 0) {
-			c = c->next;
-			continue;
-		}
+		for (int i = 0; i < server.client_budget; i++) {
+			char *nl = buffFind(&c->request, '\n', &c->request_scanned);
 
-		/* Check if the client has a full request to process */
-		char *nl = memchr(c->request.data, '\n', c->request.used);
+			if (nl == NULL)
+				break;
 
-		if (nl == NULL) {
-			c = c->next;
-			continue;
-		}
+			*nl = '\0';
+			nl++;
+
+			if (load_message(p, &c->msg)) {
+				print_msg(JERS_LOG_WARNING, "Failed to load client request, disconnecting them.");
+				handleClientDisconnect(c);
+				disconnected = 1;
+				break;
+			}
 
-		*nl = '\0';
-		nl++;
+			runCommand(c);
 
-		if (load_message(c->request.data, &c->msg)) {
-			client * c_next = c->next;
-			print_msg(JERS_LOG_WARNING, "Failed to load client request, disconnecting them.");
-			handleClientDisconnect(c);
-			c = c_next;
-			continue;
+			consumed += nl - p;
+			c->request_scanned = consumed;
+			p = nl;
 		}
 
-		runCommand(c);
+		if (!disconnected && consumed) {
+			/* Remove the used data from the clients request stream */
+			buffRemove(&c->request, consumed, 0);
+			c->request_scanned = 0;
 
-		/* Remove the used data from the clients request stream */
-		buffRemove(&c->request, (size_t)(nl - c->request.data), 0);
+			if (buffFind(&c->request, '\n', &c->request_scanned))
+				setClientReady(c);
+		}
 
-		c = c->next;
+		if (done)
+			break;
 	}
 }
 
 void checkAgentEvent(void) {
-	agent * a = agentList;
+	agent * a;
 
-	while (a) {
-		agent * a_next = a->next;
+	while ((a = agentReadyList) != NULL) {
 		size_t consumed = 0;
 		char *p = a->requests.data;
 
+		clearAgentReady(a);
+
 		while (1) {
 			char *nl = memchr(p, '\n', a->requests.used - consumed);
 
@@ -154,23 +200,31 @@ void checkAgentEvent(void) {
 			if (load_message(p, &a->msg)) {
 				print_msg(JERS_LOG_WARNING, "Failed to load agent message - Disconnecting them");
 				handleAgentDisconnect(a);
+				consumed = 0;
 				break;
 			}
 
-			if (runAgentCommand(a) != 0)
-				break;
+			runAgentCommand(a);
 
 			consumed += request_len;
 			p += request_len;
 		}
 
-		if (consumed)
+		if (consumed) {
 			buffRemove(&a->requests, consumed, 0);
 
-		a = a_next;
+			/* Whatever is left is an incomplete message */
+			a->requests_scanned = a->requests.used;
+		}
 	}
 }
 
+/* Process the requests read from our clients and agents since the last check */
+void processRequests(void) {
+	checkAgentEvent();
+	checkClientEvent();
+}
+
 void checkAcctEvent(void) {
 	acctClient *a = acctClientList;
 
@@ -199,10 +253,6 @@ void checkAcctEvent(void) {
 
 }
 
-void checkDeferEvent(void) {
-	releaseDeferred();
-}
-
 void flushEvent(void) {
 	flush_journal(0);
 }
@@ -216,7 +266,7 @@ void cleanupEvent(void) {
 	uint32_t max_clean = server.max_cleanup;
 
 	/* If we are busy, don't try and clean up as many deleted items */
-	if (server.candidate_pool_jobs || server.candidate_recalc)
+	if (server.stats.jobs.pending)
 		max_clean = (max_clean + 1) / 2;
 
 	cleaned += cleanupJobs(max_clean);
@@ -249,6 +299,10 @@ void backgroundSaveEvent(void) {
 	stateSaveToDisk(0);
 }
 
+void checkpointEvent(void) {
+	stateCheckpoint();
+}
+
 /* Send any pending emails */
 void checkEmails(void) {
 	checkEmailProcesses();
@@ -267,19 +321,17 @@ void autoCleanup(void) {
 }
 
 void initEvents(void) {
-	registerEvent(checkJobsEvent, server.sched_freq);
+	if (server.sched_mode == SCHED_MODE_POLL)
+		registerEvent(checkJobsEvent, server.sched_freq);
+
 	registerEvent(cleanupEvent, 1000);
 	registerEvent(backgroundSaveEvent, server.background_save_ms);
 
 	if (server.flush.defer)
 		registerEvent(flushEvent, server.flush.defer_ms);
 
-	registerEvent(checkDeferEvent, 750);
-
 	registerEvent(checkEmails, server.email_freq_ms);
 
-	registerEvent(checkAgentEvent, 0);
-	registerEvent(checkClientEvent, 0);
 	registerEvent(checkBlockingClientEvent, 500);
 	registerEvent(checkAcctEvent, 1000);
 
@@ -288,21 +340,39 @@ void initEvents(void) {
 
 	if (server.auto_cleanup != 0)
 		registerEvent(autoCleanup, MINUTE_MS(5));
+
+	if (server.checkpoint_interval != 0)
+		registerEvent(checkpointEvent, MINUTE_MS(server.checkpoint_interval));
 }
 
-/* Check for any timed events to expire */
+/* Fire any timed events that are due */
 
 void checkEvents(void) {
-	struct event * e = eventList;
-
+	struct event * e;
 	int64_t now = getTimeMS();
+	int64_t start = now;
 
-	while (e) {
-		if (now >= e->last_fire + e->interval) {
-			e->func();
-			e->last_fire = getTimeMS();
-		}
+	while ((e = heapPeek(&eventHeap)) != NULL && e->next_fire <= start) {
+		e->func();
 
-		e = e->next;
+		now = getTimeMS();
+		e->next_fire = now + e->interval;
+		heapUpdate(&eventHeap, e);
 	}
 }
+
+/* Return the number of milliseconds until the next timed event is due, or -1 if there are none */
+int nextEventTimeout(void) {
+	struct event * e = heapPeek(&eventHeap);
+	int64_t due;
+
+	if (e == NULL)
+		return -1;
+
+	due = e->next_fire - getTimeMS();
+
+	if (due <= 0)
+		return 0;
+
+	return due > INT_MAX ? INT_MAX : due;
+}
@@ -0,0 +1,552 @@
+/* Copyright (c) 2018 Evan Wyatt
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ *    be used to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+
+#include "server.h"
+#include "io.h"
+
+/* Optional I/O threads for client connections.
+ *
+ * Each I/O thread has its own epoll fd and owns the sockets of the clients assigned to it.
+ * It reads, splits the stream into requests and parses them into a msg_t, handing these
+ * to the main thread which runs the commands. The main thread hands any output back to
+ * the thread that owns the client to send.
+ *
+ * Closing a client is a handshake, as either side might close it while the other still
+ * has items queued for it. The main thread marks the client closed and sends a close to
+ * the I/O thread, ignoring any requests or disconnects for it from then on. The I/O thread
+ * closes the socket, then acknowledges the close behind everything it has already queued
+ * for the client. The main thread frees the client once it takes the acknowledgement. */
+
+#define IO_MAX_EVENTS 256
+
+int ioThreadCount = 0;
+
+static struct ioThread *ioThreads = NULL;
+static int ioNextThread = 0;
+static atomic_int ioShutdownFlag = 0;
+
+/* Items completed by the I/O threads, waiting for the main thread */
+static struct ioQueue completed;
+static struct connectionType completedNotify;
+
+static int ioQueueInit(struct ioQueue *q) {
+	q->head = q->tail = NULL;
+	q->notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+	if (q->notify_fd < 0)
+		return 1;
+
+	pthread_mutex_init(&q->lock, NULL);
+
+	return 0;
+}
+
+/* Append the list of items to the queue, waking up the consumer if it was empty */
+static void ioQueuePush(struct ioQueue *q, struct ioItem *head, struct ioItem *tail) {
+	int was_empty;
+
+	pthread_mutex_lock(&q->lock);
+
+	was_empty = (q->head == NULL);
+
+	if (q->tail)
+		q->tail->next = head;
+	else
+		q->head = head;
+
+	q->tail = tail;
+
+	pthread_mutex_unlock(&q->lock);
+
+	if (was_empty) {
+		uint64_t one = 1;
+
+		if (write(q->notify_fd, &one, sizeof(one)) != sizeof(one) && errno != EAGAIN)
+			print_msg(JERS_LOG_WARNING, "Failed to signal I/O queue: %s", strerror(errno));
+	}
+}
+
+/* Remove everything from the queue. The notify fd needs to be drained before this is called */
+static struct ioItem *ioQueueTake(struct ioQueue *q) {
+	struct ioItem *head;
+
+	pthread_mutex_lock(&q->lock);
+	head = q->head;
+	q->head = q->tail = NULL;
+	pthread_mutex_unlock(&q->lock);
+
+	return head;
+}
+
+static void ioQueueDrain(struct ioQueue *q) {
+	uint64_t count;
+
+	if (read(q->notify_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		print_msg(JERS_LOG_WARNING, "Failed to read I/O queue notification: %s", strerror(errno));
+}
+
+static struct ioItem *ioNewItem(int type, client *c) {
+	struct ioItem *item = calloc(1, sizeof(struct ioItem));
+
+	if (item == NULL)
+		error_die("Failed to allocate memory for I/O item: %s", strerror(errno));
+
+	item->type = type;
+	item->c = c;
+
+	return item;
+}
+
+static void ioListAdd(struct ioItem **head, struct ioItem **tail, struct ioItem *item) {
+	if (*tail)
+		(*tail)->next = item;
+	else
+		*head = item;
+
+	*tail = item;
+}
+
+/* Runs on the I/O thread */
+
+static void ioDisconnect(struct ioThread *t, client *c, struct ioItem **head, struct ioItem **tail) {
+	struct epoll_event ee = {0};
+
+	c->io_closing = 1;
+
+	if (epoll_ctl(t->event_fd, EPOLL_CTL_DEL, c->connection.socket, &ee) != 0)
+		print_msg(JERS_LOG_WARNING, "Failed to remove event for disconnected client: %s", strerror(errno));
+
+	ioListAdd(head, tail, ioNewItem(IO_ITEM_DISCONNECT, c));
+}
+
+static void ioRead(struct ioThread *t, client *c, struct ioItem **head, struct ioItem **tail) {
+	size_t consumed = 0;
+	char *nl;
+
+	if (c->io_closing)
+		return;
+
+	buffResize(&c->request, 0);
+
+	ssize_t len = _recv(c->connection.socket, c->request.data + c->request.used, c->request.size - c->request.used);
+
+	if (len < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return;
+
+		print_msg(JERS_LOG_WARNING, "failed to read from client: %s\n", strerror(errno));
+		ioDisconnect(t, c, head, tail);
+		return;
+	} else if (len == 0) {
+		/* Disconnected */
+		ioDisconnect(t, c, head, tail);
+		return;
+	}
+
+	c->request.used += len;
+
+	/* Parse each complete request. The parsed message points into its own copy of
+	 * the request, so the stream buffer is free to be reused straight away */
+	while ((nl = buffFind(&c->request, '\n', &c->request_scanned)) != NULL) {
+		struct ioItem *item = ioNewItem(IO_ITEM_REQUEST, c);
+		char *start = c->request.data + consumed;
+
+		item->request = strndup(start, nl - start);
+
+		if (item->request == NULL)
+			error_die("Failed to allocate memory for client request: %s", strerror(errno));
+
+		if (load_message(item->request, &item->msg)) {
+			print_msg(JERS_LOG_WARNING, "Failed to load client request, disconnecting them.");
+			free_message(&item->msg);
+			free(item->request);
+			free(item);
+			ioDisconnect(t, c, head, tail);
+			return;
+		}
+
+		ioListAdd(head, tail, item);
+
+		consumed = nl + 1 - c->request.data;
+		c->request_scanned = consumed;
+	}
+
+	if (consumed) {
+		buffRemove(&c->request, consumed, 0);
+		c->request_scanned = c->request.used;
+	}
+}
+
+static void ioWrite(struct ioThread *t, client *c, struct ioItem **head, struct ioItem **tail) {
+	if (c->io_closing || c->io_output_sent == c->io_output.used)
+		return;
+
+	ssize_t len = _send(c->connection.socket, c->io_output.data + c->io_output_sent, c->io_output.used - c->io_output_sent);
+
+	if (len == -1) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK) {
+			print_msg(JERS_LOG_WARNING, "send to client failed: %s", strerror(errno));
+			ioDisconnect(t, c, head, tail);
+			return;
+		}
+
+		len = 0;
+	}
+
+	c->io_output_sent += len;
+
+	if (c->io_output_sent == c->io_output.used) {
+		pollSetReadable(&c->connection);
+		c->io_output_sent = c->io_output.used = 0;
+	} else {
+		pollSetWritable(&c->connection);
+	}
+}
+
+/* Work sent from the main thread */
+static void ioProcessQueue(struct ioThread *t, struct ioItem **head, struct ioItem **tail) {
+	struct ioItem *item = ioQueueTake(&t->queue);
+
+	while (item) {
+		struct ioItem *next = item->next;
+		client *c = item->c;
+
+		switch (item->type) {
+			case IO_ITEM_RESPONSE:
+				if (c->io_closing)
+					break;
+
+				if (c->io_output.used == 0) {
+					/* Nothing outstanding, just take the buffer */
+					buffFree(&c->io_output);
+					c->io_output = item->response;
+					c->io_output_sent = 0;
+					memset(&item->response, 0, sizeof(buff_t));
+				} else {
+					buffAddBuff(&c->io_output, &item->response);
+				}
+
+				ioWrite(t, c, head, tail);
+				break;
+
+			case IO_ITEM_CLOSE:
+				if (!c->io_closing) {
+					struct epoll_event ee = {0};
+					epoll_ctl(t->event_fd, EPOLL_CTL_DEL, c->connection.socket, &ee);
+				}
+
+				/* Nothing else is queued for the client after this */
+				c->io_closing = 1;
+				close(c->connection.socket);
+				buffFree(&c->request);
+				buffFree(&c->io_output);
+				ioListAdd(head, tail, ioNewItem(IO_ITEM_CLOSED, c));
+				break;
+		}
+
+		buffFree(&item->response);
+		free(item);
+		item = next;
+	}
+}
+
+static void *ioThreadMain(void *arg) {
+	struct ioThread *t = arg;
+	struct epoll_event events[IO_MAX_EVENTS];
+
+	while (!ioShutdownFlag) {
+		struct ioItem *head = NULL, *tail = NULL;
+		int count = epoll_wait(t->event_fd, events, IO_MAX_EVENTS, -1);
+
+		if (count < 0) {
+			if (errno == EINTR)
+				continue;
+
+			error_die("I/O thread %d: epoll_wait failed: %s", t->id, strerror(errno));
+		}
+
+		for (int i = 0; i < count; i++) {
+			struct connectionType *connection = events[i].data.ptr;
+
+			if (connection == &t->notify) {
+				ioQueueDrain(&t->queue);
+				ioProcessQueue(t, &head, &tail);
+				continue;
+			}
+
+			if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+				ioRead(t, connection->ptr, &head, &tail);
+
+			if (events[i].events & EPOLLOUT)
+				ioWrite(t, connection->ptr, &head, &tail);
+		}
+
+		/* Hand everything from this pass to the main thread in one go */
+		if (head)
+			ioQueuePush(&completed, head, tail);
+	}
+
+	return NULL;
+}
+
+/* Runs on the main thread */
+
+int ioInit(int thread_count) {
+	sigset_t all, old;
+
+	if (thread_count <= 0)
+		return 0;
+
+	if (ioQueueInit(&completed) != 0) {
+		print_msg(JERS_LOG_WARNING, "Failed to create I/O completion queue: %s", strerror(errno));
+		return 1;
+	}
+
+	completedNotify.type = IO_NOTIFY;
+	completedNotify.socket = completed.notify_fd;
+	completedNotify.event_fd = server.event_fd;
+	completedNotify.ptr = NULL;
+
+	if (pollSetReadable(&completedNotify) != 0) {
+		print_msg(JERS_LOG_WARNING, "Failed to add I/O completion queue to event polling: %s", strerror(errno));
+		return 1;
+	}
+
+	ioThreads = calloc(thread_count, sizeof(struct ioThread));
+
+	if (ioThreads == NULL)
+		error_die("Failed to allocate memory for I/O threads: %s", strerror(errno));
+
+	/* Signals are left to the main thread */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+
+	for (int i = 0; i < thread_count; i++) {
+		struct ioThread *t = &ioThreads[i];
+
+		t->id = i;
+		t->event_fd = epoll_create1(EPOLL_CLOEXEC);
+
+		if (t->event_fd < 0 || ioQueueInit(&t->queue) != 0)
+			error_die("Failed to initialise I/O thread %d: %s", i, strerror(errno));
+
+		t->notify.type = IO_NOTIFY;
+		t->notify.socket = t->queue.notify_fd;
+		t->notify.event_fd = t->event_fd;
+		t->notify.ptr = t;
+
+		if (pollSetReadable(&t->notify) != 0)
+			error_die("Failed to add queue to I/O thread %d event polling: %s", i, strerror(errno));
+
+		if (pthread_create(&t->thread, NULL, ioThreadMain, t) != 0)
+			error_die("Failed to start I/O thread %d", i);
+
+		ioThreadCount++;
+	}
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	print_msg(JERS_LOG_INFO, "Started %d I/O threads", ioThreadCount);
+
+	return 0;
+}
+
+/* Pass a new client to one of the I/O threads */
+int ioAddClient(client *c) {
+	struct ioThread *t = &ioThreads[ioNextThread++ % ioThreadCount];
+	struct epoll_event ee;
+
+	/* The thread might get an event before epoll_ctl returns, so set everything up first */
+	c->connection.event_fd = t->event_fd;
+	c->connection.events = EPOLLIN;
+
+	ee.events = EPOLLIN;
+	ee.data.ptr = &c->connection;
+
+	if (epoll_ctl(t->event_fd, EPOLL_CTL_ADD, c->connection.socket, &ee) != 0) {
+		c->connection.events = 0;
+		return 1;
+	}
+
+	c->io = t;
+
+	return 0;
+}
+
+/* Give the clients pending output to its I/O thread to send */
+void ioSendResponse(client *c) {
+	size_t len = c->response.used - heldOutput(&c->connection);
+	struct ioItem *item;
+
+	if (len == 0)
+		return;
+
+	item = ioNewItem(IO_ITEM_RESPONSE, c);
+
+	if (len == c->response.used) {
+		item->response = c->response;
+		memset(&c->response, 0, sizeof(buff_t));
+	} else {
+		/* Only pass on what isn't held for group commit */
+		buffNew(&item->response, len);
+		buffAdd(&item->response, c->response.data, len);
+		buffRemove(&c->response, len, 0);
+	}
+
+	c->response_sent = 0;
+
+	ioQueuePush(&c->io->queue, item, item);
+}
+
+/* The main thread has finished with this client. It's freed once the I/O thread acknowledges the close */
+void ioCloseClient(client *c) {
+	struct ioItem *item = ioNewItem(IO_ITEM_CLOSE, c);
+
+	c->io_closed = 1;
+
+	ioQueuePush(&c->io->queue, item, item);
+}
+
+void ioHandleNotify(struct connectionType *connection) {
+	UNUSED(connection);
+	ioQueueDrain(&completed);
+}
+
+/* Run the requests parsed by the I/O threads */
+void ioProcessCompleted(void) {
+	struct ioItem *item = ioQueueTake(&completed);
+
+	while (item) {
+		struct ioItem *next = item->next;
+		client *c = item->c;
+
+		switch (item->type) {
+			case IO_ITEM_REQUEST:
+				if (c->io_closed) {
+					free_message(&item->msg);
+				} else {
+					c->msg = item->msg;
+					runCommand(c);
+					free_message(&c->msg);
+				}
+
+				free(item->request);
+				break;
+
+			case IO_ITEM_DISCONNECT:
+				if (!c->io_closed)
+					handleClientDisconnect(c);
+
+				break;
+
+			case IO_ITEM_CLOSED:
+				free(c);
+				break;
+		}
+
+		free(item);
+		item = next;
+	}
+}
+
+void ioShutdown(void) {
+	struct ioItem *item;
+
+	if (ioThreadCount == 0)
+		return;
+
+	ioShutdownFlag = 1;
+
+	for (int i = 0; i < ioThreadCount; i++) {
+		uint64_t one = 1;
+
+		if (write(ioThreads[i].queue.notify_fd, &one, sizeof(one)) != sizeof(one))
+			print_msg(JERS_LOG_WARNING, "Failed to signal I/O thread %d: %s", i, strerror(errno));
+	}
+
+	for (int i = 0; i < ioThreadCount; i++) {
+		struct ioThread *t = &ioThreads[i];
+
+		pthread_join(t->thread, NULL);
+
+		/* Free anything the thread didn't get to */
+		item = ioQueueTake(&t->queue);
+
+		while (item) {
+			struct ioItem *next = item->next;
+
+			if (item->type == IO_ITEM_CLOSE) {
+				close(item->c->connection.socket);
+				buffFree(&item->c->request);
+				buffFree(&item->c->io_output);
+				free(item->c);
+			}
+
+			buffFree(&item->response);
+			free(item);
+			item = next;
+		}
+
+		close(t->queue.notify_fd);
+		close(t->event_fd);
+		pthread_mutex_destroy(&t->queue.lock);
+	}
+
+	/* The clients of any unprocessed disconnects are still in the client list */
+	item = ioQueueTake(&completed);
+
+	while (item) {
+		struct ioItem *next = item->next;
+
+		if (item->type == IO_ITEM_REQUEST) {
+			free_message(&item->msg);
+			free(item->request);
+		} else if (item->type == IO_ITEM_CLOSED) {
+			free(item->c);
+		}
+
+		free(item);
+		item = next;
+	}
+
+	close(completed.notify_fd);
+	pthread_mutex_destroy(&completed.lock);
+
+	free(ioThreads);
+	ioThreads = NULL;
+	ioThreadCount = 0;
+}
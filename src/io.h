@@ -0,0 +1,84 @@
+/* Copyright (c) 2018 Evan Wyatt
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ *    be used to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _io_h
+#define _io_h
+
+#include <pthread.h>
+
+#include "client.h"
+
+#define IO_ITEM_REQUEST    1  // I/O thread -> main: A parsed request from a client
+#define IO_ITEM_DISCONNECT 2  // I/O thread -> main: The client has disconnected
+#define IO_ITEM_RESPONSE   3  // main -> I/O thread: Output to send to a client
+#define IO_ITEM_CLOSE      4  // main -> I/O thread: The main thread is finished with the client
+#define IO_ITEM_CLOSED     5  // I/O thread -> main: The thread is finished with the client, it can be freed
+
+struct ioItem {
+	int type;
+	client *c;
+
+	msg_t msg;
+	char *request;   // Copy of the request the msg was parsed from
+
+	buff_t response;
+
+	struct ioItem *next;
+};
+
+/* Items passed between threads. The consumer takes everything in one go,
+ * so the producer only needs to signal when the queue was empty. */
+struct ioQueue {
+	pthread_mutex_t lock;
+	struct ioItem *head;
+	struct ioItem *tail;
+	int notify_fd;   // eventfd written to when items are added to an empty queue
+};
+
+struct ioThread {
+	int id;
+	pthread_t thread;
+	int event_fd;    // epoll fd for this threads clients
+
+	struct ioQueue queue;
+	struct connectionType notify;
+};
+
+extern int ioThreadCount;
+
+int ioInit(int thread_count);
+void ioShutdown(void);
+
+int ioAddClient(client *c);
+void ioSendResponse(client *c);
+void ioCloseClient(client *c);
+void ioProcessCompleted(void);
+void ioHandleNotify(struct connectionType *connection);
+
+#endif
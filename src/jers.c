@@ -47,6 +47,7 @@ struct cmd objects[] = {
 	{"resource", resource_func},
 	{"agent",    agent_func},
 	{"clear",    clear_func},
+	{"state",    state_func},
 	{NULL, NULL}
 };
 
@@ -87,6 +88,11 @@ struct cmd clear_cmds[] = {
 	{NULL, NULL}
 };
 
+struct cmd state_cmds[] = {
+	{"checkpoint", checkpoint_state},
+	{NULL, NULL}
+};
+
 
 int add_job(int argc, char *argv[]) {
 	struct add_job_args args;
@@ -599,6 +605,25 @@ int clearcache(int argc, char *argv[]) {
 	return 0;
 }
 
+int checkpoint_state(int argc, char *argv[]) {
+	struct checkpoint_state_args args = {0};
+
+	if (parse_checkpoint_state(argc, argv, &args))
+		return 1;
+
+	if (args.verbose)
+		fprintf(stderr, "Sending checkpoint command\n");
+
+	if (jersCheckpoint() != 0) {
+		fprintf(stderr, "Failed to start checkpoint: %s\n", jersGetErrStr(jers_errno));
+		return 1;
+	}
+
+	printf("Checkpoint started.\n");
+
+	return 0;
+}
+
 int start_job(int argc, char *argv[]) {
 	struct start_job_args args;
 	int rc = 0;
@@ -797,6 +822,7 @@ void print_cmd_help(void) {
 	printf(" QUEUE\n");
 	printf(" RESOURCE\n");
 	printf(" AGENT\n");
+	printf(" STATE\n");
 	printf("\n");
 }
 
@@ -812,6 +838,8 @@ void print_obj_help(const char * cmd) {
 		cmd_ptr = &resource_cmds;
 	else if (strcasecmp(cmd, "AGENT") == 0)
 		cmd_ptr = &agent_cmds;
+	else if (strcasecmp(cmd, "STATE") == 0)
+		cmd_ptr = &state_cmds;
 
 	if (cmd_ptr) {
 		printf("Expected one of the following commands for object '%s':\n", cmd);
@@ -874,6 +902,10 @@ int clear_func(int argc, char *argv[]) {
 	return run_action(argc, argv, clear_cmds);
 }
 
+int state_func(int argc, char *argv[]) {
+	return run_action(argc, argv, state_cmds);
+}
+
 int main (int argc, char * argv[]) {
 	if (argc <= 1) {
 		fprintf(stderr, "No object provided. Expected:\n");
@@ -527,6 +527,7 @@ int jersGetAgents(const char *name, jersAgentInfo *info);
 int jersGetStats(jersStats * s);
 
 int jersClearCache(void);
+int jersCheckpoint(void);
 
 void jersFinish(void);
 const char * jersGetErrStr(int jers_error);
@@ -1911,7 +1911,7 @@ void disconnectFromDaemon(void) {
 	agent.daemon_fd = -1;
 	agent.next_connect = time(NULL) + RECONNECT_WAIT;
 
-	agent.requests.used = 0;
+	buffClear(&agent.requests, 0);
 	agent.responses.used = 0;
 	agent.responses_sent = 0;
 }
@@ -831,6 +831,34 @@ static error_t clearcache_parse(int key, char *arg, struct argp_state *state)
 	return 0;
 }
 
+static char checkpoint_state_doc[] = "state checkpoint -- Save the state and remove (or archive) the journals it covers";
+static char checkpoint_state_arg_doc[] = "";
+static struct argp_option checkpoint_state_options[] = {
+	{"verbose", 'v', 0, 0, "Produce verbose output"},
+	{0}};
+
+static error_t checkpoint_state_parse(int key, char *arg, struct argp_state *state)
+{
+	struct checkpoint_state_args *arguments = state->input;
+	UNUSED(arg);
+
+	switch (key)
+	{
+		case 'v':
+			arguments->verbose = 1;
+			break;
+
+		case ARGP_KEY_INIT:
+		case ARGP_KEY_ARG:
+		case ARGP_KEY_END:
+			break;
+
+		default:
+			return ARGP_ERR_UNKNOWN;
+	}
+	return 0;
+}
+
 
 static char start_job_doc[] = "start job -- (re)start job/s\nForces a job into a pending state by removing defertimes/hold flags.";
 static char start_job_arg_doc[] = "JOBID...";
@@ -1125,3 +1153,4 @@ CMD_PARSE(modify_resource)
 
 CMD_PARSE(show_agent)
 CMD_PARSE(clearcache)
+CMD_PARSE(checkpoint_state)
@@ -76,6 +76,10 @@ struct clearcache_args {
 	int verbose;
 };
 
+struct checkpoint_state_args {
+	int verbose;
+};
+
 struct start_job_args {
     int verbose;
     
@@ -125,6 +129,7 @@ int queue_func(int argc, char *argv[]);
 int resource_func(int argc, char *argv[]);
 int agent_func(int argc, char *argv[]);
 int clear_func(int argc, char *argv[]);
+int state_func(int argc, char *argv[]);
 
 #define CMD(__cmd) \
 	int __cmd(int argc, char *argv[]); \
@@ -151,5 +156,6 @@ CMD(modify_resource)
 CMD(show_agent)
 
 CMD(clearcache)
+CMD(checkpoint_state)
 
 #endif
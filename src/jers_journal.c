@@ -0,0 +1,144 @@
+/* Copyright (c) 2018 Evan Wyatt
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ *    be used to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Convert a journal between the text and binary formats.
+ * The commit markers and end of journal marker are carried across, so the converted
+ * journal can be replaced in the state directory while jersd is stopped. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "journal.h"
+
+static void usage(const char *prog) {
+	fprintf(stderr, "usage: %s --binary|--text <input journal> <output journal>\n", prog);
+	fprintf(stderr, "  --binary  Convert the journal to the binary format\n");
+	fprintf(stderr, "  --text    Convert the journal to the text format\n");
+}
+
+static int writeAll(int fd, buff_t *b) {
+	size_t written = 0;
+
+	while (written < b->used) {
+		ssize_t len = write(fd, b->data + written, b->used - written);
+
+		if (len == -1) {
+			if (errno == EINTR)
+				continue;
+
+			return 1;
+		}
+
+		written += len;
+	}
+
+	buffClear(b, 0);
+
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+	struct journalReader r;
+	struct journalEntry e;
+	int format;
+	int fd;
+	int rc;
+	buff_t out;
+
+	if (argc != 4) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (strcmp(argv[1], "--binary") == 0) {
+		format = JOURNAL_FORMAT_BINARY;
+	} else if (strcmp(argv[1], "--text") == 0) {
+		format = JOURNAL_FORMAT_TEXT;
+	} else {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (journalReaderOpen(&r, argv[2]) != 0) {
+		fprintf(stderr, "Failed to open journal %s: %s\n", argv[2], strerror(errno));
+		return 1;
+	}
+
+	if ((fd = open(argv[3], O_WRONLY | O_CREAT | O_EXCL, 0660)) < 0) {
+		fprintf(stderr, "Failed to create %s: %s\n", argv[3], strerror(errno));
+		return 1;
+	}
+
+	if (format == JOURNAL_FORMAT_BINARY && journalWriteHeader(fd) != 0) {
+		fprintf(stderr, "Failed to write to %s: %s\n", argv[3], strerror(errno));
+		return 1;
+	}
+
+	buffNew(&out, 0);
+
+	while ((rc = journalReaderNext(&r, &e)) == JOURNAL_RECORD) {
+		if (journalFormatRecord(&out, format, &e) != 0) {
+			fprintf(stderr, "Failed to convert record at offset %ld: %s\n", e.offset, strerror(errno));
+			return 1;
+		}
+
+		if (out.used >= 0x100000 && writeAll(fd, &out) != 0) {
+			fprintf(stderr, "Failed to write to %s: %s\n", argv[3], strerror(errno));
+			return 1;
+		}
+	}
+
+	if (rc == JOURNAL_CORRUPT) {
+		fprintf(stderr, "Invalid record at offset %ld in %s\n", r.offset, argv[2]);
+		return 1;
+	}
+
+	if (rc == JOURNAL_TORN)
+		fprintf(stderr, "Ignoring partially written record at offset %ld in %s\n", r.offset, argv[2]);
+
+	if (r.eoj)
+		journalFormatEnd(&out, format);
+
+	if (writeAll(fd, &out) != 0 || fsync(fd) != 0) {
+		fprintf(stderr, "Failed to write to %s: %s\n", argv[3], strerror(errno));
+		return 1;
+	}
+
+	close(fd);
+	buffFree(&out);
+
+	printf("Converted %ld records from %s to %s\n", r.record, argv[2], argv[3]);
+	journalReaderClose(&r);
+
+	return 0;
+}
@@ -43,6 +43,9 @@
 #include "server.h"
 #include "jers.h"
 #include "logging.h"
+#include "io.h"
+#include "uring.h"
+#include "syncer.h"
 
 char * server_log = "jersd";
 int server_log_mode = JERS_LOG_DEBUG;
@@ -62,11 +65,22 @@ int parseOpts(int argc, char * argv[]) {
 
 void serverShutdown(void) {
 	/* Lets do a final flush of our state file before we try anything else*/
+	journalCommit();
+	stateSaveWait();
+	buffFree(&server.journal.pending);
+
+	/* Wait for any outstanding journal flushes */
+	syncerShutdown();
+
 	if (server.journal.fd >= 0) {
 		print_msg(JERS_LOG_INFO, "Performing final flush of state file");
 		fdatasync(server.journal.fd);
 	}
 
+	/* Stop the I/O threads before freeing the clients they use */
+	ioShutdown();
+	uringFree();
+
 	/* Kill off any accounting stream clients */
 	acctClient *ac = acctClientList;
 	while (ac) {
@@ -90,6 +104,8 @@ void serverShutdown(void) {
 
 	/* Free jobs */
 	struct job * j, *job_tmp;
+	heapFree(&server.deferred);
+
 	HASH_ITER(hh, server.jobTable, j, job_tmp) {
 		HASH_DEL(server.jobTable, j);
 		freeJob(j);
@@ -112,9 +128,6 @@ void serverShutdown(void) {
 	/* User cache */
 	freeUserCache();
 
-	/* Scheduling candidate pool */
-	free(server.candidate_pool);
-
 	/* Clients and agents */
 	client *c = clientList;
 	while (c) {
@@ -123,6 +136,7 @@ void serverShutdown(void) {
 		close(c->connection.socket);
 		buffFree(&c->response);
 		buffFree(&c->request);
+		buffFree(&c->io_output);
 		removeClient(c);
 		free(c);
 
@@ -231,6 +245,8 @@ void handleReadable(struct epoll_event *e) {
 		case ACCT_CONN:         status = handleAcctClientConnection(connection); break;
 		case CLIENT:            status = handleClientRead(connection->ptr); break;
 		case AGENT:             status = handleAgentRead(connection->ptr); break;
+		case IO_NOTIFY:         ioHandleNotify(connection); break;
+		case SYNC_NOTIFY:       syncerHandleNotify(connection); break;
 		default:                print_msg(JERS_LOG_WARNING, "Unexpected read event - Ignoring"); break;
 	}
 
@@ -242,6 +258,14 @@ void handleReadable(struct epoll_event *e) {
 	return;
 }
 
+static void handleWrite(struct connectionType * connection) {
+	switch (connection->type) {
+		case CLIENT:       handleClientWrite(connection->ptr); break;
+		case AGENT:        handleAgentWrite(connection->ptr); break;
+		default:           print_msg(JERS_LOG_WARNING, "Unexpected write event - Ignoring"); break;
+	}
+}
+
 void handleWriteable(struct epoll_event *e) {
 	struct connectionType * connection = e->data.ptr;
 
@@ -249,13 +273,60 @@ void handleWriteable(struct epoll_event *e) {
 	if (connection == NULL)
 		return;
 
+	/* With io_uring the write is batched with the others at the end of the iteration */
+	if (uringActive()) {
+		queueWrite(connection);
+		return;
+	}
+
+	/* Already being sent, don't send it twice */
+	cancelWrite(connection);
+
+	handleWrite(connection);
+}
+
+/* Results of the socket reads and writes batched through io_uring */
+static void readComplete(void *data, int res) {
+	struct connectionType * connection = data;
+	ssize_t len = res;
+
+	if (res < 0) {
+		errno = -res;
+		len = -1;
+	}
+
 	switch (connection->type) {
-		case CLIENT:       handleClientWrite(connection->ptr); break;
-		case AGENT:        handleAgentWrite(connection->ptr); break;
-		default:           print_msg(JERS_LOG_WARNING, "Unexpected write event - Ignoring"); break;
+		case CLIENT:       handleClientReadResult(connection->ptr, len); break;
+		case AGENT:        handleAgentReadResult(connection->ptr, len); break;
 	}
+}
 
-	return;
+static void writeComplete(void *data, int res) {
+	struct connectionType * connection = data;
+	ssize_t len = res;
+
+	if (res < 0) {
+		errno = -res;
+		len = -1;
+	}
+
+	switch (connection->type) {
+		case CLIENT:       handleClientWriteResult(connection->ptr, len); break;
+		case AGENT:        handleAgentWriteResult(connection->ptr, len); break;
+	}
+}
+
+/* Send the output generated this iteration directly to each connection
+ * Anything that can't be sent now will be sent once EPOLLOUT is signaled */
+static void flushWrites(void) {
+	struct connectionType * connection;
+
+	while ((connection = writeQueue) != NULL) {
+		cancelWrite(connection);
+		handleWrite(connection);
+	}
+
+	uringSubmitWait(writeComplete);
 }
 
 int main (int argc, char * argv[]) {
@@ -295,19 +366,38 @@ int main (int argc, char * argv[]) {
 	sortAgentCommands();
 	sortCommands();
 
+	if (server.io_backend == IO_BACKEND_URING) {
+		if (uringInit(MAX_EVENTS * 2) != 0) {
+			print_msg(JERS_LOG_WARNING, "Failed to initialise io_uring, falling back to epoll: %s", strerror(errno));
+			server.io_backend = IO_BACKEND_EPOLL;
+		} else {
+			print_msg(JERS_LOG_INFO, "Using io_uring for socket and journal I/O");
+		}
+	}
+
 	stateInit();
 
-	/* Load and initialise the queues */
-	if (stateLoadQueues())
-		error_die("init: failed to load queues from file");
+	int loaded = 1;
+
+	if (server.state_format == STATE_FORMAT_SNAPSHOT)
+		loaded = stateLoadSnapshot();
+	else if (server.state_format == STATE_FORMAT_LOG)
+		loaded = stateLoadObjectStore();
 
-	if (stateLoadResources())
-		error_die("init: failed to load resources from file");
+	/* Without a snapshot or saved objects, ie. when switching formats, load from the state directories */
+	if (loaded != 0) {
+		/* Load and initialise the queues */
+		if (stateLoadQueues())
+			error_die("init: failed to load queues from file");
 
-	/* Load jobs from file */
+		if (stateLoadResources())
+			error_die("init: failed to load resources from file");
 
-	if (stateLoadJobs())
-		error_die("init: failed to load jobs from file");
+		/* Load jobs from file */
+
+		if (stateLoadJobs())
+			error_die("init: failed to load jobs from file");
+	}
 
 	/* Replay commands from the journal/s */
 	stateReplayJournal();
@@ -325,11 +415,18 @@ int main (int argc, char * argv[]) {
 
 	setup_listening_sockets();
 
+	if (ioInit(server.io_threads) != 0)
+		error_die("Failed to start I/O threads");
+
+	/* Without the syncer, the journal is flushed directly by the main thread */
+	if (syncerInit() != 0)
+		print_msg(JERS_LOG_WARNING, "Journal syncer not started, flushing the journal from the main thread");
+
 	/* Start out event polling */
 	print_msg(JERS_LOG_DEBUG, "Initialising events\n");
 	initEvents();
 
-	server.candidate_recalc = 1;
+	requestSchedule();
 	server.initalising = 0;
 
 	print_msg(JERS_LOG_INFO, "* JERSD entering main loop...\n");
@@ -351,8 +448,25 @@ int main (int argc, char * argv[]) {
 			break;
 		}
 
+		/* Sleep until the next timed event is due, or the next deferred job is to be released */
+		int timeout = nextEventTimeout();
+		int defer_timeout = nextDeferredTimeout();
+
+		if (defer_timeout >= 0 && (timeout < 0 || defer_timeout < timeout))
+			timeout = defer_timeout;
+
+		/* Or the held journal records need to be commited */
+		int commit_timeout = nextCommitTimeout();
+
+		if (commit_timeout >= 0 && (timeout < 0 || commit_timeout < timeout))
+			timeout = commit_timeout;
+
+		/* Don't wait around if there is already work to do */
+		if (clientReadyList || agentReadyList || (server.sched_mode == SCHED_MODE_EVENT && server.sched_pending))
+			timeout = 0;
+
 		/* Poll for any events on our sockets */
-		int status = epoll_wait(server.event_fd, events, MAX_EVENTS, server.event_freq);
+		int status = epoll_wait(server.event_fd, events, MAX_EVENTS, timeout);
 
 		for (int i = 0; i < status; i++) {
 			struct epoll_event * e = &events[i];
@@ -366,8 +480,35 @@ int main (int argc, char * argv[]) {
 				handleWriteable(e);
 		}
 
+		/* Perform the reads queued with io_uring */
+		uringSubmitWait(readComplete);
+
+		/* Process anything our clients and agents have sent us */
+		if (clientReadyList || agentReadyList)
+			processRequests();
+
+		if (ioThreadCount)
+			ioProcessCompleted();
+
+		/* Release any deferred jobs that are now due */
+		releaseDeferred();
+
 		/* Check for any expired events to check */
 		checkEvents();
+
+		/* Run a single scheduling pass for everything that's changed */
+		if (server.sched_mode == SCHED_MODE_EVENT && server.sched_pending) {
+			server.sched_pending = 0;
+			checkJobs();
+		}
+
+		/* Group commit - Write the journal records from this iteration/window.
+		 * Output is held until the records it depends on are on disk */
+		if (server.flush.group)
+			journalGroupCommit();
+
+		/* Send all the responses generated this iteration */
+		flushWrites();
 	}
 
 	print_msg(JERS_LOG_INFO, "Exited main loop - Shutting down.\n");
@@ -29,11 +29,12 @@
 
 #include <server.h>
 #include <limits.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
 
 #include <json.h>
 
-#include <utlist.h>
-
 /* Return the next free jobid.
  * 0 is returned if no ids are available */
 
@@ -114,16 +115,10 @@ int cleanupJob(struct job *j) {
 	if (j->obj.dirty || j->internal_state &JERS_FLAG_FLUSHING)
 		return 1;
 
-	stateDelJob(j);
 	HASH_DEL(server.jobTable, j);
 
-	/* If the job was a candidate for execution, clear it out of the pool */
-	for (int i = 0; i < server.candidate_pool_jobs; i++) {
-		if (server.candidate_pool[i] == j) {
-			server.candidate_pool[i] = NULL;
-			break;
-		}
-	}
+	/* If the job was a candidate for execution, clear it out of its queue */
+	removeCandidate(j);
 
 	/* Remove the job from the indexed tag table */
 	if (server.index_tag)
@@ -201,6 +196,7 @@ int addJob(struct job * j, int dirty) {
 void deleteJob(struct job *j) {
 	j->internal_state |= JERS_FLAG_DELETED;
 	changeJobState(j, 0, NULL, 0);
+	stateDelJob(j);
 
 	if (j->defer_time)
 		removeDeferredJob(j);
@@ -279,8 +275,10 @@ int jobToJSON(struct job *j, buff_t *buff)
 	JSONAddInt(buff, EXITCODE, j->exitcode);
 	JSONAddInt(buff, SIGNAL, j->signal);
 
-	if (j->pend_reason)
-		JSONAddInt(buff, PENDREASON, j->pend_reason);
+	int pend_reason = getPendReason(j);
+
+	if (pend_reason)
+		JSONAddInt(buff, PENDREASON, pend_reason);
 
 	if (j->fail_reason)
 		JSONAddInt(buff, FAILREASON, j->fail_reason);
@@ -291,16 +289,27 @@ int jobToJSON(struct job *j, buff_t *buff)
 	return 0;
 }
 
-/* Maintain the deferred job linked list */
+/* Maintain the deferred job heap, ordered by defer time */
+
+static int deferCmp(const void *a_, const void *b_) {
+	const struct job *a = a_;
+	const struct job *b = b_;
 
-static inline time_t deferCmp(const struct job *a, const struct job *b) {
-	return a->defer_time - b->defer_time;
+	if (a->defer_time != b->defer_time)
+		return a->defer_time < b->defer_time ? -1 : 1;
+
+	return a->jobid - b->jobid;
 }
 
 void addDeferredJob(struct job *j) {
-	DL_INSERT_INORDER2(server.deferred_list, j, deferCmp, deferred_prev, deferred_next);
+	if (server.deferred.cmp == NULL)
+		heapNew(&server.deferred, deferCmp, offsetof(struct job, deferred_index));
+
+	if (heapAdd(&server.deferred, j) != 0)
+		error_die("Failed to add job %d to deferred list: %s", j->jobid, strerror(errno));
 }
 
 void removeDeferredJob(struct job *j) {
-	DL_DELETE2(server.deferred_list, j, deferred_prev, deferred_next);
+	if (j->deferred_index)
+		heapRemove(&server.deferred, j);
 }
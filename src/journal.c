@@ -0,0 +1,473 @@
+/* Copyright (c) 2018 Evan Wyatt
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ *    be used to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "common.h"
+#include "journal.h"
+#include "cmd_defs.h"
+
+/* Journal file formats.
+ *
+ * Text journals are a line per record, of tab seperated fields:
+ *   MARKER TIME\tUID\tCMD\tJOBID\tREVISION\tJSON
+ *
+ * Binary journals are length prefixed records with a fixed header, described in journal.h.
+ * The CRC on each record allows a partially written record at the end of the journal
+ * (ie. after a crash) to be told apart from a valid one.
+ *
+ * Both are read back from a read-only mapping of the file, with the format detected from
+ * the file header, so journals of either format can be replayed regardless of the format
+ * currently configured. */
+
+/* The commands written to the journal. The index is stored in binary journals,
+ * so entries can only be added to the end of this table. */
+static const char *journalCommands[] = {
+	NULL,
+	CMD_ADD_JOB,
+	CMD_MOD_JOB,
+	CMD_DEL_JOB,
+	CMD_ADD_QUEUE,
+	CMD_MOD_QUEUE,
+	CMD_DEL_QUEUE,
+	CMD_ADD_RESOURCE,
+	CMD_MOD_RESOURCE,
+	CMD_DEL_RESOURCE,
+	CMD_SET_TAG,
+	CMD_DEL_TAG,
+	AGENT_JOB_STARTED,
+	AGENT_JOB_COMPLETED,
+	"REPLAY_COMPLETE",
+	CMD_CHECKPOINT,
+};
+
+#define JOURNAL_COMMAND_COUNT (sizeof(journalCommands) / sizeof(journalCommands[0]))
+
+/* CRC32C (Castagnoli), table driven */
+static uint32_t crcTable[256];
+
+static void crcInit(void) {
+	for (uint32_t i = 0; i < 256; i++) {
+		uint32_t crc = i;
+
+		for (int j = 0; j < 8; j++)
+			crc = (crc >> 1) ^ (0x82F63B78 & -(crc & 1));
+
+		crcTable[i] = crc;
+	}
+}
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t len) {
+	const unsigned char *p = data;
+
+	if (crcTable[1] == 0)
+		crcInit();
+
+	crc = ~crc;
+
+	while (len--)
+		crc = crcTable[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+
+	return ~crc;
+}
+
+static uint32_t recordCrc(const struct journalRecord *hdr, const char *payload, size_t payload_len) {
+	const size_t skip = offsetof(struct journalRecord, cmd);
+	uint32_t crc = crc32c(0, &hdr->length, sizeof(hdr->length));
+
+	crc = crc32c(crc, (const char *)hdr + skip, sizeof(struct journalRecord) - skip);
+
+	return crc32c(crc, payload, payload_len);
+}
+
+/* Returns 0 if the command isn't one that is journaled */
+uint32_t journalCommandId(const char *command) {
+	for (uint32_t i = 1; i < JOURNAL_COMMAND_COUNT; i++) {
+		if (strcmp(command, journalCommands[i]) == 0)
+			return i;
+	}
+
+	return 0;
+}
+
+const char *journalCommandName(uint32_t id) {
+	if (id == 0 || id >= JOURNAL_COMMAND_COUNT)
+		return NULL;
+
+	return journalCommands[id];
+}
+
+/* Write the binary file header to a new journal */
+int journalWriteHeader(int fd) {
+	struct journalFileHeader hdr = {0};
+
+	memcpy(hdr.magic, JOURNAL_MAGIC, sizeof(hdr.magic));
+	hdr.version = JOURNAL_VERSION;
+
+	if (write(fd, &hdr, sizeof(hdr)) != sizeof(hdr))
+		return 1;
+
+	return 0;
+}
+
+/* Append a record in the requested format to the buffer */
+int journalFormatRecord(buff_t *b, int format, const struct journalEntry *e) {
+	if (format == JOURNAL_FORMAT_BINARY) {
+		struct journalRecord hdr = {0};
+
+		hdr.cmd = journalCommandId(e->command);
+
+		if (hdr.cmd == 0) {
+			errno = EINVAL;
+			return 1;
+		}
+
+		hdr.length = sizeof(hdr) + e->payload_len;
+		hdr.marker = e->marker;
+		hdr.time_ms = e->time_ms;
+		hdr.uid = e->uid;
+		hdr.jobid = e->jobid;
+		hdr.revision = e->revision;
+		hdr.crc = recordCrc(&hdr, e->payload, e->payload_len);
+
+		buffAdd(b, (char *)&hdr, sizeof(hdr));
+		buffAdd(b, e->payload, e->payload_len);
+
+		return 0;
+	}
+
+	while (1) {
+		size_t space = b->size - b->used;
+		int len = snprintf(b->data + b->used, space, "%c%ld.%03d\t%d\t%s\t%u\t%ld\t%.*s\n", e->marker, e->time_ms / 1000, (int)(e->time_ms % 1000),
+			e->uid, e->command, e->jobid, e->revision, (int)e->payload_len, e->payload ? e->payload : "");
+
+		if (len < 0)
+			return 1;
+
+		if ((size_t)len < space) {
+			b->used += len;
+			break;
+		}
+
+		if (buffResize(b, len + 1) != 0)
+			return 1;
+	}
+
+	return 0;
+}
+
+/* Append the end of journal marker, written when the journal is rolled over */
+int journalFormatEnd(buff_t *b, int format) {
+	if (format == JOURNAL_FORMAT_BINARY) {
+		struct journalRecord hdr = {0};
+
+		hdr.length = sizeof(hdr);
+		hdr.marker = '$';
+		hdr.crc = recordCrc(&hdr, NULL, 0);
+
+		return buffAdd(b, (char *)&hdr, sizeof(hdr));
+	}
+
+	return buffAdd(b, "$\n", 2);
+}
+
+static int mapJournal(struct journalReader *r) {
+	struct stat st;
+
+	if (fstat(r->fd, &st) != 0)
+		return 1;
+
+	if ((size_t)st.st_size == r->size)
+		return 0;
+
+	if (r->map)
+		munmap(r->map, r->size);
+
+	r->map = NULL;
+	r->size = st.st_size;
+
+	if (r->size == 0)
+		return 0;
+
+	r->map = mmap(NULL, r->size, PROT_READ, MAP_SHARED, r->fd, 0);
+
+	if (r->map == MAP_FAILED) {
+		r->map = NULL;
+		r->size = 0;
+		return 1;
+	}
+
+	madvise(r->map, r->size, MADV_SEQUENTIAL);
+
+	return 0;
+}
+
+int journalReaderOpen(struct journalReader *r, const char *path) {
+	memset(r, 0, sizeof(struct journalReader));
+
+	r->fd = open(path, O_RDONLY | O_CLOEXEC);
+
+	if (r->fd < 0)
+		return 1;
+
+	if (mapJournal(r) != 0) {
+		int saved = errno;
+		close(r->fd);
+		errno = saved;
+		return 1;
+	}
+
+	r->format = JOURNAL_FORMAT_TEXT;
+
+	if (r->size >= sizeof(struct journalFileHeader) && memcmp(r->map, JOURNAL_MAGIC, CONST_STRLEN(JOURNAL_MAGIC)) == 0) {
+		r->format = JOURNAL_FORMAT_BINARY;
+		r->offset = sizeof(struct journalFileHeader);
+	}
+
+	return 0;
+}
+
+/* Pick up anything appended to the journal since it was opened */
+int journalReaderRefresh(struct journalReader *r) {
+	return mapJournal(r);
+}
+
+void journalReaderClose(struct journalReader *r) {
+	if (r->map)
+		munmap(r->map, r->size);
+
+	if (r->fd >= 0)
+		close(r->fd);
+
+	free(r->line);
+	memset(r, 0, sizeof(struct journalReader));
+	r->fd = -1;
+}
+
+static int isZero(const char *p, size_t len) {
+	while (len--) {
+		if (*p++)
+			return 0;
+	}
+
+	return 1;
+}
+
+static int nextBinary(struct journalReader *r, struct journalEntry *e) {
+	const char *p = r->map + r->offset;
+	size_t remaining = r->size - r->offset;
+	struct journalRecord hdr;
+
+	if (remaining < sizeof(hdr)) {
+		if (isZero(p, remaining))
+			return JOURNAL_END;
+
+		r->torn_len = remaining;
+		return JOURNAL_TORN;
+	}
+
+	memcpy(&hdr, p, sizeof(hdr));
+
+	/* Zero filled space after the last record */
+	if (hdr.length == 0 && isZero(p, sizeof(hdr)))
+		return JOURNAL_END;
+
+	if (hdr.length < sizeof(hdr) || hdr.length > remaining || recordCrc(&hdr, p + sizeof(hdr), hdr.length - sizeof(hdr)) != hdr.crc) {
+		r->torn_len = (hdr.length >= sizeof(hdr) && hdr.length <= remaining) ? hdr.length : sizeof(hdr);
+		return JOURNAL_TORN;
+	}
+
+	if (hdr.marker == '$') {
+		r->eoj = 1;
+		return JOURNAL_END;
+	}
+
+	e->offset = r->offset;
+	e->marker = hdr.marker;
+	e->time_ms = hdr.time_ms;
+	e->uid = hdr.uid;
+	e->command = journalCommandName(hdr.cmd);
+	e->jobid = hdr.jobid;
+	e->revision = hdr.revision;
+	e->payload = p + sizeof(hdr);
+	e->payload_len = hdr.length - sizeof(hdr);
+
+	if (e->command == NULL)
+		return JOURNAL_CORRUPT;
+
+	r->offset += hdr.length;
+
+	return JOURNAL_RECORD;
+}
+
+static int nextText(struct journalReader *r, struct journalEntry *e) {
+	const char *p = r->map + r->offset;
+	size_t remaining = r->size - r->offset;
+	const char *end;
+	size_t len;
+	time_t timestamp_s;
+	int timestamp_ms;
+	int msg_offset = 0;
+
+	if (remaining == 0 || *p == '\0')
+		return JOURNAL_END;
+
+	end = memchr(p, '\n', remaining);
+
+	if (end == NULL || memchr(p, '\0', end - p) != NULL) {
+		/* A partial line, the rest of it was never written */
+		const char *nul = memchr(p, '\0', remaining);
+		r->torn_len = nul ? (size_t)(nul - p) : remaining;
+		return JOURNAL_TORN;
+	}
+
+	len = end - p;
+
+	if (*p == '$') {
+		r->eoj = 1;
+		return JOURNAL_END;
+	}
+
+	if (r->line_size < len + 1) {
+		r->line_size = len + 1;
+		r->line = realloc(r->line, r->line_size);
+
+		if (r->line == NULL)
+			return JOURNAL_CORRUPT;
+	}
+
+	memcpy(r->line, p, len);
+	r->line[len] = '\0';
+
+	e->offset = r->offset;
+	e->marker = *p;
+
+	if (sscanf(r->line + 1, "%ld.%d\t%d\t%64s\t%u\t%ld\t%n", &timestamp_s, &timestamp_ms, (int *)&e->uid, r->command, &e->jobid, &e->revision, &msg_offset) != 6 || msg_offset == 0)
+		return JOURNAL_CORRUPT;
+
+	e->time_ms = (int64_t)timestamp_s * 1000 + timestamp_ms;
+	e->command = r->command;
+	e->payload = p + 1 + msg_offset;
+	e->payload_len = len - 1 - msg_offset;
+
+	r->offset += len + 1;
+
+	return JOURNAL_RECORD;
+}
+
+/* Read the next record from the journal.
+ * Returns JOURNAL_RECORD and advances past it, or one of:
+ *   JOURNAL_END     - Nothing more has been written, or the end of journal marker was reached ('eoj' is set)
+ *   JOURNAL_TORN    - The record at 'offset' is incomplete or fails its CRC. 'torn_len' is its extent
+ *   JOURNAL_CORRUPT - The record is complete, but couldn't be parsed
+ * The offset is left on the record for anything but JOURNAL_RECORD.
+ * The payload points into the mapping of the journal, so stays valid until the reader is
+ * closed or refreshed. The command of a text record is only valid until the next call. */
+int journalReaderNext(struct journalReader *r, struct journalEntry *e) {
+	int rc;
+
+	if (r->eoj || (size_t)r->offset >= r->size)
+		return JOURNAL_END;
+
+	if (r->format == JOURNAL_FORMAT_BINARY)
+		rc = nextBinary(r, e);
+	else
+		rc = nextText(r, e);
+
+	if (rc == JOURNAL_RECORD)
+		r->record++;
+
+	return rc;
+}
+
+/* Text journals - Find the last line at or after 'from' starting with a '*',
+ * working backwards from the end of the written records */
+static off_t lastCommitText(struct journalReader *r, off_t from) {
+	const char *start = r->map + from;
+	const char *end = r->map + r->size;
+	const char *nl;
+
+	/* Skip the zero filled space, and any partial line at the end */
+	while (end > start && end[-1] == '\0')
+		end--;
+
+	if ((nl = memrchr(start, '\n', end - start)) == NULL)
+		return -1;
+
+	end = nl;
+
+	while (end > start) {
+		const char *line;
+
+		nl = memrchr(start, '\n', end - start);
+		line = nl ? nl + 1 : start;
+
+		if (*line == '*')
+			return end + 1 - r->map;
+
+		if (nl == NULL)
+			break;
+
+		end = nl;
+	}
+
+	return -1;
+}
+
+/* Returns the offset of the record following the last one marked as commited,
+ * only looking at the records from 'from' onwards. -1 if none of them are marked.
+ * Text journals are searched backwards, so only the records after the last commit are read */
+off_t journalLastCommit(struct journalReader *r, off_t from) {
+	struct journalEntry e;
+	off_t last_commit = -1;
+
+	if (from < r->offset)
+		from = r->offset;
+
+	if ((size_t)from >= r->size)
+		return -1;
+
+	if (r->format == JOURNAL_FORMAT_TEXT)
+		return lastCommitText(r, from);
+
+	r->offset = from;
+
+	while (journalReaderNext(r, &e) == JOURNAL_RECORD) {
+		if (e.marker == '*')
+			last_commit = r->offset;
+	}
+
+	return last_commit;
+}
@@ -0,0 +1,124 @@
+/* Copyright (c) 2018 Evan Wyatt
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ *    be used to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _journal_h
+#define _journal_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "buffer.h"
+
+#define JOURNAL_FORMAT_TEXT   0
+#define JOURNAL_FORMAT_BINARY 1
+
+/* Binary journals start with a file header, followed by the records.
+ * Each record is a fixed header followed by the JSON message. The CRC covers
+ * the length and everything from 'cmd' onwards, leaving out the marker byte so
+ * it can be updated in place. The space preallocated at the end of the
+ * journal is zero filled, so a record length of 0 is the end of the journal */
+
+#define JOURNAL_MAGIC "JERSJRNL"
+#define JOURNAL_VERSION 1
+
+struct journalFileHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t reserved;
+};
+
+struct journalRecord {
+	uint32_t length;    // Length of the record, including this header
+	uint32_t crc;       // CRC32C of the record, see above
+	char marker;        // ' ', '*' once written out to the state files, '$' end of journal
+	char reserved[3];
+	uint32_t cmd;       // Index into the journal command table
+	int64_t time_ms;
+	uint32_t uid;
+	uint32_t jobid;
+	int64_t revision;
+};
+
+/* Offset of the marker from the start of a record */
+#define journalMarkerOffset(_binary) ((_binary) ? offsetof(struct journalRecord, marker) : 0)
+
+/* A record read from either format */
+struct journalEntry {
+	off_t offset;
+	char marker;
+	int64_t time_ms;
+	uid_t uid;
+	const char *command;
+	uint32_t jobid;
+	int64_t revision;
+
+	const char *payload;   // JSON message, not NULL terminated
+	size_t payload_len;
+};
+
+/* Journals are read through a read-only mapping of the file */
+struct journalReader {
+	int fd;
+	int format;
+	char *map;
+	size_t size;
+
+	off_t offset;     // Offset of the next record
+	off_t record;     // Records read so far
+	int eoj;          // Stopped at the end of journal marker
+	size_t torn_len;  // Bytes making up the torn record at 'offset', see journalReaderNext()
+
+	/* Text journals - Copy of the current line */
+	char *line;
+	size_t line_size;
+	char command[65];
+};
+
+#define JOURNAL_RECORD  1   // Read a record
+#define JOURNAL_END     0   // End of the journal, or end of what's been written so far
+#define JOURNAL_TORN   -1   // Incomplete or damaged record at the current offset
+#define JOURNAL_CORRUPT -2  // Complete record that couldn't be parsed
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t len);
+
+uint32_t journalCommandId(const char *command);
+const char *journalCommandName(uint32_t id);
+
+int journalWriteHeader(int fd);
+int journalFormatRecord(buff_t *b, int format, const struct journalEntry *e);
+int journalFormatEnd(buff_t *b, int format);
+
+int journalReaderOpen(struct journalReader *r, const char *path);
+int journalReaderRefresh(struct journalReader *r);
+int journalReaderNext(struct journalReader *r, struct journalEntry *e);
+void journalReaderClose(struct journalReader *r);
+off_t journalLastCommit(struct journalReader *r, off_t from);
+
+#endif
@@ -0,0 +1,675 @@
+/* Copyright (c) 2018 Evan Wyatt
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ *    be used to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "common.h"
+#include "journal.h"
+#include "objstore.h"
+
+/* Log structured object store. See objstore.h for the layout.
+ *
+ * The segments are only appended to by the background save, one save at a time.
+ * The compactor only reads the sealed segments, so runs alongside the saves. Its
+ * output replaces the newest segment it read, then the older ones are removed.
+ * A deletion is carried into the output if it replaced an earlier version, so an
+ * older segment left behind by a crash can't bring the object back. */
+
+#define OBJSTORE_WRITE_SIZE 0x100000
+#define SEGMENT_PATTERN "segment.[0-9][0-9][0-9][0-9][0-9][0-9][0-9][0-9]"
+
+/* The path of a segment, or 1 if it doesn't fit in PATH_MAX */
+static int segmentPath(char *path, const char *dir, int64_t segment, const char *suffix) {
+	int len = snprintf(path, PATH_MAX, "%s/segment.%08ld%s", dir, segment, suffix);
+
+	if (len < 0 || len >= PATH_MAX) {
+		errno = ENAMETOOLONG;
+		return 1;
+	}
+
+	return 0;
+}
+
+/* A glob pattern matching every segment in 'dir' */
+static int segmentPattern(char *pattern, const char *dir) {
+	int len = snprintf(pattern, PATH_MAX, "%s/" SEGMENT_PATTERN, dir);
+
+	if (len < 0 || len >= PATH_MAX) {
+		errno = ENAMETOOLONG;
+		return 1;
+	}
+
+	return 0;
+}
+
+static int64_t segmentNumber(const char *path) {
+	return strtoll(strrchr(path, '.') + 1, NULL, 10);
+}
+
+static int syncDir(const char *dir) {
+	int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	int status;
+
+	if (fd < 0)
+		return 1;
+
+	status = fsync(fd);
+	close(fd);
+
+	return status != 0;
+}
+
+static int writeAll(int fd, const char *data, size_t size) {
+	size_t written = 0;
+
+	while (written < size) {
+		ssize_t len = write(fd, data + written, size - written);
+
+		if (len == -1) {
+			if (errno == EINTR)
+				continue;
+
+			return 1;
+		}
+
+		written += len;
+	}
+
+	return 0;
+}
+
+static size_t recordSize(const struct snapshotObject *o) {
+	return sizeof(struct snapshotRecord) + o->key_len + o->data_len;
+}
+
+static void formatHeader(buff_t *b, int64_t segment) {
+	struct objstoreHeader h;
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, OBJSTORE_MAGIC, sizeof(h.magic));
+	h.version = OBJSTORE_VERSION;
+	h.segment = segment;
+	h.create_time = time(NULL);
+	h.crc = crc32c(0, &h, sizeof(h));
+
+	buffAdd(b, (char *)&h, sizeof(h));
+}
+
+static int openSegment(struct objstoreSegment *seg, const char *path) {
+	struct objstoreHeader h;
+	struct stat st;
+	uint32_t crc;
+
+	seg->map = NULL;
+	seg->fd = open(path, O_RDONLY | O_CLOEXEC);
+
+	if (seg->fd < 0 || fstat(seg->fd, &st) != 0)
+		return 1;
+
+	seg->size = st.st_size;
+
+	if (seg->size < sizeof(h)) {
+		errno = EINVAL;
+		return 1;
+	}
+
+	seg->map = mmap(NULL, seg->size, PROT_READ, MAP_PRIVATE, seg->fd, 0);
+
+	if (seg->map == MAP_FAILED) {
+		seg->map = NULL;
+		return 1;
+	}
+
+	madvise(seg->map, seg->size, MADV_SEQUENTIAL);
+
+	memcpy(&h, seg->map, sizeof(h));
+	crc = h.crc;
+	h.crc = 0;
+
+	if (memcmp(h.magic, OBJSTORE_MAGIC, sizeof(h.magic)) != 0 || h.version != OBJSTORE_VERSION ||
+		crc32c(0, &h, sizeof(h)) != crc || h.segment != seg->segment) {
+		errno = EINVAL;
+		return 1;
+	}
+
+	seg->committed = sizeof(h);
+
+	return 0;
+}
+
+static void closeSegment(struct objstoreSegment *seg) {
+	if (seg->map)
+		munmap(seg->map, seg->size);
+
+	if (seg->fd >= 0)
+		close(seg->fd);
+
+	seg->map = NULL;
+	seg->fd = -1;
+}
+
+/* Make this record the latest version of its object */
+static int indexObject(struct objstoreIndex *idx, const struct snapshotObject *o) {
+	uint32_t type = o->type & ~OBJSTORE_DELETED;
+	int deleted = (o->type & OBJSTORE_DELETED) != 0;
+	struct objstoreEntry *e;
+
+	if (type < SNAPSHOT_RESOURCE || type > SNAPSHOT_JOB)
+		return 1;
+
+	HASH_FIND(hh, idx->objects[type], o->key, o->key_len, e);
+
+	if (e == NULL) {
+		if ((e = calloc(1, sizeof(struct objstoreEntry))) == NULL)
+			return 1;
+
+		e->o = *o;
+		HASH_ADD_KEYPTR(hh, idx->objects[type], e->o.key, e->o.key_len, e);
+	} else {
+		if (!e->deleted)
+			idx->live -= recordSize(&e->o);
+
+		e->replaced = deleted && (!e->deleted || e->replaced);
+		e->o = *o;
+	}
+
+	e->deleted = deleted;
+
+	if (!deleted)
+		idx->live += recordSize(o);
+
+	return 0;
+}
+
+/* Index the records of each complete save in the segment */
+static int readSegment(struct objstoreIndex *idx, struct objstoreSegment *seg) {
+	struct item_list pending;
+	struct snapshotObject o, *p;
+	off_t offset = seg->committed;
+	size_t length;
+	int status = 0;
+
+	listNew(&pending, sizeof(struct snapshotObject));
+
+	while ((length = snapshotRecordRead(seg->map + offset, seg->size - offset, &o)) != 0) {
+		offset += length;
+
+		if (o.type != OBJSTORE_COMMIT) {
+			listAdd(&pending, &o);
+			continue;
+		}
+
+		if (o.data_len != sizeof(struct objstoreCommit) || o.data[offsetof(struct objstoreCommit, journal) + 15] != '\0') {
+			status = 1;
+			break;
+		}
+
+		LIST_ITER(&pending, p) {
+			if (indexObject(idx, p) != 0) {
+				status = 1;
+				break;
+			}
+		}
+
+		if (status)
+			break;
+
+		memcpy(&idx->commit, o.data, sizeof(struct objstoreCommit));
+		idx->committed = 1;
+		idx->records += pending.count;
+		seg->committed = offset;
+
+		listFree(&pending);
+		listNew(&pending, sizeof(struct snapshotObject));
+	}
+
+	listFree(&pending);
+
+	if (status) {
+		errno = EINVAL;
+		return 1;
+	}
+
+	idx->uncommitted += seg->size - seg->committed;
+
+	return 0;
+}
+
+/* Read the segments in 'dir' numbered below 'below' (or all of them if it's 0) into the index.
+ * The segments are left mapped until the index is freed */
+int objstoreLoad(struct objstoreIndex *idx, const char *dir, int64_t below) {
+	char pattern[PATH_MAX];
+	glob_t segments;
+	size_t i;
+	int rc;
+
+	memset(idx, 0, sizeof(struct objstoreIndex));
+
+	if (segmentPattern(pattern, dir) != 0)
+		return 1;
+
+	rc = glob(pattern, 0, NULL, &segments);
+
+	if (rc != 0) {
+		globfree(&segments);
+
+		if (rc == GLOB_NOMATCH)
+			return 0;
+
+		errno = EIO;
+		return 1;
+	}
+
+	idx->segments = calloc(segments.gl_pathc, sizeof(struct objstoreSegment));
+
+	if (idx->segments == NULL) {
+		globfree(&segments);
+		return 1;
+	}
+
+	for (i = 0; i < segments.gl_pathc; i++) {
+		struct objstoreSegment *seg = &idx->segments[idx->segment_count];
+
+		seg->segment = segmentNumber(segments.gl_pathv[i]);
+
+		if (below > 0 && seg->segment >= below)
+			break;
+
+		idx->segment_count++;
+
+		if (openSegment(seg, segments.gl_pathv[i]) != 0 || readSegment(idx, seg) != 0) {
+			int saved = errno;
+			globfree(&segments);
+			objstoreIndexFree(idx);
+			errno = saved;
+			return 1;
+		}
+	}
+
+	globfree(&segments);
+
+	return 0;
+}
+
+void objstoreIndexFree(struct objstoreIndex *idx) {
+	struct objstoreEntry *e, *tmp;
+	size_t i;
+
+	for (i = 0; i < OBJSTORE_TYPES; i++) {
+		HASH_ITER(hh, idx->objects[i], e, tmp) {
+			HASH_DEL(idx->objects[i], e);
+			free(e);
+		}
+	}
+
+	for (i = 0; i < idx->segment_count; i++)
+		closeSegment(&idx->segments[i]);
+
+	free(idx->segments);
+	memset(idx, 0, sizeof(struct objstoreIndex));
+}
+
+/* Create a new segment to append to. It's written under a temporary name first,
+ * so a segment always has a valid header */
+static int createSegment(struct objstore *s, int64_t segment) {
+	char path[PATH_MAX];
+	char new_path[PATH_MAX];
+	buff_t b;
+	int fd, status;
+
+	if (segmentPath(path, s->dir, segment, "") != 0 || segmentPath(new_path, s->dir, segment, ".new") != 0)
+		return 1;
+
+	fd = open(new_path, O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, 0666);
+
+	if (fd < 0)
+		return 1;
+
+	buffNew(&b, sizeof(struct objstoreHeader));
+	formatHeader(&b, segment);
+	status = writeAll(fd, b.data, b.used) != 0 || fsync(fd) != 0;
+	buffFree(&b);
+	close(fd);
+
+	if (status || rename(new_path, path) != 0 || syncDir(s->dir) != 0)
+		return 1;
+
+	if ((fd = open(path, O_WRONLY | O_APPEND | O_CLOEXEC)) < 0)
+		return 1;
+
+	s->fd = fd;
+	s->segment = segment;
+	s->size = sizeof(struct objstoreHeader);
+
+	return 0;
+}
+
+/* Open the newest segment for appending, dropping anything after its last commit.
+ * A new store is started if the index doesn't have any segments */
+int objstoreOpen(struct objstore *s, const char *dir, const struct objstoreIndex *idx) {
+	char path[PATH_MAX];
+
+	memset(s, 0, sizeof(struct objstore));
+	s->fd = -1;
+
+	if (strlen(dir) >= sizeof(s->dir)) {
+		errno = ENAMETOOLONG;
+		return 1;
+	}
+
+	strcpy(s->dir, dir);
+
+	if (mkdir(dir, S_IRWXU|S_IRGRP|S_IXGRP) != 0 && errno != EEXIST)
+		return 1;
+
+	if (idx == NULL || idx->segment_count == 0)
+		return createSegment(s, 1);
+
+	const struct objstoreSegment *last = &idx->segments[idx->segment_count - 1];
+	if (segmentPath(path, dir, last->segment, "") != 0)
+		return 1;
+
+	if ((s->fd = open(path, O_WRONLY | O_APPEND | O_CLOEXEC)) < 0)
+		return 1;
+
+	if (last->committed < (off_t)last->size && (ftruncate(s->fd, last->committed) != 0 || fdatasync(s->fd) != 0)) {
+		objstoreClose(s);
+		return 1;
+	}
+
+	s->segment = last->segment;
+	s->size = last->committed;
+
+	return 0;
+}
+
+/* Seal the current segment, appending to a new one */
+int objstoreRoll(struct objstore *s) {
+	int old = s->fd;
+
+	if (createSegment(s, s->segment + 1) != 0) {
+		int saved = errno;
+		s->fd = old;
+		errno = saved;
+		return 1;
+	}
+
+	close(old);
+
+	return 0;
+}
+
+void objstoreClose(struct objstore *s) {
+	if (s->fd >= 0)
+		close(s->fd);
+
+	s->fd = -1;
+}
+
+/* Total size of the segments before the one being appended to */
+off_t objstoreSealedSize(const struct objstore *s) {
+	char pattern[PATH_MAX];
+	glob_t segments;
+	struct stat st;
+	off_t size = 0;
+	size_t i;
+
+	if (segmentPattern(pattern, s->dir) != 0)
+		return 0;
+
+	if (glob(pattern, 0, NULL, &segments) == 0) {
+		for (i = 0; i < segments.gl_pathc; i++) {
+			if (segmentNumber(segments.gl_pathv[i]) < s->segment && stat(segments.gl_pathv[i], &st) == 0)
+				size += st.st_size;
+		}
+	}
+
+	globfree(&segments);
+
+	return size;
+}
+
+void objstoreFormatDelete(buff_t *b, uint32_t type, const char *key) {
+	size_t start = snapshotBeginObject(b, type | OBJSTORE_DELETED, key);
+	snapshotEndObject(b, start);
+}
+
+void objstoreFormatCommit(buff_t *b, struct objstoreCommit *c) {
+	size_t start = snapshotBeginObject(b, OBJSTORE_COMMIT, "");
+	buffAdd(b, (char *)c, sizeof(struct objstoreCommit));
+	snapshotEndObject(b, start);
+}
+
+/* Rewrite the segments numbered below 'below' as a single segment holding the latest
+ * version of each object. The size of the new segment is returned in 'size' */
+int objstoreCompact(const char *dir, int64_t below, off_t *size) {
+	char path[PATH_MAX];
+	char new_path[PATH_MAX];
+	struct objstoreIndex idx;
+	struct objstoreEntry *e, *tmp;
+	int64_t last, records = 0;
+	off_t written = 0;
+	size_t i;
+	buff_t b;
+	int fd, type;
+
+	*size = 0;
+
+	if (objstoreLoad(&idx, dir, below) != 0)
+		return 1;
+
+	if (idx.segment_count == 0) {
+		objstoreIndexFree(&idx);
+		return 0;
+	}
+
+	last = idx.segments[idx.segment_count - 1].segment;
+
+	if (segmentPath(path, dir, last, "") != 0 || segmentPath(new_path, dir, last, ".compact") != 0) {
+		objstoreIndexFree(&idx);
+		return 1;
+	}
+
+	fd = open(new_path, O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, 0666);
+
+	if (fd < 0) {
+		objstoreIndexFree(&idx);
+		return 1;
+	}
+
+	buffNew(&b, OBJSTORE_WRITE_SIZE * 2);
+	formatHeader(&b, last);
+
+	/* Resources and queues first, as the jobs refer to them. The records are
+	 * copied as they are, their CRCs still hold */
+	for (type = SNAPSHOT_RESOURCE; type <= SNAPSHOT_JOB; type++) {
+		HASH_ITER(hh, idx.objects[type], e, tmp) {
+			if (e->deleted && !e->replaced)
+				continue;
+
+			buffAdd(&b, e->o.key - sizeof(struct snapshotRecord), recordSize(&e->o));
+			records++;
+
+			if (b.used >= OBJSTORE_WRITE_SIZE) {
+				if (writeAll(fd, b.data, b.used) != 0)
+					goto fail;
+
+				written += b.used;
+				buffClear(&b, 0);
+			}
+		}
+	}
+
+	if (idx.committed) {
+		struct objstoreCommit c = idx.commit;
+		c.records = records;
+		objstoreFormatCommit(&b, &c);
+	}
+
+	if (writeAll(fd, b.data, b.used) != 0 || fsync(fd) != 0)
+		goto fail;
+
+	written += b.used;
+	close(fd);
+	buffFree(&b);
+
+	if (rename(new_path, path) != 0 || syncDir(dir) != 0) {
+		objstoreIndexFree(&idx);
+		return 1;
+	}
+
+	/* The older segments are covered by the new one now */
+	for (i = 0; i + 1 < idx.segment_count; i++) {
+		if (segmentPath(path, dir, idx.segments[i].segment, "") == 0)
+			unlink(path);
+	}
+
+	syncDir(dir);
+	objstoreIndexFree(&idx);
+
+	*size = written;
+
+	return 0;
+
+fail:
+	close(fd);
+	buffFree(&b);
+	unlink(new_path);
+	objstoreIndexFree(&idx);
+	return 1;
+}
+
+/* Compaction runs on its own thread, with the result collected by objstoreCompactCheck() */
+
+static struct {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int running;
+	int finished;
+	int status;
+	int error;
+
+	char dir[PATH_MAX];
+	int64_t below;
+	off_t size;
+} compactor = {.lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER};
+
+static void *compactorMain(void *arg) {
+	UNUSED(arg);
+	off_t size = 0;
+	int status = objstoreCompact(compactor.dir, compactor.below, &size);
+	int error = errno;
+
+	pthread_mutex_lock(&compactor.lock);
+	compactor.status = status;
+	compactor.error = error;
+	compactor.size = size;
+	compactor.finished = 1;
+	pthread_cond_signal(&compactor.cond);
+	pthread_mutex_unlock(&compactor.lock);
+
+	return NULL;
+}
+
+int objstoreCompactStart(const char *dir, int64_t below) {
+	sigset_t all, old;
+	int err;
+
+	if (compactor.running) {
+		errno = EBUSY;
+		return 1;
+	}
+
+	if (strlen(dir) >= sizeof(compactor.dir)) {
+		errno = ENAMETOOLONG;
+		return 1;
+	}
+
+	strcpy(compactor.dir, dir);
+	compactor.below = below;
+	compactor.finished = 0;
+
+	/* Signals are left to the main thread */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+
+	err = pthread_create(&compactor.thread, NULL, compactorMain, NULL);
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (err != 0) {
+		errno = err;
+		return 1;
+	}
+
+	compactor.running = 1;
+
+	return 0;
+}
+
+/* Check on a compaction started with objstoreCompactStart(), waiting for it if 'block' is set.
+ * Returns its status once it has finished, or -1 if it's still running or wasn't started */
+int objstoreCompactCheck(int block, off_t *size) {
+	int finished;
+
+	if (!compactor.running)
+		return -1;
+
+	pthread_mutex_lock(&compactor.lock);
+
+	while (block && !compactor.finished)
+		pthread_cond_wait(&compactor.cond, &compactor.lock);
+
+	finished = compactor.finished;
+
+	pthread_mutex_unlock(&compactor.lock);
+
+	if (!finished)
+		return -1;
+
+	pthread_join(compactor.thread, NULL);
+	compactor.running = 0;
+
+	*size = compactor.size;
+	errno = compactor.error;
+
+	return compactor.status;
+}
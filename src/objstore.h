@@ -0,0 +1,140 @@
+/* Copyright (c) 2018 Evan Wyatt
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ *    be used to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _objstore_h
+#define _objstore_h
+
+#include <stdint.h>
+#include <limits.h>
+#include <sys/types.h>
+
+#include <uthash.h>
+
+#include "buffer.h"
+#include "snapshot.h"
+
+/* Log structured object store, used with 'state_format log'.
+ *
+ * Each background save appends the changed objects to the current segment file
+ * (state_dir/objects/segment.NNNNNNNN), followed by a commit record holding the journal
+ * position the save is current to, and flushes the segment once. The records use the
+ * same framing and CRC as snapshot records. Anything after the last commit record of a
+ * segment is from a save that didn't complete, and is ignored.
+ *
+ * Loading reads the segments in order, indexing the latest version of each object.
+ * Once the segment being appended to reaches its size limit, a new one is started.
+ * The compactor rewrites the sealed segments as a single segment holding only the
+ * latest version of each object. */
+
+#define OBJSTORE_MAGIC "JERSOBJS"
+#define OBJSTORE_VERSION 1
+#define OBJSTORE_DIR "objects"
+
+#define OBJSTORE_COMMIT  5       // Closes the records of a save. Objects use the SNAPSHOT_* types
+#define OBJSTORE_DELETED 0x100   // Flag on an object's record type - The object was deleted
+
+#define OBJSTORE_TYPES (SNAPSHOT_JOB + 1)
+
+/* Compact once the sealed segments are this many times the size of the live objects */
+#define OBJSTORE_COMPACT_RATIO 2
+
+struct objstoreHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t crc;             // CRC32C of the header, calculated with this set to 0
+	int64_t segment;
+	int64_t create_time;
+};
+
+struct objstoreCommit {
+	int64_t save_time;
+	uint32_t start_jobid;
+	uint32_t reserved;
+
+	/* The journal position the save is current to, as in a snapshot header */
+	char journal[16];
+	int64_t journal_offset;
+	int64_t journal_record;
+	uint64_t journal_inode;
+
+	int64_t records;          // Object records in this save
+};
+
+/* The latest version of an object. The object points into the mapped segment */
+struct objstoreEntry {
+	struct snapshotObject o;
+	int deleted;
+	int replaced;             // A deletion that replaced an earlier version of the object
+	UT_hash_handle hh;
+};
+
+struct objstoreSegment {
+	int64_t segment;
+	int fd;
+	char *map;
+	size_t size;
+	off_t committed;          // Offset following the last commit record
+};
+
+struct objstoreIndex {
+	struct objstoreEntry *objects[OBJSTORE_TYPES];	// Keyed on the name/jobid, for each SNAPSHOT_* type
+	struct objstoreSegment *segments;
+	size_t segment_count;
+
+	struct objstoreCommit commit;	// The last commit read
+	int committed;
+	int64_t records;				// Committed object records read
+	off_t live;						// Size of the latest version of each object
+	off_t uncommitted;				// Bytes following the last commit in each segment
+};
+
+/* The segment being appended to */
+struct objstore {
+	char dir[PATH_MAX];
+	int fd;
+	int64_t segment;
+	off_t size;
+};
+
+int objstoreLoad(struct objstoreIndex *idx, const char *dir, int64_t below);
+void objstoreIndexFree(struct objstoreIndex *idx);
+
+int objstoreOpen(struct objstore *s, const char *dir, const struct objstoreIndex *idx);
+int objstoreRoll(struct objstore *s);
+void objstoreClose(struct objstore *s);
+off_t objstoreSealedSize(const struct objstore *s);
+
+void objstoreFormatDelete(buff_t *b, uint32_t type, const char *key);
+void objstoreFormatCommit(buff_t *b, struct objstoreCommit *c);
+
+int objstoreCompact(const char *dir, int64_t below, off_t *size);
+int objstoreCompactStart(const char *dir, int64_t below);
+int objstoreCompactCheck(int block, off_t *size);
+
+#endif
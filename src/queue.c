@@ -45,6 +45,7 @@
 int addQueue(struct queue * q, int dirty) {
 
 	HASH_ADD_STR(server.queueTable, name, q);
+	initCandidates(q);
 
 	if (q->def)
 		setDefaultQueue(q);
@@ -120,6 +121,7 @@ void freeQueue(struct queue * q) {
 	free(q->desc);
 	free(q->host);
 
+	heapFree(&q->pending);
 	free(q);
 }
 
@@ -155,7 +157,6 @@ int cleanupQueues(uint32_t max_clean) {
 		/* Got a queue to remove */
 		print_msg(JERS_LOG_DEBUG, "Removing deleted queue: %s", q->name);
 
-		stateDelQueue(q);
 		HASH_DEL(server.queueTable, q);
 		freeQueue(q);
 
@@ -34,6 +34,7 @@
 
 int addRes(struct resource * r, int dirty) {
 	HASH_ADD_STR(server.resTable, name, r);
+	initResourceWaiters(r);
 
 	r->obj.type = JERS_OBJECT_RESOURCE;
 	updateObject(&r->obj, dirty);
@@ -42,6 +43,7 @@ int addRes(struct resource * r, int dirty) {
 
 void freeRes(struct resource * r) {
 	free(r->name);
+	heapFree(&r->waiting);
 	free(r);
 }
 
@@ -54,12 +56,17 @@ struct resource * findResource(char * name) {
 
 /* Check if all the resources assigned to the job can be allocated */
 int checkRes(struct job *j) {
+	return unavailableRes(j) != NULL;
+}
+
+/* Return the first resource the job requires that doesn't have enough available */
+struct resource *unavailableRes(struct job *j) {
 	for (int i = 0; i < j->res_count; i++) {
 		if (j->req_resources[i].needed > j->req_resources[i].res->count - j->req_resources[i].res->in_use)
-			return 1;
+			return j->req_resources[i].res;
 	}
 
-	return 0;
+	return NULL;
 }
 
 /* Allocate all the resources assigned to the job */
@@ -75,6 +82,8 @@ void deallocateRes(struct job *j) {
 
 		if (unlikely(j->req_resources[i].res->in_use < 0))
 			j->req_resources[i].res->in_use = 0;
+
+		wakeResourceWaiters(j->req_resources[i].res);
 	}
 }
 
@@ -99,7 +108,6 @@ int cleanupResources(uint32_t max_clean) {
 		/* Got a resources to remove */
 		print_msg(JERS_LOG_DEBUG, "Removing deleted resource: %s", r->name);
 
-		stateDelResource(r);
 		HASH_DEL(server.resTable, r);
 		freeRes(r);
 
@@ -31,11 +31,12 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <time.h>
+#include <string.h>
+#include <stddef.h>
+#include <limits.h>
 #include <commands.h>
 #include <json.h>
 
-#include <utlist.h>
-
 int __comp(const void * a_, const void * b_) {
 	const struct job * a = *((struct job **) a_);
 	const struct job * b = *((struct job **) b_);
@@ -120,164 +121,308 @@ void sendStartCmd(struct job * j) {
 /* Check for any deferred jobs that need to be released */
 
 void releaseDeferred(void) {
-	int64_t released = 0;
-	struct job *j, *tmp;
-	time_t now = time(NULL);
+	struct job *j;
+	time_t now;
+
+	if (server.deferred.count == 0)
+		return;
+
+	now = time(NULL);
 
-	DL_FOREACH_SAFE2(server.deferred_list, j, tmp, deferred_next) {
+	while ((j = heapPeek(&server.deferred)) != NULL) {
 		if (now < j->defer_time)
 			break;
 
+		heapPop(&server.deferred);
 		j->defer_time = 0;
 		changeJobState(j, JERS_JOB_PENDING, NULL, 0);
-		removeDeferredJob(j);
-		released++;
 	}
-
-	if (released)
-		server.candidate_recalc = 1;
 }
 
-/* Generate a sorted array of jobs that can be started. */
+/* Return the number of milliseconds until the next deferred job is due, or -1 if there are none */
+int nextDeferredTimeout(void) {
+	struct job *j = heapPeek(&server.deferred);
+	struct timespec now;
+	int64_t due;
 
-int64_t generateCandidatePool(void) {
-	int64_t total_job_count = server.stats.jobs.pending + server.stats.jobs.deferred + server.stats.jobs.holding;
-	int64_t candidate_count = 0;
-	struct job * j;
-	int64_t start, end;
+	if (j == NULL)
+		return -1;
 
-	start = getTimeMS();
+	clock_gettime(CLOCK_REALTIME, &now);
+	due = ((int64_t)j->defer_time * 1000) - ((now.tv_sec * 1000) + (now.tv_nsec / 1000000));
 
-	print_msg(JERS_LOG_DEBUG, "Regenerating job candidate pool");
+	if (due <= 0)
+		return 0;
 
-	/* Assume we will need to add every non-completed job into this pool at some point.
-	 * We add some additional room so we don't need to realloc constantly */
+	return due > INT_MAX ? INT_MAX : due;
+}
 
-	if (server.candidate_pool_size < total_job_count) {
-		server.candidate_pool_size = total_job_count * 1.5;
-		server.candidate_pool = realloc(server.candidate_pool, sizeof(struct job *) * server.candidate_pool_size);
-	}
+/* Request a scheduling pass. In event mode, the main loop runs one pass
+ * for however many requests were made since the previous pass */
+void requestSchedule(void) {
+	server.sched_pending = 1;
+}
 
-	if (server.stats.jobs.pending == 0) {
-		server.candidate_pool_jobs = 0;
-		server.candidate_recalc = 0;
-		return server.candidate_pool_jobs;
-	}
+/* Each queue maintains a heap of its pending jobs, ordered by job priority then jobid.
+ * Jobs are added/removed as they enter/leave the pending state via changeJobState(),
+ * so the scheduler never needs to scan the job table or sort the candidates. */
 
-	/* Check each job for it's eligibility */
+static int candidateCompare(const void *a_, const void *b_) {
+	const struct job *a = a_;
+	const struct job *b = b_;
 
-	for (j = server.jobTable; j != NULL; j = j->hh.next) {
-		if (j->internal_state &JERS_FLAG_DELETED)
-			continue;
+	if (a->priority != b->priority)
+		return b->priority - a->priority;
 
-		if (j->state != JERS_JOB_PENDING)
-			continue;
+	return a->jobid - b->jobid;
+}
 
-		server.candidate_pool[candidate_count++] = j;
-	}
+/* Compare two jobs in the order the scheduler would try to start them */
+static int scheduleCompare(const void *a, const void *b) {
+	return __comp(&a, &b);
+}
 
-	qsort(server.candidate_pool, candidate_count, sizeof(struct job *), __comp);
-	server.candidate_pool_jobs = candidate_count;
-	server.candidate_recalc = 0;
-	end = getTimeMS();
-	print_msg(JERS_LOG_DEBUG, "Regenerated job candidate pool. Took %ldms", end - start);
-	return server.candidate_pool_jobs;
+void initCandidates(struct queue *q) {
+	heapNew(&q->pending, candidateCompare, offsetof(struct job, candidate_index));
 }
 
-/* Main scheduling function
- * - This is started via an event, every server.schedfreq milliseconds.
- *   We will only attempt to release server.sched_max jobs per attempt, to
- *   avoid becoming unresponsive. */
+void addCandidate(struct job *j) {
+	if (j->candidate_index || j->waiting_res || j->internal_state &(JERS_FLAG_DELETED | JERS_FLAG_JOB_STARTED))
+		return;
 
-void checkJobs(void) {
-	int64_t i = 0;
-	jobid_t checked = 0;
-	jobid_t started = 0;
-	jobid_t jobs_to_start = server.sched_max;
-	struct job * j;
+	if (heapAdd(&j->queue->pending, j) != 0)
+		error_die("Failed to add job %d to queue candidate list: %s", j->jobid, strerror(errno));
 
-	/* Don't need to do anything if we are at maximum capacity */
-	if (server.max_run_jobs != UNLIMITED_JOBS && server.stats.jobs.running >= server.max_run_jobs)
+	requestSchedule();
+}
+
+void removeCandidate(struct job *j) {
+	if (j->waiting_res) {
+		heapRemove(&j->waiting_res->waiting, j);
+		j->waiting_res = NULL;
 		return;
+	}
 
-	if (server.candidate_recalc)
-		generateCandidatePool();
+	if (j->candidate_index == 0)
+		return;
 
-	jobs_to_start = server.candidate_pool_jobs;
+	heapRemove(&j->queue->pending, j);
+}
 
-	if (server.max_run_jobs != UNLIMITED_JOBS &&
-		jobs_to_start > server.max_run_jobs - server.stats.jobs.running) {
-		jobs_to_start = server.max_run_jobs - server.stats.jobs.running;
+/* Called after a jobs priority has been modified */
+void updateCandidate(struct job *j) {
+	if (j->waiting_res) {
+		heapUpdate(&j->waiting_res->waiting, j);
+		return;
 	}
 
-	/* If we are in readonly mode, tag all jobs that would have been eligble to run
-	 * with a readonly pend reason */
+	if (j->candidate_index == 0)
+		return;
 
-	if (unlikely(server.readonly)) {
-		for (i = 0; i < server.candidate_pool_jobs; i++) {
-			checked++;
-			j = server.candidate_pool[i];
+	heapUpdate(&j->queue->pending, j);
+}
 
-			if (j == NULL)
-				continue;
+/* Jobs that can't start due to a resource being unavailable are moved off their queue's
+ * heap and onto a wait list on that resource, so they aren't rechecked on every pass.
+ * When capacity is returned to the resource, waiters that fit are made candidates again. */
 
-			if (j->state != JERS_JOB_PENDING || j->internal_state &JERS_FLAG_JOB_STARTED)
-				continue;
+void initResourceWaiters(struct resource *r) {
+	heapNew(&r->waiting, scheduleCompare, offsetof(struct job, waiting_index));
+}
 
-			j->pend_reason = JERS_PEND_READONLY;
-			continue;
-		}
+static void addWaiter(struct job *j, struct resource *r) {
+	removeCandidate(j);
 
-		return;
-	}
+	if (heapAdd(&r->waiting, j) != 0)
+		error_die("Failed to add job %d to resource wait list: %s", j->jobid, strerror(errno));
 
-	for (i = 0; i < server.candidate_pool_jobs; i++) {
-		checked++;
-		j = server.candidate_pool[i];
+	j->waiting_res = r;
+}
 
-		/* We can have gaps in the pool if we've removed a job */
-		if (j == NULL)
-			continue;
+void wakeResourceWaiters(struct resource *r) {
+	int32_t available = r->count - r->in_use;
+	struct item_list skipped;
+	struct job *j, **sj;
 
-		if (j->state != JERS_JOB_PENDING || j->internal_state &JERS_FLAG_JOB_STARTED)
-			continue;
+	if (r->waiting.count == 0 || available <= 0)
+		return;
 
-		j->pend_reason = 0;
+	listNew(&skipped, sizeof(struct job *));
 
-		if (server.max_run_jobs != UNLIMITED_JOBS && server.stats.jobs.running + server.stats.jobs.start_pending > server.max_run_jobs) {
-			j->pend_reason = JERS_PEND_SYSTEMFULL;
-			continue;
-		}
+	/* Hand the available count to the waiters in priority order,
+	 * passing over any that need more than is left */
+	while (available > 0 && (j = heapPop(&r->waiting)) != NULL) {
+		int32_t needed = 0;
+
+		j->waiting_res = NULL;
 
-		/* Check the queue limit */
-		if (j->queue->stats.running + j->queue->stats.start_pending >= j->queue->job_limit) {
-			j->pend_reason = JERS_PEND_QUEUEFULL;
+		/* A job its queue can't start yet doesn't take any of the count. It's made a
+		 * candidate again, so it's rechecked once the queue is able to start it */
+		if (queuePendReason(j->queue)) {
+			addCandidate(j);
 			continue;
 		}
 
-		/* Resources available? */
-		if (j->res_count) {
-			if (checkRes(j)) {
-				/* Not enough of the required resources are available */
-				j->pend_reason = JERS_PEND_NORES;
-				continue;
+		for (int i = 0; i < j->res_count; i++) {
+			if (j->req_resources[i].res == r) {
+				needed = j->req_resources[i].needed;
+				break;
 			}
 		}
 
-		/* Queue stopped? */
-		if (!(j->queue->state &JERS_QUEUE_FLAG_STARTED)) {
-			j->pend_reason = JERS_PEND_QUEUESTOPPED;
+		if (needed > available) {
+			if (listAdd(&skipped, &j) != 0)
+				error_die("Failed to track resource waiter %d: %s", j->jobid, strerror(errno));
+
 			continue;
 		}
 
-		/* Agent not connected? */
-		if (j->queue->agent == NULL || j->queue->agent->logged_in == 0) {
-			j->pend_reason = JERS_PEND_AGENTDOWN;
+		available -= needed;
+		addCandidate(j);
+	}
+
+	LIST_ITER(&skipped, sj) {
+		addWaiter(*sj, r);
+	}
+
+	listFree(&skipped);
+}
+
+/* The wait lists are in scheduling order, which includes the queue priority.
+ * Called after a queue's priority has been changed */
+void resortResourceWaiters(void) {
+	for (struct resource *r = server.resTable; r != NULL; r = r->hh.next)
+		heapRebuild(&r->waiting);
+}
+
+/* Walk the candidates across all queues in scheduling order (queue priority, job priority, jobid)
+ * A 'frontier' heap holds the next possible job from each queue. Once a job has been returned,
+ * the jobs behind it in its queue's heap are only considered if expandCandidate() is called,
+ * allowing the caller to skip the rest of a queue without visiting its jobs. */
+
+static struct heap frontier;
+
+void startCandidates(int all) {
+	struct queue *q;
+
+	if (frontier.cmp == NULL)
+		heapNew(&frontier, scheduleCompare, HEAP_NO_INDEX);
+
+	frontier.count = 0;
+
+	for (q = server.queueTable; q != NULL; q = q->hh.next) {
+		struct job *j = heapPeek(&q->pending);
+
+		/* Skip over queues that can't start any of their jobs */
+		if (!all && queuePendReason(q))
 			continue;
-		}
 
-		if (j->queue->agent->recon) {
-			j->pend_reason = JERS_PEND_RECON;
+		if (j && heapAdd(&frontier, j) != 0)
+			error_die("Failed to add to candidate frontier: %s", strerror(errno));
+	}
+}
+
+struct job *nextCandidate(void) {
+	return heapPop(&frontier);
+}
+
+/* Queue up the children of 'j' in its queue's heap. Must be called before the queue heap is modified. */
+void expandCandidate(struct job *j) {
+	struct heap *h = &j->queue->pending;
+	size_t child = j->candidate_index * 2 - 1;
+
+	for (size_t i = child; i < child + 2 && i < h->count; i++) {
+		if (heapAdd(&frontier, h->items[i]) != 0)
+			error_die("Failed to add to candidate frontier: %s", strerror(errno));
+	}
+}
+
+/* Return the reason no job in this queue can be started, or 0 if the queue is eligible */
+int queuePendReason(struct queue *q) {
+	if (q->stats.running + q->stats.start_pending >= q->job_limit)
+		return JERS_PEND_QUEUEFULL;
+
+	if (!(q->state &JERS_QUEUE_FLAG_STARTED))
+		return JERS_PEND_QUEUESTOPPED;
+
+	if (q->agent == NULL || q->agent->logged_in == 0)
+		return JERS_PEND_AGENTDOWN;
+
+	if (q->agent->recon)
+		return JERS_PEND_RECON;
+
+	return 0;
+}
+
+/* The scheduler doesn't record why a job wasn't started, so work
+ * out the pend reason for a job when it's requested. */
+int getPendReason(struct job *j) {
+	int reason;
+
+	if (j->state != JERS_JOB_PENDING || j->internal_state &JERS_FLAG_JOB_STARTED)
+		return j->pend_reason;
+
+	if (unlikely(server.readonly))
+		return JERS_PEND_READONLY;
+
+	if (server.max_run_jobs != UNLIMITED_JOBS && server.stats.jobs.running + server.stats.jobs.start_pending >= server.max_run_jobs)
+		return JERS_PEND_SYSTEMFULL;
+
+	reason = queuePendReason(j->queue);
+
+	if (reason == JERS_PEND_QUEUEFULL)
+		return reason;
+
+	if (j->res_count && checkRes(j))
+		return JERS_PEND_NORES;
+
+	return reason ? reason : j->pend_reason;
+}
+
+/* Main scheduling function
+ * - This is started via an event, every server.schedfreq milliseconds.
+ *   We will only attempt to release server.sched_max jobs per attempt, to
+ *   avoid becoming unresponsive. */
+
+void checkJobs(void) {
+	jobid_t started = 0;
+	jobid_t jobs_to_start;
+	struct job * j;
+	struct job ** sj;
+	struct item_list started_jobs;
+	struct item_list blocked_jobs;
+
+	/* In readonly mode jobs are never started, getPendReason() will report why */
+	if (server.stats.jobs.pending == 0 || unlikely(server.readonly))
+		return;
+
+	/* Don't need to do anything if we are at maximum capacity */
+	if (server.max_run_jobs != UNLIMITED_JOBS && server.stats.jobs.running + server.stats.jobs.start_pending >= server.max_run_jobs)
+		return;
+
+	jobs_to_start = server.stats.jobs.pending;
+
+	if (server.max_run_jobs != UNLIMITED_JOBS &&
+		jobs_to_start > server.max_run_jobs - server.stats.jobs.running - server.stats.jobs.start_pending) {
+		jobs_to_start = server.max_run_jobs - server.stats.jobs.running - server.stats.jobs.start_pending;
+	}
+
+	listNew(&started_jobs, sizeof(struct job *));
+	listNew(&blocked_jobs, sizeof(struct job *));
+	startCandidates(0);
+
+	while ((j = nextCandidate()) != NULL) {
+		/* Starting an earlier job may have filled up this queue */
+		if (j->queue->stats.running + j->queue->stats.start_pending >= j->queue->job_limit)
+			continue;
+
+		expandCandidate(j);
+
+		/* Resources available? If not, wait for them to be released */
+		if (j->res_count && checkRes(j)) {
+			if (listAdd(&blocked_jobs, &j) != 0)
+				error_die("Failed to track blocked job %d: %s", j->jobid, strerror(errno));
+
 			continue;
 		}
 
@@ -288,17 +433,35 @@ void checkJobs(void) {
 			allocateRes(j);
 
 		sendStartCmd(j);
-		j->internal_state |= JERS_FLAG_JOB_STARTED;
 		j->pend_reason = JERS_PEND_AGENT;
 
 		/* Keep track of the jobs we have attempted to start */
 		j->queue->stats.start_pending++;
 		server.stats.jobs.start_pending++;
 
+		/* The queue heaps can't be modified until we have finished walking them */
+		if (listAdd(&started_jobs, &j) != 0)
+			error_die("Failed to track started job %d: %s", j->jobid, strerror(errno));
+
 		/* Started enough jobs for this iteration? */
 		if (++started >= jobs_to_start)
 			break;
 	}
 
+	/* Started jobs are no longer candidates */
+	LIST_ITER(&started_jobs, sj) {
+		removeCandidate(*sj);
+		(*sj)->internal_state |= JERS_FLAG_JOB_STARTED;
+	}
+
+	LIST_ITER(&blocked_jobs, sj) {
+		struct resource *r = unavailableRes(*sj);
+
+		if (r)
+			addWaiter(*sj, r);
+	}
+
+	listFree(&started_jobs);
+	listFree(&blocked_jobs);
 	return;
 }
@@ -53,6 +53,8 @@
 #include <client.h>
 #include <acct.h>
 #include <tags.h>
+#include <uring.h>
+#include <journal.h>
 
 #include <jers_assert.h>
 
@@ -62,14 +64,38 @@
 
 /* Configuration defaults */
 
+#define SCHED_MODE_POLL  0 // Scheduler runs every sched_freq ms
+#define SCHED_MODE_EVENT 1 // Scheduler runs when something changes that may allow a job to start
+
+#define STATE_FORMAT_DIRECTORY 0 // A file per job/queue/resource under the state directory
+#define STATE_FORMAT_SNAPSHOT  1 // Everything in a single snapshot file
+#define STATE_FORMAT_LOG       2 // Changed objects appended to a log structured object store
+
+#define SAVE_MODE_FORK   0 // Background saves are written by a forked process
+#define SAVE_MODE_THREAD 1 // Background saves are formatted by the main thread, then written by a thread
+
 #define DEFAULT_CONFIG_FILE "/etc/jers/jers.conf"
 
 #define DEFAULT_CONFIG_STATEDIR "/var/spool/jers/state"
 #define DEFAULT_CONFIG_BACKGROUNDSAVEMS 30000
 #define DEFAULT_CONFIG_LOGGINGMODE JERS_LOG_DEBUG
-#define DEFAULT_CONFIG_EVENTFREQ 10
 #define DEFAULT_CONFIG_SCHEDFREQ 25
 #define DEFAULT_CONFIG_SCHEDMAX 250
+#define DEFAULT_CONFIG_SCHEDMODE SCHED_MODE_POLL
+#define DEFAULT_CONFIG_CLIENTBUDGET 64
+#define DEFAULT_CONFIG_IOTHREADS 0
+#define DEFAULT_CONFIG_IOBACKEND IO_BACKEND_EPOLL
+#define DEFAULT_CONFIG_JOURNALFORMAT JOURNAL_FORMAT_TEXT
+#define DEFAULT_CONFIG_STATEFORMAT STATE_FORMAT_DIRECTORY
+#define DEFAULT_CONFIG_TRUNCATEJOURNALS 1
+#define DEFAULT_CONFIG_SAVEMODE SAVE_MODE_FORK
+#define DEFAULT_CONFIG_OBJECTSEGMENTSIZE 64 // MB
+#define DEFAULT_CONFIG_JOURNALMAXSIZE 0 // MB, 0 = Only roll over daily
+#define DEFAULT_CONFIG_CHECKPOINTINTERVAL 0 // Minutes, 0 = Only when requested
+#define DEFAULT_CONFIG_JOURNALARCHIVEDAYS 0 // 0 = Keep archived journals
+#define MAX_IO_THREADS 64
+#define DEFAULT_CONFIG_LOADTHREADS 0
+#define MAX_LOAD_THREADS 64
 #define DEFAULT_CONFIG_MAXJOBS UNLIMITED_JOBS
 #define DEFAULT_CONFIG_MAXCLEAN 50
 #define DEFAULT_CONFIG_MAXJOBID 9999999
@@ -78,6 +104,7 @@
 #define DEFAULT_CONFIG_ACCTSOCKETPATH "/var/run/jers/accounting.socket"
 #define DEFAULT_CONFIG_FLUSHDEFER 1
 #define DEFAULT_CONFIG_FLUSHDEFERMS 5000
+#define DEFAULT_CONFIG_FLUSHGROUPMS 0
 #define DEFAULT_CONFIG_EMAIL_FREQ 5000
 #define DEFAULT_SLOWLOG 50 // Milliseconds
 
@@ -85,7 +112,8 @@
 
 enum readonly_modes {
 	READONLY_ENOSPACE = 1,
-	READONLY_BGSAVE
+	READONLY_BGSAVE,
+	READONLY_JOURNAL
 };
 
 enum jers_object_type {
@@ -98,8 +126,15 @@ typedef struct _jers_object {
 	int type;
 	int64_t revision;
 	int dirty;
+	struct _jers_object *dirty_next;	// Next object on the dirty list for its type
 } jers_object;
 
+/* Objects waiting to be saved, linked through jers_object.dirty_next */
+struct dirtyList {
+	jers_object *head;
+	int64_t count;
+};
+
 struct gid_perm {
 	gid_t gid;
 	int perm;
@@ -126,6 +161,9 @@ struct queue {
 
 	struct gid_perm *permissions;
 
+	/* Pending jobs that are candidates to be started, ordered by priority, jobid */
+	struct heap pending;
+
 	UT_hash_handle hh;
 };
 
@@ -137,6 +175,9 @@ struct resource {
 	int32_t in_use;
 	int32_t internal_state;
 
+	/* Pending jobs waiting for this resource to become available, in scheduling order */
+	struct heap waiting;
+
 	UT_hash_handle hh;
 };
 
@@ -211,11 +252,15 @@ struct job {
 	UT_hash_handle hh;
 	UT_hash_handle tag_hh;
 
-	/* We keep a sorted linked list of jobs in a deferred state,
-	 * sorted by the defer time. This helps efficiently release
-	 * deferred jobs */
-	struct job *deferred_next;
-	struct job *deferred_prev;
+	/* Position of this job in its queue's pending heap, 0 if not a candidate */
+	size_t candidate_index;
+
+	/* Resource this job is waiting on instead of being a candidate */
+	struct resource *waiting_res;
+	size_t waiting_index;
+
+	/* Position of this job in the deferred heap, 0 if not deferred */
+	size_t deferred_index;
 };
 
 struct gid_array {
@@ -241,9 +286,9 @@ struct jersServer {
 	int secret;
 	unsigned char secret_hash[SECRET_HASH_SIZE]; // Hash of secret read from config file
 
-	int64_t dirty_jobs;
-	int64_t dirty_queues;
-	int64_t dirty_resources;
+	struct dirtyList dirty_jobs;
+	struct dirtyList dirty_queues;
+	struct dirtyList dirty_resources;
 
 	int64_t flush_jobs;
 	int64_t flush_queues;
@@ -260,10 +305,10 @@ struct jersServer {
 	/* Flags set by signal handlers */
 	volatile sig_atomic_t shutdown;
 
-	int event_freq;
-
 	int sched_freq;
 	int sched_max;
+	int sched_mode;
+	int sched_pending;   // A scheduling pass has been requested (event mode)
 	int max_run_jobs;
 
 	uint32_t max_cleanup; // Maximum deleted objects to cleanup per cycle
@@ -307,15 +352,16 @@ struct jersServer {
 		jobid_t jobid;
 		int64_t revision;
 		char *buffer;
+
+		/* Journal position the loaded snapshot is current to */
+		int snapshot;
+		char snapshot_journal[16];
+		off_t snapshot_offset;
+		off_t snapshot_record;
+		ino_t snapshot_inode;
 	} recovery;
 	int initalising;
 
-	int candidate_recalc;
-
-	int64_t candidate_pool_size;
-	int64_t candidate_pool_jobs;
-	struct job ** candidate_pool;
-
 	int default_job_nice;
 
 	int auto_cleanup;
@@ -328,6 +374,11 @@ struct jersServer {
 
 	int event_fd;
 
+	int client_budget;		// Max requests processed from a single client per loop iteration
+	int io_threads;			// Threads handling client socket I/O and request parsing. 0 = main thread only
+	int io_backend;			// IO_BACKEND_EPOLL or IO_BACKEND_URING
+	int load_threads;		// Threads parsing the saved jobs and journals at startup. 0 = One per CPU
+
 	char * socket_path;
 	struct connectionType client_connection;
 
@@ -343,19 +394,37 @@ struct jersServer {
 		pid_t pid;
 		char defer;		// 0 == flush after every write. 1 == flush every defer_ms milliseconds
 		int defer_ms;	// milliseconds between state file flushes
+		char group;		// Group commit - Records are written and flushed together, holding responses until they are
+		int group_ms;	// milliseconds to collect records for before commiting them. 0 = every event loop iteration
 		int dirty;
 		time_t lastflush;
 	} flush;
 
+	int journal_format;		// Format of new journals. JOURNAL_FORMAT_TEXT or JOURNAL_FORMAT_BINARY
+	int state_format;		// STATE_FORMAT_DIRECTORY, STATE_FORMAT_SNAPSHOT or STATE_FORMAT_LOG
+	int truncate_journals;	// Snapshots/object store - Remove the journals a save makes redundant
+	int save_mode;			// SAVE_MODE_FORK or SAVE_MODE_THREAD
+	off_t object_segment_size;	// Object store - Size to start a new segment at
+	off_t journal_max_size;	// Size to roll over to a new journal at, 0 = Only roll over daily
+	int checkpoint_interval;	// Minutes between checkpoints, 0 = Only when requested by a client
+	char * journal_archive_dir;	// Journals no longer needed are compressed into here instead of being removed
+	int journal_archive_days;	// Remove archived journals older than this many days, 0 = Keep them
+
 	struct journal {
 		int fd;
+		int format;				// Format of the current journal
 		off_t len;
 		off_t limit;
 		off_t size;
 		off_t extend_block_size;
 		off_t last_commit;
 		off_t record;
-		char datetime[10]; // YYYYMMDD
+		int sequence;			// Journals started before this one today, see journalName()
+		char datetime[16]; // YYYYMMDD[.NNNNNN]
+
+		buff_t pending;			// Group commit - Records not yet written to the journal
+		int64_t commit_due;		// Group commit - When the pending records need to be written
+		uint64_t commit_seq;	// Group commit - Syncer request being waited on, 0 if none
 	} journal;
 
 	/* A tag can be designated an 'index' tag, which adds jobs to a
@@ -364,14 +433,16 @@ struct jersServer {
 	struct indexed_tag *index_tag_table;
 
 	/* Sorted linked list of deferred jobs */
-	struct job *deferred_list;
+	struct heap deferred;   // Jobs with a defer time, earliest first
 
 	struct item_list queue_acls;
 };
 
 #define STATE_DIV_FACTOR 10000
 
-#define JOURNAL_EXTEND_DEFAULT 524288 // 512kb
+#define JOURNAL_EXTEND_DEFAULT 4194304 // 4mb
+#define JOURNAL_RETRY_MS 1000 // Wait before retrying a failed journal write
+#define JOURNAL_MAX_SEQUENCE 999999
 
 /* The internal_state field is a bitmap of flags */
 #define JERS_FLAG_DELETED  0x0001  // Job has been deleted and will be cleaned up
@@ -399,6 +470,7 @@ int addRes(struct resource * r, int dirty);
 void freeRes(struct resource *r);
 struct resource * findResource(char * name);
 int checkRes(struct job *j);
+struct resource *unavailableRes(struct job *j);
 void allocateRes(struct job *j);
 void deallocateRes(struct job *j);
 
@@ -419,12 +491,35 @@ int stateLoadQueues(void);
 struct queue * stateLoadQueue(const char *filename);
 int stateLoadResources(void);
 struct resource * stateLoadResource(const char *filename);
+int stateLoadSnapshot(void);
+int stateLoadObjectStore(void);
 void stateReplayJournal(void);
 void stateSaveToDisk(int block);
+void stateSaveWait(void);
+int stateCheckpoint(void);
 void flush_journal(int force);
+int journalCommit(void);
+void journalGroupCommit(void);
+void journalSynced(uint64_t seq);
+int nextCommitTimeout(void);
 
 void checkJobs(void);
 void releaseDeferred(void);
+void requestSchedule(void);
+int nextDeferredTimeout(void);
+
+void initCandidates(struct queue *q);
+void addCandidate(struct job *j);
+void removeCandidate(struct job *j);
+void updateCandidate(struct job *j);
+void startCandidates(int all);
+struct job *nextCandidate(void);
+void expandCandidate(struct job *j);
+void initResourceWaiters(struct resource *r);
+void wakeResourceWaiters(struct resource *r);
+void resortResourceWaiters(void);
+int queuePendReason(struct queue *q);
+int getPendReason(struct job *j);
 
 int stateDelJob(struct job * j);
 int stateDelQueue(struct queue * q);
@@ -439,6 +534,8 @@ int runCommand(client * c);
 int runAgentCommand(agent * a);
 
 void checkEvents(void);
+int nextEventTimeout(void);
+void processRequests(void);
 void freeEvents(void);
 
 void initEvents(void);
@@ -0,0 +1,204 @@
+/* Copyright (c) 2018 Evan Wyatt
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ *    be used to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "common.h"
+#include "journal.h"
+#include "snapshot.h"
+
+/* Single file snapshots of the queues, resources and jobs. See snapshot.h for the layout.
+ *
+ * The objects themselves are stored as the same key/value lines used by the
+ * state directories, so they are loaded with the same parsing code. */
+
+static uint32_t recordCrc(const char *record, size_t length) {
+	const size_t skip = offsetof(struct snapshotRecord, type);
+
+	return crc32c(0, record + skip, length - skip);
+}
+
+int snapshotFormatHeader(buff_t *b, struct snapshotHeader *h) {
+	memcpy(h->magic, SNAPSHOT_MAGIC, sizeof(h->magic));
+	h->version = SNAPSHOT_VERSION;
+	h->crc = 0;
+	h->crc = crc32c(0, h, sizeof(struct snapshotHeader));
+
+	return buffAdd(b, (char *)h, sizeof(struct snapshotHeader));
+}
+
+/* Start a record for an object. The object's data is then added to the buffer
+ * directly, with snapshotEndObject() filling in the record header once it's complete */
+size_t snapshotBeginObject(buff_t *b, uint32_t type, const char *key) {
+	struct snapshotRecord hdr = {0};
+	size_t start = b->used;
+
+	hdr.type = type;
+	hdr.key_len = strlen(key);
+
+	buffAdd(b, (char *)&hdr, sizeof(hdr));
+	buffAdd(b, key, hdr.key_len);
+
+	return start;
+}
+
+void snapshotEndObject(buff_t *b, size_t start) {
+	struct snapshotRecord hdr;
+	char *record = b->data + start;
+
+	memcpy(&hdr, record, sizeof(hdr));
+	hdr.length = b->used - start;
+	memcpy(record, &hdr, sizeof(hdr));
+
+	hdr.crc = recordCrc(record, hdr.length);
+	memcpy(record, &hdr, sizeof(hdr));
+}
+
+int snapshotFormatEnd(buff_t *b, int64_t objects) {
+	size_t start = snapshotBeginObject(b, SNAPSHOT_END, "");
+
+	buffAdd(b, (char *)&objects, sizeof(objects));
+	snapshotEndObject(b, start);
+
+	return 0;
+}
+
+int snapshotReaderOpen(struct snapshotReader *r, const char *path) {
+	struct stat st;
+	uint32_t crc;
+
+	memset(r, 0, sizeof(struct snapshotReader));
+
+	r->fd = open(path, O_RDONLY | O_CLOEXEC);
+
+	if (r->fd < 0)
+		return 1;
+
+	if (fstat(r->fd, &st) != 0)
+		goto fail;
+
+	if ((size_t)st.st_size < sizeof(struct snapshotHeader)) {
+		errno = EINVAL;
+		goto fail;
+	}
+
+	r->size = st.st_size;
+	r->map = mmap(NULL, r->size, PROT_READ, MAP_PRIVATE, r->fd, 0);
+
+	if (r->map == MAP_FAILED) {
+		r->map = NULL;
+		goto fail;
+	}
+
+	madvise(r->map, r->size, MADV_SEQUENTIAL);
+
+	memcpy(&r->header, r->map, sizeof(struct snapshotHeader));
+	crc = r->header.crc;
+	r->header.crc = 0;
+
+	if (memcmp(r->header.magic, SNAPSHOT_MAGIC, sizeof(r->header.magic)) != 0 || r->header.version != SNAPSHOT_VERSION ||
+		crc32c(0, &r->header, sizeof(struct snapshotHeader)) != crc || r->header.journal[sizeof(r->header.journal) - 1] != '\0') {
+		errno = EINVAL;
+		goto fail;
+	}
+
+	r->header.crc = crc;
+	r->offset = sizeof(struct snapshotHeader);
+
+	return 0;
+
+fail:
+	snapshotReaderClose(r);
+	return 1;
+}
+
+/* Decode the record at 'p', returning its length or 0 if it's damaged or incomplete */
+size_t snapshotRecordRead(const char *p, size_t remaining, struct snapshotObject *o) {
+	struct snapshotRecord hdr;
+
+	if (remaining < sizeof(hdr))
+		return 0;
+
+	memcpy(&hdr, p, sizeof(hdr));
+
+	if (hdr.length < sizeof(hdr) || hdr.length > remaining || hdr.key_len > hdr.length - sizeof(hdr))
+		return 0;
+
+	if (recordCrc(p, hdr.length) != hdr.crc)
+		return 0;
+
+	o->type = hdr.type;
+	o->key = p + sizeof(hdr);
+	o->key_len = hdr.key_len;
+	o->data = o->key + hdr.key_len;
+	o->data_len = hdr.length - sizeof(hdr) - hdr.key_len;
+
+	return hdr.length;
+}
+
+/* Read the next object. The end record has to be present, and agree with the number
+ * of objects read, otherwise the snapshot wasn't completely written */
+int snapshotReaderNext(struct snapshotReader *r, struct snapshotObject *o) {
+	size_t length = snapshotRecordRead(r->map + r->offset, r->size - r->offset, o);
+	int64_t objects;
+
+	if (length == 0)
+		return SNAPSHOT_CORRUPT;
+
+	if (o->type == SNAPSHOT_END) {
+		if (o->data_len != sizeof(objects))
+			return SNAPSHOT_CORRUPT;
+
+		memcpy(&objects, o->data, sizeof(objects));
+
+		return objects == r->objects ? SNAPSHOT_DONE : SNAPSHOT_CORRUPT;
+	}
+
+	r->offset += length;
+	r->objects++;
+
+	return SNAPSHOT_OBJECT;
+}
+
+void snapshotReaderClose(struct snapshotReader *r) {
+	if (r->map)
+		munmap(r->map, r->size);
+
+	if (r->fd >= 0)
+		close(r->fd);
+
+	memset(r, 0, sizeof(struct snapshotReader));
+	r->fd = -1;
+}
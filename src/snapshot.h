@@ -0,0 +1,108 @@
+/* Copyright (c) 2018 Evan Wyatt
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ *    be used to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _snapshot_h
+#define _snapshot_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "buffer.h"
+
+/* A snapshot holds every queue, resource and job in a single file.
+ * It's a file header followed by a record per object, appended one after the
+ * other, and finished with an end record holding the number of objects written.
+ * Each record has a CRC32C covering everything after the crc field, so a
+ * damaged or incomplete snapshot is refused rather than partially loaded. */
+
+#define SNAPSHOT_MAGIC "JERSSNAP"
+#define SNAPSHOT_VERSION 1
+
+#define SNAPSHOT_RESOURCE 1
+#define SNAPSHOT_QUEUE    2
+#define SNAPSHOT_JOB      3
+#define SNAPSHOT_END      4
+
+struct snapshotHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t crc;             // CRC32C of the header, calculated with this set to 0
+	int64_t save_time;
+	uint32_t start_jobid;
+	uint32_t reserved;
+
+	/* The journal position the snapshot is current to.
+	 * Only the records from here onwards need replaying */
+	char journal[16];         // Date of the journal (journal.yyyymmdd)
+	int64_t journal_offset;
+	int64_t journal_record;   // Records before the offset, in case the journal has been converted
+	uint64_t journal_inode;
+};
+
+struct snapshotRecord {
+	uint32_t length;          // Length of the record, including this header
+	uint32_t crc;
+	uint32_t type;
+	uint32_t key_len;         // The key (jobid or name) follows this header, then the object's key/value lines
+};
+
+/* An object read from a snapshot. The key and data point into the mapped file */
+struct snapshotObject {
+	uint32_t type;
+	const char *key;
+	size_t key_len;
+	const char *data;
+	size_t data_len;
+};
+
+struct snapshotReader {
+	int fd;
+	char *map;
+	size_t size;
+	off_t offset;            // Offset of the next record
+	int64_t objects;         // Objects read so far
+	struct snapshotHeader header;
+};
+
+#define SNAPSHOT_OBJECT   1   // Read an object
+#define SNAPSHOT_DONE     0   // Read the end record
+#define SNAPSHOT_CORRUPT -1   // Damaged or missing record at the current offset
+
+int snapshotFormatHeader(buff_t *b, struct snapshotHeader *h);
+size_t snapshotBeginObject(buff_t *b, uint32_t type, const char *key);
+void snapshotEndObject(buff_t *b, size_t start);
+int snapshotFormatEnd(buff_t *b, int64_t objects);
+size_t snapshotRecordRead(const char *p, size_t remaining, struct snapshotObject *o);
+
+int snapshotReaderOpen(struct snapshotReader *r, const char *path);
+int snapshotReaderNext(struct snapshotReader *r, struct snapshotObject *o);
+void snapshotReaderClose(struct snapshotReader *r);
+
+#endif
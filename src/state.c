@@ -32,6 +32,10 @@
 #include "common.h"
 #include "commands.h"
 #include "email.h"
+#include "syncer.h"
+#include "journal.h"
+#include "snapshot.h"
+#include "objstore.h"
 
 #include <sys/types.h>
 #include <sys/wait.h>
@@ -39,11 +43,14 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <stddef.h>
 #include <errno.h>
 #include <sys/uio.h>
 #include <time.h>
 #include <glob.h>
 #include <libgen.h>
+#include <pthread.h>
+#include <zlib.h>
 
 #ifdef USE_SYSTEMD
 #include <systemd/sd-daemon.h>
@@ -80,46 +87,120 @@ static inline int64_t strtoint64(const char *str, int64_t *result) {
 }
 
 /* Functions to save/recover the state to/from disk
- *   The state journals (journal.yyyymmdd) are written to when commands are received
+ *   The state journals (journal.yyyymmdd[.NNNNNN]) are written to when commands are received
  *   These commands are then applied to the job/queue/res files as needed */
 
-static off_t findJournalEnd(int fd) {
-	char data[8192 + 1];
-	int len;
-	off_t offset = 0;
+/* Zero 'len' bytes of the journal from 'offset', keeping the space allocated */
+static int zeroJournal(int fd, off_t offset, off_t len) {
+	char zero[65536] = {0};
 
-	while ((len = read(fd, data, sizeof(data) - 1)) > 0) {
-		/* NULL the buffer to make it easier to find records */
-		data[sizeof(data) - 1] = '\0';
+	if (fallocate(fd, FALLOC_FL_ZERO_RANGE, offset, len) == 0)
+		return 0;
 
-		/* Count all the records */
-		char *p = data;
-		while ((p = strchr(p, '\n')) != NULL) {
-			server.journal.record++;
-			p++;
-		}
+	if (errno != EOPNOTSUPP && errno != ENOSYS)
+		return 1;
 
-		if (data[len - 1] == 0) {
-			/* This chunk should contain the last record */
-			int i;
-			for (i = 0; i < len && data[i]; i++) {}
+	while (len) {
+		ssize_t written = pwrite(fd, zero, len < (off_t)sizeof(zero) ? (size_t)len : sizeof(zero), offset);
 
-			if (i >= len)
-				error_die("Failed to locate end of journal");
+		if (written == -1) {
+			if (errno == EINTR)
+				continue;
 
-			offset += i;
-			break;
+			return 1;
 		}
 
-		offset += len;
+		len -= written;
+		offset += written;
+	}
+
+	return 0;
+}
+
+static off_t findJournalEnd(const char *path, int fd) {
+	struct journalReader r;
+	struct journalEntry e;
+	off_t offset;
+	int rc;
+
+	if (journalReaderOpen(&r, path) != 0)
+		error_die("Failed to open journal %s: %s", path, strerror(errno));
+
+	/* Count all the records */
+	while ((rc = journalReaderNext(&r, &e)) == JOURNAL_RECORD) {}
+
+	if (rc == JOURNAL_CORRUPT)
+		error_die("Failed to locate end of journal %s - Invalid record at offset %ld", path, r.offset);
+
+	if (rc == JOURNAL_TORN) {
+		/* A record was only partially written before we stopped. Parts of the same write
+		 * after it might have made it to disk though, so everything from the torn record
+		 * onwards is cleared. Otherwise they could be read back after the new records */
+		print_msg(JERS_LOG_WARNING, "Discarding partially written record (%zu bytes) and anything after it at offset %ld in journal %s",
+			r.torn_len, r.offset, path);
+
+		if (zeroJournal(fd, r.offset, r.size - r.offset) != 0 || fdatasync(fd) != 0)
+			error_die("Failed to clear partially written record from journal %s: %s", path, strerror(errno));
+	}
+
+	server.journal.record = r.record;
+	server.journal.format = r.format;
+	offset = r.offset;
+
+	/* Nothing was ever written to it, use the configured format */
+	if (r.size == 0) {
+		server.journal.format = server.journal_format;
+
+		if (server.journal.format == JOURNAL_FORMAT_BINARY) {
+			if (journalWriteHeader(fd) != 0)
+				error_die("Failed to write header to journal %s: %s", path, strerror(errno));
+
+			offset = sizeof(struct journalFileHeader);
+		}
 	}
 
+	journalReaderClose(&r);
+
 	print_msg(JERS_LOG_DEBUG, "Found EOJ at offset %ld", offset);
 	print_msg(JERS_LOG_DEBUG, "Last journal record is: %ld", server.journal.record);
 
 	return offset;
 }
 
+/* Allocate 'len' bytes of the journal from 'offset'. fallocate() allocates the space without
+ * writing it out, zeros are written instead if the filesystem doesn't support it */
+static int allocateJournal(int fd, off_t offset, off_t len) {
+	char *zero;
+
+	if (fallocate(fd, 0, offset, len) == 0)
+		return 0;
+
+	if (errno != EOPNOTSUPP && errno != ENOSYS)
+		return 1;
+
+	if ((zero = calloc(1, len)) == NULL)
+		return 1;
+
+	while (len) {
+		ssize_t written = pwrite(fd, zero, len, offset);
+
+		if (written == -1) {
+			if (errno == EINTR)
+				continue;
+
+			free(zero);
+			return 1;
+		}
+
+		len -= written;
+		offset += written;
+	}
+
+	free(zero);
+
+	return 0;
+}
+
 /* To ensure we don't run out of space when writing journal entries, space is pre-allocated.
  *  We ensure we have 2 'extend' blocks at the end of journal:
  *  One is used for writing new journal entries, the other is reserved for if we
@@ -128,84 +209,225 @@ static off_t findJournalEnd(int fd) {
 
 static int extendJournal(void) {
 	off_t new_size = server.journal.size + server.journal.extend_block_size;
-	ssize_t fill_size = 0;
-	ssize_t written = 0;
-	off_t offset = server.journal.size;
-	static char *data = NULL;
-	static ssize_t data_size = 0;
+	off_t fill_size = 0;
 
 	if (server.journal.limit == 0)
 		new_size += server.journal.extend_block_size;
 
-	/* Need to actually write something to the journal to get the new space allocated */
 	fill_size = new_size - server.journal.size;
 
 	print_msg(JERS_LOG_DEBUG, "Attempting to add %ld bytes to the journal. New size: %ld", fill_size, new_size);
 
-	if (data_size < fill_size) {
-		data = realloc(data, fill_size);
-		memset(data, 0, fill_size);
-	}
-
-	while (fill_size) {
-		if ((written = pwrite(server.journal.fd, data, fill_size, offset)) == -1) {
-			if (errno == ENOSPC) {
-				/* No space is left on the device, we need to switch into a read only mode */
-				if (server.readonly == 0) {
-					print_msg(JERS_LOG_CRITICAL, "*********************************************");
-					print_msg(JERS_LOG_CRITICAL, "* Failed to extend journal - Device is full *");
-					print_msg(JERS_LOG_CRITICAL, "*        Switching to READONLY mode!        *");
-					print_msg(JERS_LOG_CRITICAL, "*********************************************");
-					server.readonly = READONLY_ENOSPACE;
-				}
-
-				return 1;
-			} else if (errno != EINTR) {
-				/* Another error occurred trying to fill in the file */
-				error_die("Failed to extend journal file: %s", strerror(errno));
+	if (allocateJournal(server.journal.fd, server.journal.size, fill_size) != 0) {
+		if (errno == ENOSPC) {
+			/* No space is left on the device, we need to switch into a read only mode */
+			if (server.readonly == 0) {
+				print_msg(JERS_LOG_CRITICAL, "*********************************************");
+				print_msg(JERS_LOG_CRITICAL, "* Failed to extend journal - Device is full *");
+				print_msg(JERS_LOG_CRITICAL, "*        Switching to READONLY mode!        *");
+				print_msg(JERS_LOG_CRITICAL, "*********************************************");
+				server.readonly = READONLY_ENOSPACE;
 			}
+
+			return 1;
 		}
 
-		fill_size -= written;
-		offset += written;
+		/* Another error occurred trying to fill in the file */
+		error_die("Failed to extend journal file: %s", strerror(errno));
 	}
 
 	if (server.readonly == READONLY_ENOSPACE) {
 		print_msg(JERS_LOG_INFO, "Turning off readonly mode - journal extended.");
 		server.readonly = 0;
+		requestSchedule();
 	}
 
 	server.journal.size = new_size;
 	server.journal.limit = server.journal.size - server.journal.extend_block_size;
-	fsync(server.journal.fd);
+	syncerRequest(server.journal.fd, 0);
 
 	return 0;
 }
 
-int openStateFile(time_t now) {
+/* Journals are named after the day they were started, journal.yyyymmdd. The journals started
+ * that day after one is rolled over for its size also have a sequence number, journal.yyyymmdd.NNNNNN */
+static void journalName(char *name, size_t size, time_t now, int sequence) {
+	struct tm * tm = localtime(&now);
+
+	if (tm == NULL)
+		error_die("Failed to get time for state file name: %s", strerror(errno));
+
+	if (sequence)
+		snprintf(name, size, "%d%02d%02d.%06d", 1900 + tm->tm_year, tm->tm_mon + 1, tm->tm_mday, sequence);
+	else
+		snprintf(name, size, "%d%02d%02d", 1900 + tm->tm_year, tm->tm_mon + 1, tm->tm_mday);
+}
+
+/* Sequence number of the last journal started on the day of 'now' */
+static int lastJournalSequence(time_t now) {
+	char name[sizeof(server.journal.datetime)];
+	char pattern[PATH_MAX];
+	glob_t journalGlob;
+	int sequence = 0;
+
+	journalName(name, sizeof(name), now, 0);
+	sprintf(pattern, "%s/journal.%s.*", server.state_dir, name);
+
+	if (glob(pattern, 0, NULL, &journalGlob) == 0)
+		sequence = atoi(strrchr(journalGlob.gl_pathv[journalGlob.gl_pathc - 1], '.') + 1);
+
+	globfree(&journalGlob);
+
+	return sequence;
+}
+
+/* The next journal is created and allocated by a thread ahead of time, as state_dir/journal_next,
+ * which doesn't match the journal.* pattern. At the rollover it's just linked into place */
+
+static struct {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	int running;			// Main thread - The thread has been started, but not joined
+	int finished;
+	int status;
+
+	int fd;
+	int format;
+	off_t size;
+} nextJournal = {.lock = PTHREAD_MUTEX_INITIALIZER, .fd = -1};
+
+static void nextJournalPath(char *path) {
+	sprintf(path, "%s/journal_next", server.state_dir);
+}
+
+static void *nextJournalMain(void *arg) {
+	UNUSED(arg);
+	char path[PATH_MAX];
+	int status = 1;
+	int fd;
+
+	nextJournalPath(path);
+
+	fd = open(path, O_CREAT | O_TRUNC | O_RDWR | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+
+	if (fd >= 0 && (nextJournal.format != JOURNAL_FORMAT_BINARY || journalWriteHeader(fd) == 0) &&
+		allocateJournal(fd, 0, nextJournal.size) == 0 && fsync(fd) == 0)
+		status = 0;
+
+	if (status)
+		print_msg(JERS_LOG_WARNING, "Failed to create next journal %s: %s", path, strerror(errno));
+
+	pthread_mutex_lock(&nextJournal.lock);
+	nextJournal.fd = fd;
+	nextJournal.status = status;
+	nextJournal.finished = 1;
+	pthread_mutex_unlock(&nextJournal.lock);
+
+	return NULL;
+}
+
+/* Start creating the journal to roll over to, if it isn't already being created */
+static void nextJournalStart(void) {
+	sigset_t all, old;
+	int err;
+
+	if (nextJournal.running)
+		return;
+
+	nextJournal.format = server.journal_format;
+	nextJournal.size = server.journal.extend_block_size * 2;
+	nextJournal.finished = 0;
+	nextJournal.fd = -1;
+
+	/* Signals are left to the main thread */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+
+	err = pthread_create(&nextJournal.thread, NULL, nextJournalMain, NULL);
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (err != 0) {
+		print_msg(JERS_LOG_WARNING, "Failed to start thread to create the next journal: %s", strerror(err));
+		return;
+	}
+
+	nextJournal.running = 1;
+}
+
+/* Use the journal created ahead of time as 'path', returning its fd.
+ * Returns -1 if it isn't ready, or 'path' already exists, to open it as usual */
+static int nextJournalTake(const char *path) {
+	char next[PATH_MAX];
+	int finished, fd;
+
+	if (!nextJournal.running)
+		return -1;
+
+	pthread_mutex_lock(&nextJournal.lock);
+	finished = nextJournal.finished;
+	pthread_mutex_unlock(&nextJournal.lock);
+
+	if (!finished)
+		return -1;
+
+	pthread_join(nextJournal.thread, NULL);
+	nextJournal.running = 0;
+
+	fd = nextJournal.fd;
+	nextJournalPath(next);
+
+	/* link() rather than rename(), so an existing journal isn't replaced */
+	if (nextJournal.status != 0 || nextJournal.format != server.journal_format || link(next, path) != 0) {
+		if (fd >= 0)
+			close(fd);
+
+		unlink(next);
+		return -1;
+	}
+
+	unlink(next);
+
+	server.journal.format = nextJournal.format;
+	server.journal.len = nextJournal.format == JOURNAL_FORMAT_BINARY ? (off_t)sizeof(struct journalFileHeader) : 0;
+	server.journal.size = nextJournal.size;
+	server.journal.limit = server.journal.size - server.journal.extend_block_size;
+
+	/* The new name is flushed to disk by the syncer */
+	int dir = open(server.state_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+	if (dir >= 0)
+		syncerRequest(dir, 1);
+
+	return fd;
+}
+
+/* Open the journal for the day of 'now' with the given sequence number,
+ * or with -1, the last journal started that day */
+int openStateFile(time_t now, int sequence) {
 	char * state_file = NULL;
 	int fd;
 	int flags = O_CREAT | O_RDWR;
 	int mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP;
-	struct tm * tm = NULL;
 	struct stat buf;
 
-	tm = localtime(&now);
-
-	if (tm == NULL)
-		error_die("Failed to get time for state file name: %s", strerror(errno));
-
 	if (!server.state_dir)
 		error_die("No state directory specified");
 
+	if (sequence < 0)
+		sequence = lastJournalSequence(now);
+
 	server.journal.record = 0;
-	snprintf(server.journal.datetime, sizeof(server.journal.datetime), "%d%02d%02d", 1900 + tm->tm_year, tm->tm_mon + 1, tm->tm_mday);
+	server.journal.sequence = sequence;
+	journalName(server.journal.datetime, sizeof(server.journal.datetime), now, sequence);
 	asprintf(&state_file, "%s/journal.%s", server.state_dir, server.journal.datetime);
 
 	if (state_file == NULL)
 		error_die("Failed to open new state file: %s", strerror(errno));
 
-	if ((fd = open(state_file, flags | O_EXCL, mode)) < 0) {
+	if ((fd = nextJournalTake(state_file)) >= 0) {
+		print_msg(JERS_LOG_DEBUG, "Rolled over to journal %s, created ahead of time", state_file);
+	} else if ((fd = open(state_file, flags | O_EXCL, mode)) < 0) {
 		if (errno != EEXIST)
 			error_die("Failed to open state file %s: %s", state_file, strerror(errno));
 
@@ -215,7 +437,7 @@ int openStateFile(time_t now) {
 		if ((fd = open(state_file, flags, mode)) < 0)
 			error_die("Failed to open state file %s: %s", state_file, strerror(errno));
 
-		server.journal.len = findJournalEnd(fd);
+		server.journal.len = findJournalEnd(state_file, fd);
 
 		if (lseek(fd, server.journal.len, SEEK_SET) != server.journal.len)
 			error_die("Failed to seek to end of journal %s: %s", state_file, strerror(errno));
@@ -240,12 +462,136 @@ int openStateFile(time_t now) {
 		server.journal.size = 0;
 		server.journal.limit = 0;
 		server.journal.record = 0;
+		server.journal.format = server.journal_format;
+
+		if (server.journal.format == JOURNAL_FORMAT_BINARY) {
+			if (journalWriteHeader(fd) != 0)
+				error_die("Failed to write header to journal %s: %s", state_file, strerror(errno));
+
+			server.journal.len = server.journal.size = sizeof(struct journalFileHeader);
+		}
 	}
 
 	free(state_file);
 	return fd;
 }
 
+/* Append to the current journal, syncing it to disk if requested.
+ * With io_uring, the write and fdatasync are submitted together as linked requests */
+static ssize_t journalWrite(const char *data, size_t len, int sync) {
+	ssize_t written;
+
+	if (uringActive())
+		return uringWriteFile(server.journal.fd, data, len, sync);
+
+	written = write(server.journal.fd, data, len);
+
+	if (written != -1 && sync)
+		fdatasync(server.journal.fd);
+
+	return written;
+}
+
+/* Group commit - Write all the pending records with a single write, handing the
+ * flush to the syncer thread. The output held for these records is released once
+ * the syncer reports it's done, see journalSynced()
+ *
+ * If the write fails, the records not written are kept to be retried and we switch to
+ * readonly mode. The output for them stays held until they have been written */
+int journalCommit(void) {
+	buff_t *pending = &server.journal.pending;
+	ssize_t written = 0;
+
+	if (pending->used == 0)
+		return 0;
+
+	while ((size_t)written < pending->used) {
+		ssize_t len = journalWrite(pending->data + written, pending->used - written, 0);
+
+		if (len == -1) {
+			if (errno == EINTR)
+				continue;
+
+			break;
+		}
+
+		written += len;
+	}
+
+	if ((size_t)written < pending->used) {
+		print_msg(JERS_LOG_CRITICAL, "Failed to write pending records to journal file: %s", strerror(errno));
+
+		if (server.readonly == 0) {
+			print_msg(JERS_LOG_CRITICAL, "*********************************************");
+			print_msg(JERS_LOG_CRITICAL, "*           Journal write failed            *");
+			print_msg(JERS_LOG_CRITICAL, "*        Switching to READONLY mode!        *");
+			print_msg(JERS_LOG_CRITICAL, "*********************************************");
+			server.readonly = READONLY_JOURNAL;
+		}
+
+		/* Try the rest again shortly */
+		buffRemove(pending, written, 0);
+		server.journal.commit_due = getTimeMS() + JOURNAL_RETRY_MS;
+
+		return 1;
+	}
+
+	buffRemove(pending, pending->used, 0);
+	server.journal.commit_seq = syncerRequest(server.journal.fd, 0);
+
+	if (server.readonly == READONLY_JOURNAL) {
+		server.readonly = 0;
+		print_msg(JERS_LOG_INFO, "Turning off readonly mode - Journal written.");
+		requestSchedule();
+	}
+
+	return 0;
+}
+
+/* Group commit - Called at the end of each event loop iteration.
+ * Only one commit is flushed at a time, records generated while waiting on
+ * it are collected into the next one. */
+void journalGroupCommit(void) {
+	if (server.journal.commit_seq) {
+		/* The output since the last commit doesn't depend on any new records,
+		 * so it can go out with the commit being flushed */
+		if (server.journal.pending.used == 0)
+			commitHeldOutput();
+
+		return;
+	}
+
+	if (server.journal.pending.used == 0) {
+		/* Nothing to wait for */
+		commitHeldOutput();
+		releaseHeldOutput();
+		return;
+	}
+
+	if (nextCommitTimeout() == 0 && journalCommit() == 0)
+		commitHeldOutput();
+}
+
+/* The syncer has flushed everything up to 'seq' */
+void journalSynced(uint64_t seq) {
+	if (server.journal.commit_seq == 0 || seq < server.journal.commit_seq)
+		return;
+
+	server.journal.commit_seq = 0;
+	releaseHeldOutput();
+}
+
+/* Milliseconds until the pending records need to be commited, -1 if there are none
+ * or they are waiting for the current commit to be flushed */
+int nextCommitTimeout(void) {
+	if (server.journal.pending.used == 0 || server.journal.commit_seq)
+		return -1;
+
+	int64_t remaining = server.journal.commit_due - getTimeMS();
+
+	return remaining > 0 ? remaining : 0;
+}
+
 time_t getRollOver(time_t now) {
 	struct tm * _tm = localtime(&now);
 
@@ -256,41 +602,67 @@ time_t getRollOver(time_t now) {
 	return mktime(_tm);
 }
 
+/* Checkpoints - A save started on a new journal, so once it's on disk all the older journals
+ * are covered by it and are removed (or archived). Run every checkpoint_interval minutes,
+ * or when requested by a client */
+static struct {
+	int requested;		// Start a checkpoint with the next save
+	int roll;			// Roll over to a new journal with the next record
+	int active;			// The save in progress is a checkpoint
+	char datetime[16];	// The journal the checkpoint started
+} checkpoint;
+
 /* Function to save the current command to disk (& flush it, if in sync mode)
  * Only 'update' command are written, ie command that modify jobs/queues or resources.
  *
- * Records are formatted as tab seperated fields. newline, tabs and
- * backslashes are escaped before being written to disk.
- *
- *  TIME\tUID\tCMDt\tJOBID\tREVISION\tJSON.
-  *
- * Note: There is a space at the start of line, this space will have a '*' character written
- *       to this position when these transaction have been commited to disk as the job/queue/resource state files
- *       A '$' will be written to this position as a 'End of journal' marker when rotating the journal files */
+ * Records are written in the format of the current journal, see journal.c.
+ * Each has a marker, which will have a '*' character written to it when these
+ * transaction have been commited to disk as the job/queue/resource state files.
+ * An end of journal record with a '$' marker is written when rotating the journal files */
 
 int stateSaveCmd(uid_t uid, char * cmd, char * msg, jobid_t jobid, int64_t revision) {
 	off_t start_offset;
 	struct timespec now;
-	int len = 0;
+	ssize_t len = 0;
 	static time_t next_rollover = 0;
-	static char *msg_string = NULL;
-	static int msg_size = 0;
+	static buff_t record = {0};
+	struct journalEntry e;
 
 	clock_gettime(CLOCK_REALTIME_COARSE, &now);
 
-	if (now.tv_sec >= next_rollover) {
+	if (record.data == NULL)
+		buffNew(&record, 0);
+
+	/* Roll over daily, for a checkpoint, or once the journal reaches journal_max_size */
+	int full = (checkpoint.roll || (server.journal_max_size && server.journal.len >= server.journal_max_size)) &&
+		server.journal.fd > 0 && server.journal.sequence < JOURNAL_MAX_SEQUENCE;
+
+	checkpoint.roll = 0;
+
+	/* The records still pending have to be written to the current journal first.
+	 * If they can't be, the rollover is left until they are */
+	if ((now.tv_sec >= next_rollover || full) && (server.journal.fd <= 0 || journalCommit() == 0)) {
+		int sequence = server.journal.sequence + 1;
+
 		/* Write the End of journal marker and close the current file */
 		if (server.journal.fd > 0) {
-			write(server.journal.fd, "$\n", 2);
-			fdatasync(server.journal.fd);
-			close(server.journal.fd);
+			buffClear(&record, 0);
+			journalFormatEnd(&record, server.journal.format);
+			journalWrite(record.data, record.used, 0);
+			syncerRequest(server.journal.fd, 1);
 		}
 
-		/* Work out the next rollover */
-		if ((next_rollover = getRollOver(now.tv_sec)) < 0)
-			error_die("Failed to determine next journal rollover time");
+		if (now.tv_sec >= next_rollover) {
+			/* Work out the next rollover */
+			if ((next_rollover = getRollOver(now.tv_sec)) < 0)
+				error_die("Failed to determine next journal rollover time");
+
+			/* A new day, carrying on from its last journal if there is one */
+			sequence = -1;
+		}
 
-		server.journal.fd = openStateFile(now.tv_sec);
+		server.journal.fd = openStateFile(now.tv_sec, sequence);
+		nextJournalStart();
 
 		if (server.journal.size == 0 || server.journal.len >= server.journal.limit) {
 			if (extendJournal())
@@ -299,29 +671,42 @@ int stateSaveCmd(uid_t uid, char * cmd, char * msg, jobid_t jobid, int64_t revis
 	}
 
 	/* Save the offset of this new record, so we can write the '*' later if needed */
-	start_offset = lseek(server.journal.fd, 0, SEEK_CUR);
+	start_offset = server.journal.len;
 
 	/* Expand the msg */
-	while (1) {
-		len = snprintf(msg_string, msg_size, " %ld.%03d\t%d\t%s\t%d\t%ld\t%s\n", now.tv_sec, (int)(now.tv_nsec / 1000000), uid, cmd, jobid, revision, msg ? msg :"");
-
-		if (len < msg_size)
-			break;
-
-		msg_size = len + 64;
-		msg_string = realloc(msg_string, msg_size);
-
-		if (msg_string == NULL)
-			error_die("Failed to allocate memory for journal message: %s", strerror(errno));
+	e.marker = ' ';
+	e.time_ms = (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+	e.uid = uid;
+	e.command = cmd;
+	e.jobid = jobid;
+	e.revision = revision;
+	e.payload = msg;
+	e.payload_len = msg ? strlen(msg) : 0;
+
+	buffClear(&record, 0);
+
+	if (journalFormatRecord(&record, server.journal.format, &e) != 0) {
+		print_msg(JERS_LOG_CRITICAL, "Failed to format journal record for %s: %s", cmd, strerror(errno));
+		return 1;
 	}
 
+	len = record.used;
+
 	/* Do we need to extend the journal? */
 	if (server.journal.len + len >= server.journal.limit) {
 		extendJournal();
 		// Even if extendJournal fails, we want to write this message out.
 	}
 
-	len = write(server.journal.fd, msg_string, len);
+	if (server.flush.group) {
+		/* Written out with the rest of this group by journalCommit() */
+		if (server.journal.pending.used == 0)
+			server.journal.commit_due = getTimeMS() + server.flush.group_ms;
+
+		buffAdd(&server.journal.pending, record.data, len);
+	} else {
+		len = journalWrite(record.data, len, server.flush.defer == 0);
+	}
 
 	if (len == -1) {
 		print_msg(JERS_LOG_CRITICAL, "Failed to write to journal file: %s", strerror(errno));
@@ -331,157 +716,403 @@ int stateSaveCmd(uid_t uid, char * cmd, char * msg, jobid_t jobid, int64_t revis
 	server.journal.len += len;
 	server.journal.record++;
 
-	if (server.flush.defer == 0)
-		fdatasync(server.journal.fd);
-	else
+	if (server.flush.defer)
 		server.flush.dirty++;
 
-	server.journal.last_commit = start_offset;
+	server.journal.last_commit = start_offset + journalMarkerOffset(server.journal.format == JOURNAL_FORMAT_BINARY);
 	return 0;
 }
 
-off_t checkForLastCommit(char * journal) {
-	FILE * f = NULL;
-	char * line = NULL;
-	size_t line_size = 0;
-	ssize_t len = 0;
+/* Returns the offset of the record following the last one marked as commited, or -1 if none are.
+ * Only the records from 'from' onwards are checked */
+off_t checkForLastCommit(char * journal, off_t from) {
+	struct journalReader r;
 	off_t last_commit = -1;
 
 	print_msg(JERS_LOG_INFO, "Checking journal: %s", journal);
 
-	if ((f = fopen(journal, "r")) == NULL)
+	if (journalReaderOpen(&r, journal) != 0)
 		error_die("Failed to open journal %s: %s", journal, strerror(errno));
 
-	while ((len = getline(&line, &line_size, f)) != -1) {
-		if (line[0] == '*') {
-			last_commit = ftell(f);
-
-			if (last_commit == -1)
-				error_die("Failed to get offset of last commit: %s", strerror(errno));
-		}
-	}
+	last_commit = journalLastCommit(&r, from);
 
-	if (len == -1 && !feof(f))
-		error_die("Failed to read line from journal: %s", strerror(errno));
-
-	fclose(f);
-	free(line);
+	journalReaderClose(&r);
 
 	return last_commit;
 }
 
-/* Convert a journal entry into a message that can be used for recovering state */
+/* The position following the last commit marker is also saved to the 'journal_commit' file,
+ * so on startup the journals don't need to be searched for it. This is written after the
+ * marker, so can only be behind it. The inode of the journal is saved to catch the journal
+ * being replaced, ie. by converting it to another format */
+static int stateSaveCommit(int journal_fd, const char *datetime, off_t journal_len) {
+	char filename[PATH_MAX];
+	char new_filename[PATH_MAX];
+	struct stat buf;
+	FILE * f;
 
-int convertJournalEntry(msg_t *msg, char *entry) {
-	time_t timestamp_s;
-	int timestamp_ms;
-	uid_t uid;
-	char command[65];
-	jobid_t jobid;
-	int64_t revision;
-	int field_count = 0;
-	int msg_offset = 0;
-	char *json;
-	size_t json_len = 0;
+	sprintf(filename, "%s/journal_commit", server.state_dir);
+	sprintf(new_filename, "%s/journal_commit.new", server.state_dir);
 
-	memset(msg, 0, sizeof(msg_t));
+	if (fstat(journal_fd, &buf) != 0)
+		return 1;
 
-	field_count = sscanf(entry, " %ld.%d\t%d\t%64s\t%u\t%ld\t%n", &timestamp_s, &timestamp_ms, (int *)&uid, command, &jobid, &revision, &msg_offset);
+	f = fopen(new_filename, "w");
 
-	if (field_count != 6) {
-		print_msg(JERS_LOG_CRITICAL, "Failed entry (len:%ld): %s", strlen(entry), entry);
-		error_die("Failed to load journal entry. Got %d fields, wanted 6\n", field_count);
+	if (f == NULL) {
+		fprintf(stderr, "Failed to open commit file %s : %s\n", new_filename, strerror(errno));
+		return 1;
 	}
 
-	json = strdup(entry + msg_offset);
+	fprintf(f, "%s %ld %lu\n", datetime, journal_len, buf.st_ino);
 
-	if (json == NULL)
-		error_die("Failed to copy message for replaying: %s\n", strerror(errno));
+	if (fflush(f) || fsync(fileno(f))) {
+		fclose(f);
+		return 1;
+	}
 
-	if (*json) {
-		json_len = strlen(json);
+	fclose(f);
 
-		if (load_message(json, msg) != 0)
-			error_die("Failed to load message from journal entry");
+	if (rename(new_filename, filename) != 0) {
+		fprintf(stderr, "Failed to rename '%s' to '%s': %s\n", new_filename, filename, strerror(errno));
+		return 1;
 	}
 
-	server.recovery.time = timestamp_s;
-	server.recovery.uid = uid;
-	server.recovery.jobid = jobid;
-	server.recovery.revision = revision;
-	server.recovery.buffer = json;
-
-	return json_len;
+	return 0;
 }
 
-void replayTransaction(char * line) {
-	msg_t msg;
+/* Load the saved commit position. Returns the journal it refers to, or NULL if there isn't a usable one */
+static char *stateLoadCommit(off_t *offset) {
+	char filename[PATH_MAX];
+	char datetime[16];
+	char *journal = NULL;
+	unsigned long inode;
+	struct stat buf;
+	FILE * f;
 
-	/* Remove the newline */
-	line[strcspn(line, "\n")] = 0;
+	sprintf(filename, "%s/journal_commit", server.state_dir);
 
-	/* End of journal marker, nothing to do here */
-	if (line[0] == '$')
-		return;
+	if ((f = fopen(filename, "r")) == NULL) {
+		if (errno != ENOENT)
+			print_msg(JERS_LOG_WARNING, "Failed to open commit file '%s': %s", filename, strerror(errno));
 
-	if (line[0] == 0)
-		return;
+		return NULL;
+	}
 
-	/* Load the fields into a msg_t and call the appropriate command handler */
-	if (convertJournalEntry(&msg, line))
-		replayCommand(&msg);
+	if (fscanf(f, "%15s %ld %lu", datetime, offset, &inode) != 3) {
+		print_msg(JERS_LOG_WARNING, "Ignoring invalid commit file '%s'", filename);
+		fclose(f);
+		return NULL;
+	}
 
-	free(server.recovery.buffer);
-	server.recovery.buffer = NULL;
+	fclose(f);
 
-	return;
+	asprintf(&journal, "%s/journal.%s", server.state_dir, datetime);
+
+	if (stat(journal, &buf) != 0 || buf.st_ino != inode) {
+		print_msg(JERS_LOG_WARNING, "Ignoring commit file '%s' - Journal %s has been removed or replaced", filename, journal);
+		free(journal);
+		return NULL;
+	}
+
+	print_msg(JERS_LOG_DEBUG, "Last saved commit position: %s offset %ld", journal, *offset);
+
+	return journal;
 }
 
-/* Read and replay transactions from the journal.
- * 'Offset' is provided for the first file, subsequent files have the offset passed in as
- * a negative number. - All entries should be replayed for these files */
+/* Threads to use for loading at startup, including the main thread */
+static int loadThreads(void) {
+	long threads = server.load_threads;
 
-void replayJournal(char * journal, off_t offset) {
-	FILE * f = NULL;
-	char * line = NULL;
-	size_t line_size = 0;
-	ssize_t len = 0;
+	if (threads == 0) {
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
 
-	print_msg(JERS_LOG_INFO, "Replaying journal %s", journal);
+		if (threads > MAX_LOAD_THREADS)
+			threads = MAX_LOAD_THREADS;
+	}
 
-	if (offset >= 0)
-		print_msg(JERS_LOG_DEBUG, "Using journal offset: %ld", offset);
+	return threads > 1 ? threads : 1;
+}
 
-	if ((f = fopen(journal, "r")) == NULL)
-		error_die("Failed to open journal %s: %s", journal, strerror(errno));
+/* Journal replay pipeline - The main thread reads records into a ring of slots,
+ * with worker threads decoding them into messages ahead of the main thread,
+ * which applies them in journal order. Decoding doesn't depend on the server
+ * state, so only applying the records needs to be done in sequence. */
 
-	if (offset >= 0 && fseek(f, offset, SEEK_SET) != 0)
-		error_die("Failed to offset into journal at offset %ld: %s", offset, strerror(errno));
+#define REPLAY_RING_SIZE 1024
 
-	while ((len = getline(&line, &line_size, f)) != -1) {
-		replayTransaction(line);
-	}
+struct replaySlot {
+	struct journalEntry e;
+	char *json;
+	msg_t msg;
+	int decoded;
+};
+
+struct replayPipeline {
+	pthread_mutex_t lock;
+	pthread_cond_t filled;		// Workers - There are records to be decoded
+	pthread_cond_t decoded;		// Main thread - A record has been decoded
+	const char *journal;
+	uint64_t head;				// Records read into the ring
+	uint64_t next;				// Next record to be decoded
+	int done;					// No more records will be read
+	struct replaySlot slots[REPLAY_RING_SIZE];
+};
+
+/* Load the journal entry into a message */
+static void decodeEntry(struct replaySlot *s, const char *journal) {
+	s->json = NULL;
+	memset(&s->msg, 0, sizeof(msg_t));
+
+	if (s->e.payload_len == 0)
+		return;
 
-	if (len == -1 && !feof(f))
-		error_die("Failed to read line from journal: %s", strerror(errno));
+	/* The message is parsed in place, so needs its own copy */
+	s->json = malloc(s->e.payload_len + 1);
 
-	fclose(f);
-	free(line);
+	if (s->json == NULL)
+		error_die("Failed to copy message for replaying: %s\n", strerror(errno));
 
-	print_msg(JERS_LOG_DEBUG, "Finished replaying journal %s", journal);
+	memcpy(s->json, s->e.payload, s->e.payload_len);
+	s->json[s->e.payload_len] = '\0';
 
-	return;
+	if (load_message(s->json, &s->msg) != 0)
+		error_die("Failed to load message from journal entry at offset %ld in %s", s->e.offset, journal);
 }
 
-/* After loading all the queues/jobs/resources from disk,
- * we need go through the journals on disk, checking what we need to replay.
- * When dirty objects are written to disk, the journal is marked with a '*' character
+static void applyEntry(struct replaySlot *s) {
+	if (s->json == NULL)
+		return;
+
+	server.recovery.time = s->e.time_ms / 1000;
+	server.recovery.uid = s->e.uid;
+	server.recovery.jobid = s->e.jobid;
+	server.recovery.revision = s->e.revision;
+	server.recovery.buffer = s->json;
+
+	replayCommand(&s->msg);
+	free_message(&s->msg);
+
+	free(server.recovery.buffer);
+	server.recovery.buffer = NULL;
+}
+
+static void *replayWorkerMain(void *arg) {
+	struct replayPipeline *p = arg;
+
+	pthread_mutex_lock(&p->lock);
+
+	for (;;) {
+		while (!p->done && p->next == p->head)
+			pthread_cond_wait(&p->filled, &p->lock);
+
+		if (p->next == p->head)
+			break;
+
+		struct replaySlot *s = &p->slots[p->next++ % REPLAY_RING_SIZE];
+
+		pthread_mutex_unlock(&p->lock);
+		decodeEntry(s, p->journal);
+		pthread_mutex_lock(&p->lock);
+
+		s->decoded = 1;
+		pthread_cond_signal(&p->decoded);
+	}
+
+	pthread_mutex_unlock(&p->lock);
+
+	return NULL;
+}
+
+/* Replay the records from the reader, returning how the reader finished */
+static int replayRecords(struct journalReader *r, const char *journal, int workers) {
+	pthread_t threads[MAX_LOAD_THREADS];
+	struct replayPipeline *p;
+	uint64_t tail = 0;
+	int rc = JOURNAL_RECORD;
+	int i;
+
+	if (workers == 0) {
+		struct replaySlot s;
+
+		while ((rc = journalReaderNext(r, &s.e)) == JOURNAL_RECORD) {
+			decodeEntry(&s, journal);
+			applyEntry(&s);
+		}
+
+		return rc;
+	}
+
+	if ((p = calloc(1, sizeof(struct replayPipeline))) == NULL)
+		error_die("Failed to allocate replay pipeline: %s", strerror(errno));
+
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->filled, NULL);
+	pthread_cond_init(&p->decoded, NULL);
+	p->journal = journal;
+
+	for (i = 0; i < workers; i++) {
+		int err = pthread_create(&threads[i], NULL, replayWorkerMain, p);
+
+		if (err != 0)
+			error_die("Failed to create replay thread: %s", strerror(err));
+	}
+
+	for (;;) {
+		uint64_t filled = p->head;
+
+		/* Top up the ring once it's half empty, so the workers are woken for a batch of records
+		 * rather than each one. The slots past 'head' aren't touched by the workers until it's moved */
+		while (rc == JOURNAL_RECORD && filled - tail < REPLAY_RING_SIZE && (filled != p->head || filled - tail <= REPLAY_RING_SIZE / 2)) {
+			struct replaySlot *s = &p->slots[filled % REPLAY_RING_SIZE];
+
+			if ((rc = journalReaderNext(r, &s->e)) != JOURNAL_RECORD)
+				break;
+
+			s->decoded = 0;
+			filled++;
+		}
+
+		pthread_mutex_lock(&p->lock);
+
+		if (filled != p->head || rc != JOURNAL_RECORD) {
+			p->head = filled;
+			p->done = rc != JOURNAL_RECORD;
+			pthread_cond_broadcast(&p->filled);
+		}
+
+		if (tail == p->head) {
+			pthread_mutex_unlock(&p->lock);
+			break;
+		}
+
+		struct replaySlot *s = &p->slots[tail % REPLAY_RING_SIZE];
+
+		/* Decode the record ourselves if the workers haven't got to it yet,
+		 * rather than sleeping until one of them does */
+		if (p->next == tail) {
+			p->next++;
+			pthread_mutex_unlock(&p->lock);
+			decodeEntry(s, journal);
+			pthread_mutex_lock(&p->lock);
+			s->decoded = 1;
+		}
+
+		while (!s->decoded)
+			pthread_cond_wait(&p->decoded, &p->lock);
+
+		pthread_mutex_unlock(&p->lock);
+
+		applyEntry(s);
+		tail++;
+	}
+
+	for (i = 0; i < workers; i++)
+		pthread_join(threads[i], NULL);
+
+	pthread_cond_destroy(&p->decoded);
+	pthread_cond_destroy(&p->filled);
+	pthread_mutex_destroy(&p->lock);
+	free(p);
+
+	return rc;
+}
+
+/* Read and replay transactions from the journal.
+ * 'Offset' is provided for the first file, subsequent files have the offset passed in as
+ * a negative number. - All entries should be replayed for these files */
+
+void replayJournal(char * journal, off_t offset) {
+	struct journalReader r;
+	int64_t start = getTimeMS();
+	int threads = loadThreads();
+	off_t first;
+	int rc;
+
+	print_msg(JERS_LOG_INFO, "Replaying journal %s", journal);
+
+	if (offset >= 0)
+		print_msg(JERS_LOG_DEBUG, "Using journal offset: %ld", offset);
+
+	if (journalReaderOpen(&r, journal) != 0)
+		error_die("Failed to open journal %s: %s", journal, strerror(errno));
+
+	if (offset > r.offset)
+		r.offset = offset;
+
+	first = r.record;
+
+	/* The main thread applies the records, the rest decode them */
+	rc = replayRecords(&r, journal, threads - 1);
+
+	if (rc == JOURNAL_CORRUPT)
+		error_die("Failed to load journal entry at offset %ld in %s", r.offset, journal);
+
+	/* Anything after a torn record was never acknowledged, so there is nothing more to replay */
+	if (rc == JOURNAL_TORN)
+		print_msg(JERS_LOG_WARNING, "Partially written record at offset %ld in journal %s - Ignoring it", r.offset, journal);
+
+	print_msg(JERS_LOG_INFO, "Replayed %ld records from %s in %ldms using %d threads", r.record - first, journal, getTimeMS() - start, threads);
+
+	journalReaderClose(&r);
+
+	return;
+}
+
+/* The journal and offset to start replaying from after loading a snapshot.
+ * If the journal has been converted since, the offset is found by counting records instead */
+static off_t snapshotReplayStart(glob_t *journalGlob, size_t *start) {
+	char journal[PATH_MAX];
+	struct journalReader r;
+	struct journalEntry e;
+	struct stat buf;
+	size_t i;
+
+	sprintf(journal, "%s/journal.%s", server.state_dir, server.recovery.snapshot_journal);
+
+	/* Older journals are covered by the snapshot */
+	for (i = 1; i <= journalGlob->gl_pathc; i++) {
+		if (strcmp(journalGlob->gl_pathv[i - 1], journal) >= 0)
+			break;
+	}
+
+	*start = i;
+
+	if (i > journalGlob->gl_pathc || strcmp(journalGlob->gl_pathv[i - 1], journal) != 0) {
+		print_msg(JERS_LOG_WARNING, "Journal %s the snapshot was taken in is missing", journal);
+		return 0;
+	}
+
+	if (stat(journal, &buf) == 0 && buf.st_ino == server.recovery.snapshot_inode)
+		return server.recovery.snapshot_offset;
+
+	print_msg(JERS_LOG_WARNING, "Journal %s has been replaced since the snapshot - Skipping the first %ld records", journal, server.recovery.snapshot_record);
+
+	if (journalReaderOpen(&r, journal) != 0)
+		error_die("Failed to open journal %s: %s", journal, strerror(errno));
+
+	while (r.record < server.recovery.snapshot_record) {
+		if (journalReaderNext(&r, &e) != JOURNAL_RECORD)
+			error_die("Journal %s has fewer records than the snapshot covers", journal);
+	}
+
+	off_t offset = r.offset;
+	journalReaderClose(&r);
+
+	return offset;
+}
+
+/* After loading all the queues/jobs/resources from disk,
+ * we need go through the journals on disk, checking what we need to replay.
+ * When dirty objects are written to disk, the journal is marked with a '*' character
  * in the first position corrisponding to the LAST entry we know made it to disk.
  *
  * We need to scan through the journals, newest first, looking for the last '*'
  * and reapplying any commands after that (potentially across journal files) */
 
 void stateReplayJournal(void) {
+	int64_t start = getTimeMS();
+
 	print_msg(JERS_LOG_INFO, "Recovering state from journal files");
 
 	int rc = 0;
@@ -505,13 +1136,29 @@ void stateReplayJournal(void) {
 		error_die("Failed to glob() journal files %s : %s\n", pattern, strerror(errno));
 	}
 
-	if (journalGlob.gl_pathc) {
+	/* Start looking from the last saved commit position. Any journals after it
+	 * still need checking, in case we stopped before it could be updated */
+	off_t commit_offset = 0;
+	char *commit_journal = server.recovery.snapshot ? NULL : stateLoadCommit(&commit_offset);
+
+	if (server.recovery.snapshot) {
+		offset = snapshotReplayStart(&journalGlob, &i);
+	} else if (journalGlob.gl_pathc) {
 		for (i = journalGlob.gl_pathc; i > 0 ; i--) {
-			if ((offset = checkForLastCommit(journalGlob.gl_pathv[i - 1])) >= 0)
+			int saved = commit_journal && strcmp(commit_journal, journalGlob.gl_pathv[i - 1]) == 0;
+
+			if ((offset = checkForLastCommit(journalGlob.gl_pathv[i - 1], saved ? commit_offset : 0)) >= 0)
+				break;
+
+			if (saved) {
+				offset = commit_offset;
 				break;
+			}
 		}
 	}
 
+	free(commit_journal);
+
 	/* If we didn't find any offset, we need to replay everything we have */
 	if (offset == -1) {
 		offset = 0;
@@ -535,7 +1182,7 @@ void stateReplayJournal(void) {
 	server.recovery.uid = 0;
 	server.recovery.jobid = 0;
 
-	print_msg(JERS_LOG_INFO, "Finished recovery from journal files");
+	print_msg(JERS_LOG_INFO, "Finished recovery from journal files in %ldms", getTimeMS() - start);
 
 	/* Now that we have recovered our state, we need to look for any jobs that were in a 'RUN' state when we shutdown (crashed)
 	 * We will mark these jobs as 'UNKNOWN', which will require manual intervention to start again. There is a chance
@@ -559,277 +1206,376 @@ void stateReplayJournal(void) {
 	stateSaveCmd(getuid(), "REPLAY_COMPLETE", NULL, 0, 0);
 }
 
-int stateDelJob(struct job * j) {
-	char filename[PATH_MAX];
-	int directory = j->jobid / STATE_DIV_FACTOR;
-	sprintf(filename, "%s/jobs/%d/%d.job", server.state_dir, directory, j->jobid);
+static int writeData(int fd, const char *data, size_t size) {
+	size_t written = 0;
+
+	while (written < size) {
+		ssize_t len = write(fd, data + written, size - written);
+
+		if (len == -1) {
+			if (errno == EINTR)
+				continue;
 
-	if (unlink(filename) != 0)
-		print_msg(JERS_LOG_WARNING, "Failed to remove statefile for deleted job %d: %s", j->jobid, strerror(errno));
+			return 1;
+		}
+
+		written += len;
+	}
 
 	return 0;
 }
 
-int stateSaveJob(struct job * j) {
-	char filename[PATH_MAX];
-	char new_filename[PATH_MAX];
-	FILE * f;
-	int i;
-	int directory = j->jobid / STATE_DIV_FACTOR;
+/* Write out all of 'b', clearing it */
+static int writeBuffer(int fd, buff_t *b) {
+	if (writeData(fd, b->data, b->used) != 0)
+		return 1;
 
-	sprintf(filename, "%s/jobs/%d/%d.job", server.state_dir, directory, j->jobid);
-	sprintf(new_filename, "%s/jobs/%d/%d.new", server.state_dir, directory, j->jobid);
+	buffClear(b, 0);
 
-	f = fopen(new_filename, "w");
+	return 0;
+}
 
-	if (f == NULL) {
-		if (errno == ENOENT) {
-			/* Try again after attempting to create the sub directory */
-			char create_dir[PATH_MAX];
-			sprintf(create_dir, "%s/jobs/%d", server.state_dir, directory);
-			createDir(create_dir);
+/* Replace 'filename' with 'data', via 'new_filename' */
+static int replaceStateFile(const char *filename, const char *new_filename, const char *data, size_t len) {
+	int fd = open(new_filename, O_CREAT | O_TRUNC | O_WRONLY, 0666);
 
-			f = fopen(new_filename, "w");
-		}
+	if (fd < 0)
+		return 1;
 
-		if (f == NULL) {
-			fprintf(stderr, "Failed to open job file %s : %s\n", filename, strerror(errno));
-			return 1;
-		}
+	if (writeData(fd, data, len) != 0 || fsync(fd) != 0) {
+		int saved = errno;
+		close(fd);
+		errno = saved;
+		return 1;
 	}
 
-	fprintf(f, "# JOB %u\n", j->jobid);
-	fprintf(f, "# SAVETIME %ld\n", time(NULL));
-	fprintf(f, "REVISION %ld\n", j->obj.revision);
+	close(fd);
+
+	if (rename(new_filename, filename) != 0) {
+		fprintf(stderr, "Failed to rename '%s' to '%s': %s\n", new_filename, filename, strerror(errno));
+		return 1;
+	}
+
+	return 0;
+}
+
+/* The key/value lines for each object. These are the contents of the
+ * state files, and of each object in a snapshot */
+
+static void formatJob(buff_t *b, struct job * j) {
+	int i;
 
-	fprintf(f, "JOBNAME %s\n", escapeString(j->jobname, NULL));
-	fprintf(f, "QUEUENAME %s\n", escapeString(j->queue->name, NULL));
-	fprintf(f, "SUBMITTIME %ld\n", j->submit_time);
+	buffPrintf(b, "REVISION %ld\n", j->obj.revision);
 
-	fprintf(f, "SUBMITTER %d\n", j->submitter);
+	buffPrintf(b, "JOBNAME %s\n", escapeString(j->jobname, NULL));
+	buffPrintf(b, "QUEUENAME %s\n", escapeString(j->queue->name, NULL));
+	buffPrintf(b, "SUBMITTIME %ld\n", j->submit_time);
 
-	fprintf(f, "ARGC %d\n", j->argc);
+	buffPrintf(b, "SUBMITTER %d\n", j->submitter);
+
+	buffPrintf(b, "ARGC %d\n", j->argc);
 
 	for (i = 0; i < j->argc; i++) {
-		fprintf(f, "ARGV[%d] %s\n", i, escapeString(j->argv[i], NULL));
+		buffPrintf(b, "ARGV[%d] %s\n", i, escapeString(j->argv[i], NULL));
 	}
 
 	if (j->shell)
-		fprintf(f, "SHELL %s\n", escapeString(j->shell, NULL));
+		buffPrintf(b, "SHELL %s\n", escapeString(j->shell, NULL));
 
 	if (j->pre_cmd)
-		fprintf(f, "PRECMD %s\n", escapeString(j->pre_cmd, NULL));
+		buffPrintf(b, "PRECMD %s\n", escapeString(j->pre_cmd, NULL));
 
 	if (j->post_cmd)
-		fprintf(f, "POSTCMD %s\n", escapeString(j->post_cmd, NULL));
+		buffPrintf(b, "POSTCMD %s\n", escapeString(j->post_cmd, NULL));
 
 	if (j->stdout)
-		fprintf(f, "STDOUT %s\n", escapeString(j->stdout, NULL));
+		buffPrintf(b, "STDOUT %s\n", escapeString(j->stdout, NULL));
 
 	if (j->stderr)
-		fprintf(f, "STDERR %s\n", escapeString(j->stderr, NULL));
+		buffPrintf(b, "STDERR %s\n", escapeString(j->stderr, NULL));
 
 	if (j->env_count) {
-		fprintf(f, "ENV_COUNT %d\n", j->env_count);
+		buffPrintf(b, "ENV_COUNT %d\n", j->env_count);
 
 		for (i = 0; i < j->env_count; i++)
-			fprintf(f, "ENV[%d] %s\n", i, j->envs[i]);
+			buffPrintf(b, "ENV[%d] %s\n", i, j->envs[i]);
 	}
 
 	if (j->tag_count) {
-		fprintf(f, "TAG_COUNT %d\n", j->tag_count);
+		buffPrintf(b, "TAG_COUNT %d\n", j->tag_count);
 		for (i = 0; i < j->tag_count; i++)
-			fprintf(f, "TAG[%d] %s\t%s\n", i, j->tags[i].key, j->tags[i].value ? escapeString(j->tags[i].value, NULL) : "");
+			buffPrintf(b, "TAG[%d] %s\t%s\n", i, j->tags[i].key, j->tags[i].value ? escapeString(j->tags[i].value, NULL) : "");
 	}
 
 	if (j->res_count) {
-		fprintf(f, "RES_COUNT %d\n", j->res_count);
+		buffPrintf(b, "RES_COUNT %d\n", j->res_count);
 		for (i = 0; i < j->res_count; i++)
-			fprintf(f, "RES[%d] %s:%d\n", i, j->req_resources[i].res->name, j->req_resources[i].needed);
+			buffPrintf(b, "RES[%d] %s:%d\n", i, j->req_resources[i].res->name, j->req_resources[i].needed);
 	}
 
 	if (j->uid)
-		fprintf(f, "UID %d\n", j->uid);
+		buffPrintf(b, "UID %d\n", j->uid);
 
 	if (j->nice != UNSET_32)
-		fprintf(f, "NICE %d\n", j->nice);
+		buffPrintf(b, "NICE %d\n", j->nice);
 
 	if (j->state)
-		fprintf(f, "STATE %d\n", j->state);
+		buffPrintf(b, "STATE %d\n", j->state);
 
 	if (j->priority)
-		fprintf(f, "PRIORITY %d\n", j->priority);
+		buffPrintf(b, "PRIORITY %d\n", j->priority);
 
 	if (j->defer_time)
-		fprintf(f, "DEFERTIME %ld\n", j->defer_time);
+		buffPrintf(b, "DEFERTIME %ld\n", j->defer_time);
 
 	if (j->start_time)
-		fprintf(f, "STARTTIME %ld\n", j->start_time);
+		buffPrintf(b, "STARTTIME %ld\n", j->start_time);
 
 	if (j->finish_time)
-		fprintf(f, "FINISHTIME %ld\n", j->finish_time);
+		buffPrintf(b, "FINISHTIME %ld\n", j->finish_time);
 
 	if (j->exitcode)
-		fprintf(f, "EXITCODE %d\n", j->exitcode);
+		buffPrintf(b, "EXITCODE %d\n", j->exitcode);
 
 	if (j->signal)
-		fprintf(f,"SIGNAL %d\n", j->signal);
+		buffPrintf(b,"SIGNAL %d\n", j->signal);
 
 	if (j->flags)
-		fprintf(f,"FLAGS %ld\n", j->flags);
+		buffPrintf(b,"FLAGS %ld\n", j->flags);
 
 	/* Usage */
 	if (j->finish_time) {
-		fprintf(f, "USAGE_UTIME_SEC %ld\n", j->usage.ru_utime.tv_sec);
-		fprintf(f, "USAGE_UTIME_USEC %ld\n", j->usage.ru_utime.tv_usec);
-		fprintf(f, "USAGE_STIME_SEC %ld\n", j->usage.ru_stime.tv_sec);
-		fprintf(f, "USAGE_STIME_USEC %ld\n", j->usage.ru_stime.tv_usec);
-		fprintf(f, "USAGE_MAXRSS %ld\n", j->usage.ru_maxrss);
-		fprintf(f, "USAGE_MINFLT %ld\n", j->usage.ru_minflt);
-		fprintf(f, "USAGE_MAJFLT %ld\n", j->usage.ru_majflt);
-		fprintf(f, "USAGE_INBLOCK %ld\n", j->usage.ru_inblock);
-		fprintf(f, "USAGE_OUBLOCK %ld\n", j->usage.ru_oublock);
-		fprintf(f, "USAGE_NVCSW %ld\n", j->usage.ru_nvcsw);
-		fprintf(f, "USAGE_NIVCSW %ld\n", j->usage.ru_nivcsw);
-	}
-
-	if (fflush(f)) {
-		fclose(f);
-		return 1;
+		buffPrintf(b, "USAGE_UTIME_SEC %ld\n", j->usage.ru_utime.tv_sec);
+		buffPrintf(b, "USAGE_UTIME_USEC %ld\n", j->usage.ru_utime.tv_usec);
+		buffPrintf(b, "USAGE_STIME_SEC %ld\n", j->usage.ru_stime.tv_sec);
+		buffPrintf(b, "USAGE_STIME_USEC %ld\n", j->usage.ru_stime.tv_usec);
+		buffPrintf(b, "USAGE_MAXRSS %ld\n", j->usage.ru_maxrss);
+		buffPrintf(b, "USAGE_MINFLT %ld\n", j->usage.ru_minflt);
+		buffPrintf(b, "USAGE_MAJFLT %ld\n", j->usage.ru_majflt);
+		buffPrintf(b, "USAGE_INBLOCK %ld\n", j->usage.ru_inblock);
+		buffPrintf(b, "USAGE_OUBLOCK %ld\n", j->usage.ru_oublock);
+		buffPrintf(b, "USAGE_NVCSW %ld\n", j->usage.ru_nvcsw);
+		buffPrintf(b, "USAGE_NIVCSW %ld\n", j->usage.ru_nivcsw);
 	}
+}
 
-	if (fsync(fileno(f))) {
-		fclose(f);
-		return 1;
-	}
+static void formatQueue(buff_t *b, struct queue * q) {
+	if (q->desc)
+		buffPrintf(b, "DESC %s\n", q->desc);
 
-	fclose(f);
+	buffPrintf(b, "JOBLIMIT %d\n", q->job_limit);
+	buffPrintf(b, "PRIORITY %d\n", q->priority);
+	buffPrintf(b, "HOST %s\n", q->host);
+	buffPrintf(b, "REVISION %ld\n", q->obj.revision);
 
-	if (rename(new_filename, filename) != 0) {
-		fprintf(stderr, "Failed to rename '%s' to '%s': %s\n", new_filename, filename, strerror(errno));
-		return 1;
-	}
+	if (q->nice != UNSET_32)
+		buffPrintf(b, "NICE %d\n", q->nice);
 
-	return 0;
+	if (server.defaultQueue == q)
+		buffPrintf(b, "DEFAULT 1\n");
 }
 
-int stateSaveQueue(struct queue * q) {
-	char filename[PATH_MAX];
-	char new_filename[PATH_MAX];
-	FILE * f;
+static void formatResource(buff_t *b, struct resource * r) {
+	buffPrintf(b, "COUNT %d\n", r->count);
+	buffPrintf(b, "REVISION %ld\n", r->obj.revision);
+}
 
-	sprintf(filename, "%s/queues/%s.queue", server.state_dir, q->name);
-	sprintf(new_filename, "%s/queues/%s.new", server.state_dir, q->name);
+/* The contents of each state file - The object with a header */
 
-	f = fopen(new_filename, "w");
+static void formatJobFile(buff_t *b, struct job *j) {
+	buffPrintf(b, "# JOB %u\n", j->jobid);
+	buffPrintf(b, "# SAVETIME %ld\n", time(NULL));
+	formatJob(b, j);
+}
 
-	if (f == NULL) {
-		fprintf(stderr, "Failed to open queue file %s : %s\n", filename, strerror(errno));
-		return 1;
-	}
+static void formatQueueFile(buff_t *b, struct queue *q) {
+	buffPrintf(b, "# QUEUE %s\n", q->name);
+	buffPrintf(b, "# SAVETIME %ld\n", time(NULL));
+	formatQueue(b, q);
+}
 
-	fprintf(f, "# QUEUE %s\n", q->name);
-	fprintf(f, "# SAVETIME %ld\n", time(NULL));
+static void formatResourceFile(buff_t *b, struct resource *r) {
+	buffPrintf(b, "# RESOURCE %s\n", r->name);
+	buffPrintf(b, "# SAVETIME %ld\n", time(NULL));
+	formatResource(b, r);
+}
 
-	if (q->desc)
-		fprintf(f, "DESC %s\n", q->desc);
+/* Deleted objects are removed by the next background save, rather than on the event loop.
+ * The removal is queued as the object is deleted, so any save whose journal marker covers
+ * the deletion also removes the object. A deleted object that's still dirty isn't written.
+ * These hold the state file paths (NUL terminated), or the object store deletion records */
+static buff_t pendingDeletes = {0};		// Deletions for the next save
+static buff_t flushDeletes = {0};		// Deletions being made by the running save
 
-	fprintf(f, "JOBLIMIT %d\n", q->job_limit);
-	fprintf(f, "PRIORITY %d\n", q->priority);
-	fprintf(f, "HOST %s\n", q->host);
-	fprintf(f, "REVISION %ld\n", q->obj.revision);
+/* The object store being appended to with state_format log. See objstore.h */
+static struct objstore objectStore = {.fd = -1};
+static off_t objectStoreLive = 0;			// Size of the live objects as of the last load or compaction
+static off_t objectStoreSaveStart = 0;		// Segment size before the running save, to cut a failed one off
+static int objectStoreFull = 0;				// Every object needs saving, as the store is new
+static int objectStoreCompacting = 0;
 
-	if (q->nice != UNSET_32)
-		fprintf(f, "NICE %d\n", q->nice);
+/* With snapshots, deleted objects are just left out of the next one */
 
-	if (server.defaultQueue == q)
-		fprintf(f, "DEFAULT 1\n");
+static void queueDelete(const char *filename) {
+	buffAdd(&pendingDeletes, filename, strlen(filename) + 1);
+}
 
-	if (fflush(f)) {
-		fclose(f);
-		return 1;
-	}
+/* Hand the deletions queued so far to the save being started */
+static void takeDeletes(void) {
+	buff_t tmp = flushDeletes;
 
-	if (fsync(fileno(f))) {
-		fclose(f);
-		return 1;
-	}
+	flushDeletes = pendingDeletes;
+	pendingDeletes = tmp;
+	buffClear(&pendingDeletes, 0);
+}
 
-	fclose(f);
+/* The save has finished. If it failed, its deletions go to the next save, ahead of any queued since */
+static void finishDeletes(int status) {
+	if (status) {
+		if (pendingDeletes.used)
+			buffAdd(&flushDeletes, pendingDeletes.data, pendingDeletes.used);
 
-	if (rename(new_filename, filename) != 0) {
-		fprintf(stderr, "Failed to rename '%s' to '%s': %s\n", new_filename, filename, strerror(errno));
-		return 1;
+		buff_t tmp = pendingDeletes;
+		pendingDeletes = flushDeletes;
+		flushDeletes = tmp;
 	}
 
-	return 0;
+	buffClear(&flushDeletes, 0);
 }
 
-int stateDelQueue(struct queue * q) {
+/* Remove the state files of the objects deleted before this save. This is done before
+ * anything is written, as the name or jobid of a deleted object can be reused */
+static void removeStateFiles(void) {
+	const char *path = flushDeletes.data;
+	const char *end = flushDeletes.data + flushDeletes.used;
+
+	for (; path < end; path += strlen(path) + 1) {
+		if (unlink(path) != 0 && errno != ENOENT)
+			print_msg(JERS_LOG_WARNING, "Failed to remove statefile for deleted object %s: %s", path, strerror(errno));
+	}
+}
+
+int stateDelJob(struct job * j) {
 	char filename[PATH_MAX];
-	sprintf(filename, "%s/queues/%s.queue", server.state_dir, q->name);
+	int directory = j->jobid / STATE_DIV_FACTOR;
+
+	if (server.state_format == STATE_FORMAT_SNAPSHOT)
+		return 0;
 
-	if (unlink(filename) != 0)
-		print_msg(JERS_LOG_WARNING, "Failed to remove statefile for deleted queue %s: %s", q->name, strerror(errno));
+	if (server.state_format == STATE_FORMAT_LOG) {
+		sprintf(filename, "%u", j->jobid);
+		objstoreFormatDelete(&pendingDeletes, SNAPSHOT_JOB, filename);
+		return 0;
+	}
+
+	sprintf(filename, "%s/jobs/%d/%d.job", server.state_dir, directory, j->jobid);
+	queueDelete(filename);
 
 	return 0;
 }
 
-int stateSaveResource(struct resource * r) {
+int stateSaveJob(struct job * j) {
 	char filename[PATH_MAX];
 	char new_filename[PATH_MAX];
-	FILE * f;
-
-	sprintf(filename, "%s/resources/%s.resource", server.state_dir, r->name);
-	sprintf(new_filename, "%s/resources/%s.new", server.state_dir, r->name);
+	static buff_t b = {0};
+	int directory = j->jobid / STATE_DIV_FACTOR;
 
-	f = fopen(new_filename, "w");
+	sprintf(filename, "%s/jobs/%d/%d.job", server.state_dir, directory, j->jobid);
+	sprintf(new_filename, "%s/jobs/%d/%d.new", server.state_dir, directory, j->jobid);
 
-	if (f == NULL) {
-		fprintf(stderr, "Failed to open resource file %s : %s\n", filename, strerror(errno));
-		return 1;
-	}
+	buffClear(&b, 0);
+	formatJobFile(&b, j);
 
-	fprintf(f, "# RESOURCE %s\n", r->name);
-	fprintf(f, "# SAVETIME %ld\n", time(NULL));
+	if (replaceStateFile(filename, new_filename, b.data, b.used) != 0) {
+		if (errno == ENOENT) {
+			/* Try again after attempting to create the sub directory */
+			char create_dir[PATH_MAX];
+			sprintf(create_dir, "%s/jobs/%d", server.state_dir, directory);
+			createDir(create_dir);
 
-	fprintf(f, "COUNT %d\n", r->count);
-	fprintf(f, "REVISION %ld\n", r->obj.revision);
+			if (replaceStateFile(filename, new_filename, b.data, b.used) == 0)
+				return 0;
+		}
 
-	if (fflush(f)) {
-		fclose(f);
+		fprintf(stderr, "Failed to write job file %s : %s\n", filename, strerror(errno));
 		return 1;
 	}
 
-	if (fsync(fileno(f))) {
-		fclose(f);
-		return 1;
-	}
+	return 0;
+}
 
-	fclose(f);
+int stateSaveQueue(struct queue * q) {
+	char filename[PATH_MAX];
+	char new_filename[PATH_MAX];
+	static buff_t b = {0};
 
-	if (rename(new_filename, filename) != 0) {
-		fprintf(stderr, "Failed to rename '%s' to '%s': %s\n", new_filename, filename, strerror(errno));
+	sprintf(filename, "%s/queues/%s.queue", server.state_dir, q->name);
+	sprintf(new_filename, "%s/queues/%s.new", server.state_dir, q->name);
+
+	buffClear(&b, 0);
+	formatQueueFile(&b, q);
+
+	if (replaceStateFile(filename, new_filename, b.data, b.used) != 0) {
+		fprintf(stderr, "Failed to write queue file %s : %s\n", filename, strerror(errno));
 		return 1;
 	}
 
 	return 0;
 }
 
-int stateDelResource(struct resource * r) {
+int stateDelQueue(struct queue * q) {
 	char filename[PATH_MAX];
-	sprintf(filename, "%s/resources/%s.resource", server.state_dir, r->name);
 
-	if (unlink(filename) != 0)
-		print_msg(JERS_LOG_WARNING, "Failed to remove statefile for deleted resource %s: %s", r->name, strerror(errno));
+	if (server.state_format == STATE_FORMAT_SNAPSHOT)
+		return 0;
 
-	return 0;
+	if (server.state_format == STATE_FORMAT_LOG) {
+		objstoreFormatDelete(&pendingDeletes, SNAPSHOT_QUEUE, q->name);
+		return 0;
+	}
+
+	sprintf(filename, "%s/queues/%s.queue", server.state_dir, q->name);
+	queueDelete(filename);
+
+	return 0;
 }
 
+int stateSaveResource(struct resource * r) {
+	char filename[PATH_MAX];
+	char new_filename[PATH_MAX];
+	static buff_t b = {0};
+
+	sprintf(filename, "%s/resources/%s.resource", server.state_dir, r->name);
+	sprintf(new_filename, "%s/resources/%s.new", server.state_dir, r->name);
+
+	buffClear(&b, 0);
+	formatResourceFile(&b, r);
+
+	if (replaceStateFile(filename, new_filename, b.data, b.used) != 0) {
+		fprintf(stderr, "Failed to write resource file %s : %s\n", filename, strerror(errno));
+		return 1;
+	}
+
+	return 0;
+}
+
+int stateDelResource(struct resource * r) {
+	char filename[PATH_MAX];
+
+	if (server.state_format == STATE_FORMAT_SNAPSHOT)
+		return 0;
+
+	if (server.state_format == STATE_FORMAT_LOG) {
+		objstoreFormatDelete(&pendingDeletes, SNAPSHOT_RESOURCE, r->name);
+		return 0;
+	}
+
+	sprintf(filename, "%s/resources/%s.resource", server.state_dir, r->name);
+	queueDelete(filename);
+
+	return 0;
+}
 
-/* Save the current high allocated jobid to disk.
- * This is loaded on startup as a hint to where
- * jobid allocation should start from */
 int stateSaveJobID(jobid_t jobid) {
 	char filename[PATH_MAX];
 	sprintf(filename, "%s/jobid", server.state_dir);
@@ -853,74 +1599,928 @@ jobid_t stateLoadJobID(void) {
 	char *line = NULL;
 	size_t size = 0;
 
-	sprintf(filename, "%s/jobid", server.state_dir);
+	sprintf(filename, "%s/jobid", server.state_dir);
+
+	FILE *f = fopen(filename, "r");
+
+	if (f == NULL) {
+		if (errno != ENOENT)
+			print_msg(JERS_LOG_WARNING, "Failed to open jobid file '%s': %s", filename, strerror(errno));
+
+		return 0;
+	}
+
+	/* Only expect to have one line */
+	ssize_t len = getline(&line, &size, f);
+
+	if (len <= 0) {
+		print_msg(JERS_LOG_WARNING, "Failed to read jobid file '%s': %s", filename, strerror(errno));
+		fclose(f);
+		return 0;
+	}
+
+	jobid = atoi(line);
+
+	free(line);
+	fclose(f);
+
+	return jobid;
+}
+
+int stateSaveToDiskChild(struct job ** jobs, struct queue ** queues, struct resource ** resources) {
+	int64_t i;
+
+	setproctitle("jersd_state_save");
+
+	print_msg(JERS_LOG_DEBUG, "Starting background save. %ld Jobs %ld Queues %ld Resources",
+		server.flush_jobs, server.flush_queues, server.flush_resources);
+
+	/* Save the start jobid as a hint when the server starts */
+	stateSaveJobID(server.start_jobid);
+
+	removeStateFiles();
+
+	/* Save the queues and resources first, to avoid having to handle
+	 * situations where we might have to recover jobs that reference
+	 * queues and resources that don't exist */
+
+	for (i = 0; i < server.flush_resources; i++) {
+		if (!(resources[i]->internal_state &JERS_FLAG_DELETED) && stateSaveResource(resources[i]))
+			return 1;
+	}
+
+	for (i = 0; i < server.flush_queues; i++) {
+		if (!(queues[i]->internal_state &JERS_FLAG_DELETED) && stateSaveQueue(queues[i]))
+			return 1;
+	}
+
+	for (i = 0; i < server.flush_jobs; i++) {
+		if (!(jobs[i]->internal_state &JERS_FLAG_DELETED) && stateSaveJob(jobs[i]))
+			return 1;
+	}
+
+	/* Flush any directory we might have touched */
+	if (flushStateDirs())
+		return 1;
+
+	return 0;
+}
+
+#define SNAPSHOT_WRITE_SIZE 0x100000
+
+/* The snapshot header records the position in the current journal it's up to */
+static void snapshotHeaderNow(struct snapshotHeader *h, ino_t journal_inode) {
+	memset(h, 0, sizeof(struct snapshotHeader));
+	h->save_time = time(NULL);
+	h->start_jobid = server.start_jobid;
+	strcpy(h->journal, server.journal.datetime);
+	h->journal_offset = server.journal.len;
+	h->journal_record = server.journal.record;
+	h->journal_inode = journal_inode;
+}
+
+/* Format a snapshot of every object into 'b', writing the buffer out to 'fd' as it
+ * fills. Returns the number of objects, or -1 if a write failed */
+static int64_t formatSnapshot(buff_t *b, struct snapshotHeader *h, int fd) {
+	char key[16];
+	struct resource *r;
+	struct queue *q;
+	struct job *j;
+	int64_t objects = 0;
+	size_t start;
+
+	snapshotFormatHeader(b, h);
+
+	/* Resources and queues first, as the jobs refer to them */
+	for (r = server.resTable; r != NULL; r = r->hh.next) {
+		if (r->internal_state &JERS_FLAG_DELETED)
+			continue;
+
+		start = snapshotBeginObject(b, SNAPSHOT_RESOURCE, r->name);
+		formatResource(b, r);
+		snapshotEndObject(b, start);
+		objects++;
+	}
+
+	for (q = server.queueTable; q != NULL; q = q->hh.next) {
+		if (q->internal_state &JERS_FLAG_DELETED)
+			continue;
+
+		start = snapshotBeginObject(b, SNAPSHOT_QUEUE, q->name);
+		formatQueue(b, q);
+		snapshotEndObject(b, start);
+		objects++;
+	}
+
+	for (j = server.jobTable; j != NULL; j = j->hh.next) {
+		if (j->internal_state &JERS_FLAG_DELETED)
+			continue;
+
+		sprintf(key, "%u", j->jobid);
+		start = snapshotBeginObject(b, SNAPSHOT_JOB, key);
+		formatJob(b, j);
+		snapshotEndObject(b, start);
+		objects++;
+
+		if (b->used >= SNAPSHOT_WRITE_SIZE && writeBuffer(fd, b) != 0)
+			return -1;
+	}
+
+	snapshotFormatEnd(b, objects);
+
+	return objects;
+}
+
+/* Write the formatted snapshot in 'b' to the snapshot file */
+static int writeSnapshot(buff_t *b, int fd, const char *filename, const char *new_filename) {
+	if (writeBuffer(fd, b) != 0 || fsync(fd) != 0) {
+		fprintf(stderr, "Failed to write snapshot file %s : %s\n", new_filename, strerror(errno));
+		close(fd);
+		return 1;
+	}
+
+	close(fd);
+
+	if (rename(new_filename, filename) != 0) {
+		fprintf(stderr, "Failed to rename '%s' to '%s': %s\n", new_filename, filename, strerror(errno));
+		return 1;
+	}
+
+	return flushDir(server.state_dir);
+}
+
+/* Write every object to a new snapshot, replacing the current one once it's complete.
+ * This is run in the forked background save process, so has a consistent view of
+ * everything up to the end of the current journal. */
+
+static int stateSaveSnapshot(void) {
+	char filename[PATH_MAX];
+	char new_filename[PATH_MAX];
+	struct snapshotHeader h;
+	struct stat buf;
+	int64_t objects;
+	buff_t b;
+	int fd;
+
+	setproctitle("jersd_state_save");
+
+	sprintf(filename, "%s/snapshot", server.state_dir);
+	sprintf(new_filename, "%s/snapshot.new", server.state_dir);
+
+	/* The journal records covered by the snapshot need to be on disk before it is,
+	 * otherwise we could lose them and append new records at an offset it covers */
+	if (fdatasync(server.journal.fd) != 0 || fstat(server.journal.fd, &buf) != 0) {
+		fprintf(stderr, "Failed to flush journal before snapshot: %s\n", strerror(errno));
+		return 1;
+	}
+
+	snapshotHeaderNow(&h, buf.st_ino);
+
+	fd = open(new_filename, O_CREAT | O_TRUNC | O_WRONLY, 0666);
+
+	if (fd < 0) {
+		fprintf(stderr, "Failed to open snapshot file %s : %s\n", new_filename, strerror(errno));
+		return 1;
+	}
+
+	buffNew(&b, SNAPSHOT_WRITE_SIZE * 2);
+	objects = formatSnapshot(&b, &h, fd);
+
+	if (objects < 0) {
+		fprintf(stderr, "Failed to write snapshot file %s : %s\n", new_filename, strerror(errno));
+		close(fd);
+		buffFree(&b);
+		return 1;
+	}
+
+	int status = writeSnapshot(&b, fd, filename, new_filename);
+	buffFree(&b);
+
+	if (status == 0)
+		print_msg(JERS_LOG_DEBUG, "Snapshot saved. %ld objects, current to journal.%s offset %ld", objects, h.journal, h.journal_offset);
+
+	return status;
+}
+
+/* Compress a journal into journal_archive_dir as journal.<datetime>.gz */
+static int archiveJournal(const char *journal) {
+	char archive[PATH_MAX];
+	char new_archive[PATH_MAX + 4];
+	char buf[65536];
+	gzFile gz = NULL;
+	ssize_t len;
+	int in, out;
+	int status = 1;
+
+	len = snprintf(archive, sizeof(archive), "%s/%s.gz", server.journal_archive_dir, strrchr(journal, '/') + 1);
+
+	if (len < 0 || (size_t)len >= sizeof(archive)) {
+		errno = ENAMETOOLONG;
+		return 1;
+	}
+
+	snprintf(new_archive, sizeof(new_archive), "%s.new", archive);
+
+	if ((in = open(journal, O_RDONLY | O_CLOEXEC)) < 0)
+		return 1;
+
+	if ((out = open(new_archive, O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, 0640)) < 0) {
+		close(in);
+		return 1;
+	}
+
+	/* The gzFile is given its own descriptor, so the archive can still be synced after it's closed */
+	int gz_fd = dup(out);
+
+	if (gz_fd < 0 || (gz = gzdopen(gz_fd, "wb")) == NULL) {
+		if (gz_fd >= 0)
+			close(gz_fd);
+
+		goto archive_done;
+	}
+
+	while ((len = read(in, buf, sizeof(buf))) > 0) {
+		if (gzwrite(gz, buf, len) != len)
+			break;
+	}
+
+	if (gzclose(gz) == Z_OK && len == 0 && fsync(out) == 0 && rename(new_archive, archive) == 0)
+		status = 0;
+
+archive_done:
+	close(in);
+	close(out);
+
+	if (status)
+		unlink(new_archive);
+
+	return status;
+}
+
+/* Remove the archived journals older than journal_archive_days */
+static void expireArchivedJournals(void) {
+	char pattern[PATH_MAX];
+	glob_t archiveGlob;
+	struct stat buf;
+	time_t cutoff = time(NULL) - (time_t)server.journal_archive_days * 24 * 60 * 60;
+
+	snprintf(pattern, sizeof(pattern), "%s/journal.*.gz", server.journal_archive_dir);
+
+	if (glob(pattern, 0, NULL, &archiveGlob) != 0) {
+		globfree(&archiveGlob);
+		return;
+	}
+
+	for (size_t i = 0; i < archiveGlob.gl_pathc; i++) {
+		if (stat(archiveGlob.gl_pathv[i], &buf) != 0 || buf.st_mtime >= cutoff)
+			continue;
+
+		if (unlink(archiveGlob.gl_pathv[i]) != 0) {
+			print_msg(JERS_LOG_WARNING, "Failed to remove archived journal %s: %s", archiveGlob.gl_pathv[i], strerror(errno));
+			continue;
+		}
+
+		print_msg(JERS_LOG_INFO, "Removed archived journal %s - Older than %d days", archiveGlob.gl_pathv[i], server.journal_archive_days);
+	}
+
+	globfree(&archiveGlob);
+}
+
+/* Once a snapshot, a save to the object store or a checkpoint is on disk, the journals
+ * before the one it covers are no longer needed. They are archived if journal_archive_dir is set.
+ * This is run by the background save, so a slow archive doesn't hold up the main thread */
+void stateTruncateJournals(const char *datetime) {
+	char pattern[PATH_MAX];
+	char current[PATH_MAX];
+	glob_t journalGlob;
+	size_t i;
+
+	sprintf(pattern, "%s/journal.*", server.state_dir);
+	sprintf(current, "%s/journal.%s", server.state_dir, datetime);
+
+	if (glob(pattern, 0, NULL, &journalGlob) != 0) {
+		globfree(&journalGlob);
+		return;
+	}
+
+	for (i = 0; i < journalGlob.gl_pathc; i++) {
+		if (strcmp(journalGlob.gl_pathv[i], current) >= 0)
+			break;
+
+		if (server.journal_archive_dir && archiveJournal(journalGlob.gl_pathv[i]) != 0) {
+			print_msg(JERS_LOG_WARNING, "Failed to archive journal %s to %s: %s - Keeping it",
+				journalGlob.gl_pathv[i], server.journal_archive_dir, strerror(errno));
+			continue;
+		}
+
+		if (unlink(journalGlob.gl_pathv[i]) != 0) {
+			print_msg(JERS_LOG_WARNING, "Failed to remove journal %s: %s", journalGlob.gl_pathv[i], strerror(errno));
+			continue;
+		}
+
+		print_msg(JERS_LOG_INFO, "%s journal %s - Covered by the save of journal.%s",
+			server.journal_archive_dir ? "Archived" : "Removed", journalGlob.gl_pathv[i], datetime);
+	}
+
+	globfree(&journalGlob);
+	flushDir(server.state_dir);
+
+	if (server.journal_archive_dir) {
+		flushDir(server.journal_archive_dir);
+
+		if (server.journal_archive_days)
+			expireArchivedJournals();
+	}
+}
+
+/* Object store - state_format log
+ *
+ * Each save appends the deletions since the last save, then the changed objects and
+ * a commit record holding the journal position the save covers. A failed save is cut
+ * off the segment again, so the next save carries on from the last commit. */
+
+static void formatStoreResource(buff_t *b, struct resource *r) {
+	size_t start;
+
+	if (r->internal_state &JERS_FLAG_DELETED) {
+		objstoreFormatDelete(b, SNAPSHOT_RESOURCE, r->name);
+		return;
+	}
+
+	start = snapshotBeginObject(b, SNAPSHOT_RESOURCE, r->name);
+	formatResource(b, r);
+	snapshotEndObject(b, start);
+}
+
+static void formatStoreQueue(buff_t *b, struct queue *q) {
+	size_t start;
+
+	if (q->internal_state &JERS_FLAG_DELETED) {
+		objstoreFormatDelete(b, SNAPSHOT_QUEUE, q->name);
+		return;
+	}
+
+	start = snapshotBeginObject(b, SNAPSHOT_QUEUE, q->name);
+	formatQueue(b, q);
+	snapshotEndObject(b, start);
+}
+
+static void formatStoreJob(buff_t *b, struct job *j) {
+	char key[16];
+	size_t start;
+
+	sprintf(key, "%u", j->jobid);
+
+	if (j->internal_state &JERS_FLAG_DELETED) {
+		objstoreFormatDelete(b, SNAPSHOT_JOB, key);
+		return;
+	}
+
+	start = snapshotBeginObject(b, SNAPSHOT_JOB, key);
+	formatJob(b, j);
+	snapshotEndObject(b, start);
+}
+
+/* Format the records of a save to the object store into 'b'. The deletions go first,
+ * as a name or jobid can be reused by an object in the same save */
+static void formatObjectStoreSave(buff_t *b, struct job **jobs, struct queue **queues, struct resource **resources, ino_t journal_inode) {
+	struct objstoreCommit c;
+	int64_t i;
+
+	memset(&c, 0, sizeof(struct objstoreCommit));
+
+	if (flushDeletes.used)
+		buffAdd(b, flushDeletes.data, flushDeletes.used);
+
+	if (objectStoreFull) {
+		struct resource *r;
+		struct queue *q;
+		struct job *j;
+
+		for (r = server.resTable; r != NULL; r = r->hh.next, c.records++)
+			formatStoreResource(b, r);
+
+		for (q = server.queueTable; q != NULL; q = q->hh.next, c.records++)
+			formatStoreQueue(b, q);
+
+		for (j = server.jobTable; j != NULL; j = j->hh.next, c.records++)
+			formatStoreJob(b, j);
+	} else {
+		for (i = 0; i < server.flush_resources; i++)
+			formatStoreResource(b, resources[i]);
+
+		for (i = 0; i < server.flush_queues; i++)
+			formatStoreQueue(b, queues[i]);
+
+		for (i = 0; i < server.flush_jobs; i++)
+			formatStoreJob(b, jobs[i]);
+
+		c.records = server.flush_resources + server.flush_queues + server.flush_jobs;
+	}
+
+	c.save_time = time(NULL);
+	c.start_jobid = server.start_jobid;
+	strcpy(c.journal, server.journal.datetime);
+	c.journal_offset = server.journal.len;
+	c.journal_record = server.journal.record;
+	c.journal_inode = journal_inode;
+
+	objstoreFormatCommit(b, &c);
+}
+
+static int writeObjectStore(const char *data, size_t len) {
+	if (writeData(objectStore.fd, data, len) != 0 || fdatasync(objectStore.fd) != 0) {
+		fprintf(stderr, "Failed to write to object store segment %ld : %s\n", objectStore.segment, strerror(errno));
+		return 1;
+	}
+
+	return 0;
+}
+
+/* Append the save to the object store. This is run in the forked background save process */
+static int stateSaveObjectStore(struct job **jobs, struct queue **queues, struct resource **resources) {
+	struct stat buf;
+	buff_t b;
+	int status;
+
+	setproctitle("jersd_state_save");
+
+	/* As with a snapshot, the journal records the save covers need to be on disk first */
+	if (fdatasync(server.journal.fd) != 0 || fstat(server.journal.fd, &buf) != 0) {
+		fprintf(stderr, "Failed to flush journal before saving objects: %s\n", strerror(errno));
+		return 1;
+	}
+
+	buffNew(&b, 0);
+	formatObjectStoreSave(&b, jobs, queues, resources, buf.st_ino);
+	status = writeObjectStore(b.data, b.used);
+
+	if (status == 0)
+		print_msg(JERS_LOG_DEBUG, "Background save complete. %ld bytes appended to object store segment %ld", b.used, objectStore.segment);
+
+	buffFree(&b);
+
+	return status;
+}
+
+/* Called before a save is started. Moves on to a new segment once the current one is full */
+static void objectStoreBeginSave(void) {
+	if (objectStore.size >= server.object_segment_size && objstoreRoll(&objectStore) != 0)
+		print_msg(JERS_LOG_WARNING, "Failed to start a new object store segment: %s", strerror(errno));
+
+	objectStoreSaveStart = objectStore.size;
+}
+
+/* Pick up the result of a compaction, waiting for it if 'block' is set */
+static void objectStoreCompactDone(int block) {
+	off_t size;
+	int status = objstoreCompactCheck(block, &size);
+
+	if (status < 0)
+		return;
+
+	objectStoreCompacting = 0;
+
+	if (status) {
+		print_msg(JERS_LOG_WARNING, "Object store compaction failed: %s", strerror(errno));
+		return;
+	}
+
+	objectStoreLive = size;
+	print_msg(JERS_LOG_INFO, "Object store compaction complete. Sealed segments now %ld bytes", size);
+}
+
+/* Compact the sealed segments once they're mostly made up of old versions */
+static void objectStoreCompact(void) {
+	off_t sealed;
+
+	if (objectStoreCompacting)
+		return;
+
+	sealed = objstoreSealedSize(&objectStore);
+
+	if (sealed == 0 || sealed < objectStoreLive * OBJSTORE_COMPACT_RATIO)
+		return;
+
+	if (objstoreCompactStart(objectStore.dir, objectStore.segment) != 0) {
+		print_msg(JERS_LOG_WARNING, "Failed to start object store compaction: %s", strerror(errno));
+		return;
+	}
+
+	print_msg(JERS_LOG_INFO, "Compacting object store segments before %ld. %ld bytes sealed, %ld bytes live",
+		objectStore.segment, sealed, objectStoreLive);
+
+	objectStoreCompacting = 1;
+}
+
+static void objectStoreEndSave(int status) {
+	struct stat buf;
+
+	if (status) {
+		if (ftruncate(objectStore.fd, objectStoreSaveStart) != 0)
+			print_msg(JERS_LOG_WARNING, "Failed to remove failed save from object store segment %ld: %s", objectStore.segment, strerror(errno));
+
+		objectStore.size = objectStoreSaveStart;
+		return;
+	}
+
+	objectStoreFull = 0;
+
+	if (fstat(objectStore.fd, &buf) == 0)
+		objectStore.size = buf.st_size;
+
+	objectStoreCompact();
+}
+
+/* Threaded background save - save_mode thread
+ *
+ * Instead of forking, the main thread formats the dirty objects into a buffer, then a
+ * writer thread writes it out. The writer never touches the objects themselves, so the
+ * event loop carries on while it runs, without the cost of fork() and the copy-on-write
+ * faults that follow it. The result is picked up by stateSaveToDisk() on its next call,
+ * the same as for the forked save.
+ *
+ * A snapshot covers every object, so formatting one would stall the event loop for as
+ * long as the save takes. state_format snapshot is always saved by a forked process, as
+ * is a save that fills in a new object store. */
+
+struct saveFile {
+	size_t path;	// Offset of the filename in the save buffer
+	size_t data;	// Offset of the contents
+	size_t len;
+};
+
+static struct {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int running;			// Main thread - A save thread has been started, but not joined
+	int finished;			// Set by the save thread once it's done
+	int status;
+
+	int format;				// STATE_FORMAT_*
+	buff_t data;			// The state files or object store records to write
+	struct item_list files;
+
+	/* The journal as of the start of the save. The writer uses its own handle,
+	 * as the journal might be rolled over and closed during the save */
+	int journal_fd;
+	off_t last_commit;
+	off_t journal_len;
+	char datetime[16];
+	jobid_t start_jobid;
+	int checkpoint;			// Remove the journals before this one once it's saved
+} saveThread = {.lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER, .journal_fd = -1};
+
+static void saveFileBegin(struct saveFile *f, const char *filename) {
+	f->path = saveThread.data.used;
+	buffAdd(&saveThread.data, filename, strlen(filename) + 1);
+	f->data = saveThread.data.used;
+}
+
+static void saveFileEnd(struct saveFile *f) {
+	f->len = saveThread.data.used - f->data;
+	listAdd(&saveThread.files, f);
+}
+
+/* Replace a state file, creating its directory if needed */
+static int saveWriteFile(const char *filename, const char *data, size_t len) {
+	char new_filename[PATH_MAX];
+	char dir[PATH_MAX];
+	const char *ext = strrchr(filename, '.');
+
+	sprintf(new_filename, "%.*s.new", (int)(ext - filename), filename);
+
+	if (replaceStateFile(filename, new_filename, data, len) == 0)
+		return 0;
+
+	if (errno == ENOENT) {
+		/* Try again after attempting to create the sub directory */
+		strcpy(dir, filename);
+
+		if ((mkdir(dirname(dir), S_IRWXU|S_IRGRP|S_IXGRP) == 0 || errno == EEXIST) &&
+			replaceStateFile(filename, new_filename, data, len) == 0)
+			return 0;
+	}
+
+	fprintf(stderr, "Failed to write state file %s : %s\n", filename, strerror(errno));
+	return 1;
+}
+
+static int saveThreadFiles(void) {
+	struct saveFile *f;
+
+	stateSaveJobID(saveThread.start_jobid);
+	removeStateFiles();
+
+	LIST_ITER(&saveThread.files, f) {
+		if (saveWriteFile(saveThread.data.data + f->path, saveThread.data.data + f->data, f->len))
+			return 1;
+	}
+
+	if (flushStateDirs())
+		return 1;
+
+	/* Mark the journal, as the forked save does */
+	if (pwrite(saveThread.journal_fd, "*", 1, saveThread.last_commit) != 1)
+		print_msg(JERS_LOG_WARNING, "Background save: Failed to write marker to journal: %s\n", strerror(errno));
+
+	fdatasync(saveThread.journal_fd);
+
+	if (stateSaveCommit(saveThread.journal_fd, saveThread.datetime, saveThread.journal_len) != 0)
+		print_msg(JERS_LOG_WARNING, "Background save: Failed to save commit position: %s\n", strerror(errno));
+	else if (saveThread.checkpoint)
+		stateTruncateJournals(saveThread.datetime);
+
+	print_msg(JERS_LOG_DEBUG, "Background save complete. Files:%ld", saveThread.files.count);
+
+	return 0;
+}
+
+static int saveThreadObjects(void) {
+	if (fdatasync(saveThread.journal_fd) != 0) {
+		fprintf(stderr, "Failed to flush journal before saving objects: %s\n", strerror(errno));
+		return 1;
+	}
+
+	if (writeObjectStore(saveThread.data.data, saveThread.data.used) != 0)
+		return 1;
+
+	print_msg(JERS_LOG_DEBUG, "Background save complete. %ld bytes appended to object store segment %ld",
+		saveThread.data.used, objectStore.segment);
+
+	if (server.truncate_journals || saveThread.checkpoint)
+		stateTruncateJournals(saveThread.datetime);
+
+	return 0;
+}
+
+static void *saveThreadMain(void *arg) {
+	UNUSED(arg);
+	int status;
+
+	if (saveThread.format == STATE_FORMAT_LOG)
+		status = saveThreadObjects();
+	else
+		status = saveThreadFiles();
+
+	if (status != 0)
+		print_msg(JERS_LOG_WARNING, "Background save: Failed.\n");
+
+	pthread_mutex_lock(&saveThread.lock);
+	saveThread.status = status;
+	saveThread.finished = 1;
+	pthread_cond_signal(&saveThread.cond);
+	pthread_mutex_unlock(&saveThread.lock);
+
+	return NULL;
+}
+
+/* Format everything being saved, then start the writer thread */
+static void saveThreadStart(struct job **jobs, struct queue **queues, struct resource **resources) {
+	char filename[PATH_MAX];
+	struct saveFile f;
+	struct stat buf;
+	sigset_t all, old;
+	int64_t i;
+	int err;
+
+	saveThread.format = server.state_format;
+	saveThread.journal_fd = dup(server.journal.fd);
+	saveThread.last_commit = server.journal.last_commit;
+	saveThread.journal_len = server.journal.len;
+	saveThread.start_jobid = server.start_jobid;
+	strcpy(saveThread.datetime, server.journal.datetime);
+	saveThread.checkpoint = checkpoint.active;
+
+	if (saveThread.journal_fd < 0 || fstat(saveThread.journal_fd, &buf) != 0)
+		error_die("stateSaveToDisk: failed to open journal for background save: %s", strerror(errno));
+
+	buffNew(&saveThread.data, 0);
+	listNew(&saveThread.files, sizeof(struct saveFile));
+
+	if (saveThread.format == STATE_FORMAT_LOG) {
+		formatObjectStoreSave(&saveThread.data, jobs, queues, resources, buf.st_ino);
+	} else {
+		/* Resources and queues are written first, as with the forked save */
+		for (i = 0; i < server.flush_resources; i++) {
+			if (resources[i]->internal_state &JERS_FLAG_DELETED)
+				continue;
+
+			sprintf(filename, "%s/resources/%s.resource", server.state_dir, resources[i]->name);
+			saveFileBegin(&f, filename);
+			formatResourceFile(&saveThread.data, resources[i]);
+			saveFileEnd(&f);
+		}
+
+		for (i = 0; i < server.flush_queues; i++) {
+			if (queues[i]->internal_state &JERS_FLAG_DELETED)
+				continue;
+
+			sprintf(filename, "%s/queues/%s.queue", server.state_dir, queues[i]->name);
+			saveFileBegin(&f, filename);
+			formatQueueFile(&saveThread.data, queues[i]);
+			saveFileEnd(&f);
+		}
+
+		for (i = 0; i < server.flush_jobs; i++) {
+			if (jobs[i]->internal_state &JERS_FLAG_DELETED)
+				continue;
+
+			sprintf(filename, "%s/jobs/%d/%d.job", server.state_dir, jobs[i]->jobid / STATE_DIV_FACTOR, jobs[i]->jobid);
+			saveFileBegin(&f, filename);
+			formatJobFile(&saveThread.data, jobs[i]);
+			saveFileEnd(&f);
+		}
+	}
+
+	print_msg(JERS_LOG_DEBUG, "Starting background save thread. %ld Jobs %ld Queues %ld Resources, %ld bytes",
+		server.flush_jobs, server.flush_queues, server.flush_resources, saveThread.data.used);
+
+	saveThread.finished = 0;
+	saveThread.status = 0;
+
+	/* Signals are left to the main thread */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+
+	err = pthread_create(&saveThread.thread, NULL, saveThreadMain, NULL);
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (err != 0)
+		error_die("stateSaveToDisk: failed to create background save thread: %s", strerror(err));
+
+	saveThread.running = 1;
+}
+
+/* Check if the save thread has finished, waiting for it if 'block' is set.
+ * Returns the status of the save, or -1 if it's still running */
+static int saveThreadCheck(int block) {
+	int finished, status;
+
+	pthread_mutex_lock(&saveThread.lock);
+
+	while (block && !saveThread.finished)
+		pthread_cond_wait(&saveThread.cond, &saveThread.lock);
+
+	finished = saveThread.finished;
+	status = saveThread.status;
+
+	pthread_mutex_unlock(&saveThread.lock);
+
+	if (!finished)
+		return -1;
+
+	pthread_join(saveThread.thread, NULL);
+	saveThread.running = 0;
+
+	close(saveThread.journal_fd);
+	saveThread.journal_fd = -1;
+
+	buffFree(&saveThread.data);
+	listFree(&saveThread.files);
+
+	return status;
+}
+
+#define dirtyObject(_obj, _type) ((_type *)((char *)(_obj) - offsetof(_type, obj)))
+
+/* Add an object to the dirty list for its type, if it isn't already on it */
+static void markDirty(jers_object *obj) {
+	struct dirtyList *list;
+
+	if (obj->dirty)
+		return;
+
+	switch(obj->type) {
+		case JERS_OBJECT_JOB: list = &server.dirty_jobs; break;
+		case JERS_OBJECT_QUEUE: list = &server.dirty_queues; break;
+		case JERS_OBJECT_RESOURCE: list = &server.dirty_resources; break;
+		default: return;
+	}
 
-	FILE *f = fopen(filename, "r");
+	obj->dirty = 1;
+	obj->dirty_next = list->head;
+	list->head = obj;
+	list->count++;
+}
 
-	if (f == NULL) {
-		if (errno != ENOENT)
-			print_msg(JERS_LOG_WARNING, "Failed to open jobid file '%s': %s", filename, strerror(errno));
+/* The objects being saved by the current background save */
+static struct job ** dirtyJobs = NULL;
+static struct queue ** dirtyQueues = NULL;
+static struct resource ** dirtyResources = NULL;
 
-		return 0;
+/* Roll over to a new journal, so the save being started covers all the older ones.
+ * The checkpoint record gives the save a record in the new journal to mark */
+static void checkpointBegin(void) {
+	checkpoint.requested = 0;
+	checkpoint.roll = 1;
+
+	if (stateSaveCmd(getuid(), CMD_CHECKPOINT, NULL, 0, 0) != 0) {
+		print_msg(JERS_LOG_WARNING, "Failed to write checkpoint to the journal - Skipping checkpoint");
+		return;
 	}
 
-	/* Only expect to have one line */
-	ssize_t len = getline(&line, &size, f);
+	checkpoint.active = 1;
+	strcpy(checkpoint.datetime, server.journal.datetime);
 
-	if (len <= 0) {
-		print_msg(JERS_LOG_WARNING, "Failed to read jobid file '%s': %s", filename, strerror(errno));
-		fclose(f);
-		return 0;
+	print_msg(JERS_LOG_INFO, "Starting checkpoint at journal.%s", checkpoint.datetime);
+}
+
+/* A background save has finished, either the forked process or the save thread */
+static void stateSaveFinished(int status, int64_t took) {
+	if (status) {
+		print_msg(JERS_LOG_CRITICAL, "Background save failed. ExitCode:%d", status);
+
+		if (server.readonly == 0) {
+			print_msg(JERS_LOG_CRITICAL, "*********************************************");
+			print_msg(JERS_LOG_CRITICAL, "*          Background save failed           *");
+			print_msg(JERS_LOG_CRITICAL, "*        Switching to READONLY mode!        *");
+			print_msg(JERS_LOG_CRITICAL, "*********************************************");
+			server.readonly = READONLY_BGSAVE;
+		}
+	} else {
+		/* Sucessful save. Clear read only mode if we previously
+		 * entered it due to and issue with a save */
+		if (server.readonly == READONLY_BGSAVE) {
+			server.readonly = 0;
+			print_msg(JERS_LOG_INFO, "Turning off readonly mode - Background save successful.");
+			requestSchedule();
+		}
 	}
 
-	jobid = atoi(line);
+	/* Clear the flushing flag on the objects */
+	if (server.flush_jobs) {
+		int64_t i;
+		for (i = 0; i < server.flush_jobs; i++)
+			dirtyJobs[i]->internal_state &= ~JERS_FLAG_FLUSHING;
+	}
 
-	free(line);
-	fclose(f);
+	if (server.flush_queues) {
+		int64_t i;
+		for (i = 0; i < server.flush_queues; i++)
+			dirtyQueues[i]->internal_state &= ~JERS_FLAG_FLUSHING;
+	}
 
-	return jobid;
-}
+	if (server.flush_resources) {
+		int64_t i;
+		for (i = 0; i < server.flush_resources; i++)
+			dirtyResources[i]->internal_state &= ~JERS_FLAG_FLUSHING;
+	}
 
-int stateSaveToDiskChild(struct job ** jobs, struct queue ** queues, struct resource ** resources) {
-	int64_t i;
+	finishDeletes(status);
 
-	setproctitle("jersd_state_save");
+	if (server.state_format == STATE_FORMAT_LOG)
+		objectStoreEndSave(status);
 
-	print_msg(JERS_LOG_DEBUG, "Starting background save. %ld Jobs %ld Queues %ld Resources",
-		server.flush_jobs, server.flush_queues, server.flush_resources);
+	if (checkpoint.active) {
+		if (status)
+			print_msg(JERS_LOG_WARNING, "Checkpoint at journal.%s failed - Journals kept", checkpoint.datetime);
+		else
+			print_msg(JERS_LOG_INFO, "Checkpoint complete. Recovery starts from journal.%s", checkpoint.datetime);
 
-	/* Save the start jobid as a hint when the server starts */
-	stateSaveJobID(server.start_jobid);
+		checkpoint.active = 0;
+	}
 
-	/* Save the queues and resources first, to avoid having to handle
-	 * situations where we might have to recover jobs that reference
-	 * queues and resources that don't exist */
+	/* If the background save failed, set them all back as dirty */
+	if (unlikely(status)) {
+		if (server.flush_jobs) {
+			int64_t i;
+			for (i = 0; i < server.flush_jobs; i++)
+				markDirty(&dirtyJobs[i]->obj);
+		}
 
-	for (i = 0; i < server.flush_resources; i++) {
-		if (stateSaveResource(resources[i]))
-			return 1;
-	}
+		if (server.flush_queues) {
+			int64_t i;
+			for (i = 0; i < server.flush_queues; i++)
+				markDirty(&dirtyQueues[i]->obj);
+		}
 
-	for (i = 0; i < server.flush_queues; i++) {
-		if (stateSaveQueue(queues[i]))
-			return 1;
+		if (server.flush_resources) {
+			int64_t i;
+			for (i = 0; i < server.flush_resources; i++)
+				markDirty(&dirtyResources[i]->obj);
+		}
 	}
 
-	for (i = 0; i < server.flush_jobs; i++) {
-		if (stateSaveJob(jobs[i]))
-			return 1;
-	}
+	/* Clear our active flush counts  */
+	server.flush_jobs = server.flush_queues = server.flush_resources = 0;
 
-	/* Flush any directory we might have touched */
-	if (flushStateDirs())
-		return 1;
+	free(dirtyJobs);
+	free(dirtyQueues);
+	free(dirtyResources);
 
-	return 0;
+	print_msg(JERS_LOG_DEBUG, "Background save %s. Took %ldms\n", status ? "FAILED":"complete", took);
+
+	dirtyJobs = NULL;
+	dirtyQueues = NULL;
+	dirtyResources = NULL;
 }
 
 /* This function is responsible for commiting dirty objects to disk.
- * - This is done by creating a list of the dirty objects, then
- *   forking off so the writes are done in the background */
+ * - This is done by taking the objects off the dirty lists, then
+ *   forking off (or handing them to a thread) so the writes are done in the background */
 
 void stateSaveToDisk(int block) {
 	static uint64_t startTime = 0;
@@ -931,9 +2531,22 @@ void stateSaveToDisk(int block) {
 		return;
 	}
 
-	static struct job ** dirtyJobs = NULL;
-	static struct queue ** dirtyQueues = NULL;
-	static struct resource ** dirtyResources = NULL;
+	if (objectStoreCompacting)
+		objectStoreCompactDone(0);
+
+	/* A save thread was started previously */
+	if (saveThread.running) {
+		int status = saveThreadCheck(block);
+
+		if (status >= 0) {
+			stateSaveFinished(status, getTimeMS() - startTime);
+			startTime = 0;
+			return;
+		}
+
+		print_msg(JERS_LOG_DEBUG, "Background save still running. Has been %ldms", now - startTime);
+		return;
+	}
 
 	/* If pid is populated we kicked off a save previously */
 	if (server.flush.pid) {
@@ -945,24 +2558,6 @@ void stateSaveToDisk(int block) {
 
 			if (WIFEXITED(rc)) {
 				status = WEXITSTATUS(rc);
-				if (status) {
-					print_msg(JERS_LOG_CRITICAL, "Background save failed. ExitCode:%d", status);
-
-					if (server.readonly == 0) {
-						print_msg(JERS_LOG_CRITICAL, "*********************************************");
-						print_msg(JERS_LOG_CRITICAL, "*          Background save failed           *");
-						print_msg(JERS_LOG_CRITICAL, "*        Switching to READONLY mode!        *");
-						print_msg(JERS_LOG_CRITICAL, "*********************************************");
-						server.readonly = READONLY_BGSAVE;
-					}
-				} else {
-					/* Sucessful save. Clear read only mode if we previously
-					 * entered it due to and issue with a save */
-					if (server.readonly == READONLY_BGSAVE) {
-						server.readonly = 0;
-						print_msg(JERS_LOG_INFO, "Turning off readonly mode - Background save successful.");
-					}
-				}
 			}
 			else if (WIFSIGNALED(rc)) {
 				signo = WTERMSIG(rc);
@@ -971,66 +2566,10 @@ void stateSaveToDisk(int block) {
 				error_die("Background save failed - Unknown reason.");
 			}
 
-			/* Clear the flushing flag on the objects */
-			if (server.flush_jobs) {
-				int64_t i;
-				for (i = 0; i < server.flush_jobs; i++)
-					dirtyJobs[i]->internal_state &= ~JERS_FLAG_FLUSHING;
-			}
-
-			if (server.flush_queues) {
-				int64_t i;
-				for (i = 0; i < server.flush_queues; i++)
-					dirtyQueues[i]->internal_state &= ~JERS_FLAG_FLUSHING;
-			}
-
-			if (server.flush_resources) {
-				int64_t i;
-				for (i = 0; i < server.flush_resources; i++)
-					dirtyResources[i]->internal_state &= ~JERS_FLAG_FLUSHING;
-			}
-
-			/* If the background save failed, set them all back as dirty */
-			if (unlikely(status)) {
-				if (server.flush_jobs) {
-					int64_t i;
-					for (i = 0; i < server.flush_jobs; i++)
-						dirtyJobs[i]->obj.dirty = 1;
-
-					server.dirty_jobs = 1;
-				}
-
-				if (server.flush_queues) {
-					int64_t i;
-					for (i = 0; i < server.flush_queues; i++)
-						dirtyQueues[i]->obj.dirty = 1;
-
-					server.dirty_queues = 1;
-				}
-
-				if (server.flush_resources) {
-					int64_t i;
-					for (i = 0; i < server.flush_resources; i++)
-						dirtyResources[i]->obj.dirty = 1;
-
-					server.dirty_resources = 1;
-				}
-			}
-
-			/* Clear our active flush counts  */
-			server.flush_jobs = server.flush_queues = server.flush_resources = 0;
-
-			free(dirtyJobs);
-			free(dirtyQueues);
-			free(dirtyResources);
-
-			print_msg(JERS_LOG_DEBUG, "Background save %s. Took %ldms\n", status ? "FAILED":"complete", now - startTime);
+			stateSaveFinished(status, now - startTime);
 
 			server.flush.pid = 0;
 			startTime = 0;
-			dirtyJobs = NULL;
-			dirtyQueues = NULL;
-			dirtyResources = NULL;
 			return;
 		}
 
@@ -1042,7 +2581,9 @@ void stateSaveToDisk(int block) {
 		return;
 	}
 
-	if (server.dirty_jobs == 0 && server.dirty_queues == 0 && server.dirty_resources == 0)
+	/* A new object store is filled in once there's a journal for the save to cover */
+	if (server.dirty_jobs.count == 0 && server.dirty_queues.count == 0 && server.dirty_resources.count == 0 &&
+		pendingDeletes.used == 0 && (!objectStoreFull || server.journal.fd < 0) && !checkpoint.requested)
 		return;
 
 	if (server.readonly == READONLY_ENOSPACE) {
@@ -1053,70 +2594,110 @@ void stateSaveToDisk(int block) {
 		}
 	}
 
+	if (checkpoint.requested)
+		checkpointBegin();
+
+	/* The commit marker can only be written once the records it covers are */
+	if (journalCommit() != 0) {
+		print_msg(JERS_LOG_WARNING, "Skipping background save - Failed to write the journal");
+
+		/* Try the checkpoint again with the next save */
+		if (checkpoint.active) {
+			checkpoint.active = 0;
+			checkpoint.requested = 1;
+		}
+
+		return;
+	}
+
 	print_msg(JERS_LOG_DEBUG, "Starting background save to disk");
 
-	/* Check for dirty objects - saving the references to flush to disk.
+	/* Take the dirty objects off their lists - saving the references to flush to disk.
 	 * We clear the dirty flags here, and set a flushing state as we might
 	 * make other changes to these objects while they are being saved to disk. */
 
-	if (server.dirty_jobs) {
-		int i = 0;
-		struct job * j = NULL;
+	if (server.dirty_jobs.count) {
+		int64_t i = server.dirty_jobs.count;
+		jers_object *o;
 
-		dirtyJobs = malloc(sizeof(struct job *) * (HASH_COUNT(server.jobTable) + 1));
+		dirtyJobs = malloc(sizeof(struct job *) * (i + 1));
+		dirtyJobs[i] = NULL;
 
-		for (j = server.jobTable; j != NULL; j = j->hh.next) {
-			if (j->obj.dirty) {
-				dirtyJobs[i++] = j;
-				j->obj.dirty = 0;
-				j->internal_state |= JERS_FLAG_FLUSHING;
-			}
+		/* The list is newest first, so fill the array from the end */
+		for (o = server.dirty_jobs.head; o != NULL; o = o->dirty_next) {
+			struct job *j = dirtyObject(o, struct job);
+			dirtyJobs[--i] = j;
+			j->obj.dirty = 0;
+			j->internal_state |= JERS_FLAG_FLUSHING;
 		}
 
-		dirtyJobs[i] = NULL;
-		server.flush_jobs = i;
+		server.flush_jobs = server.dirty_jobs.count;
 	}
 
-	if (server.dirty_queues) {
-		int i = 0;
-		struct queue * q = NULL;
+	if (server.dirty_queues.count) {
+		int64_t i = server.dirty_queues.count;
+		jers_object *o;
 
-		dirtyQueues = malloc(sizeof(struct queue *) * (HASH_COUNT(server.queueTable) + 1));
+		dirtyQueues = malloc(sizeof(struct queue *) * (i + 1));
+		dirtyQueues[i] = NULL;
 
-		for (q = server.queueTable; q != NULL; q = q->hh.next) {
-			if (q->obj.dirty) {
-				dirtyQueues[i++] = q;
-				q->obj.dirty = 0;
-				q->internal_state |= JERS_FLAG_FLUSHING;
-			}
+		for (o = server.dirty_queues.head; o != NULL; o = o->dirty_next) {
+			struct queue *q = dirtyObject(o, struct queue);
+			dirtyQueues[--i] = q;
+			q->obj.dirty = 0;
+			q->internal_state |= JERS_FLAG_FLUSHING;
 		}
 
-		dirtyQueues[i] = NULL;
-		server.flush_queues = i;
+		server.flush_queues = server.dirty_queues.count;
 	}
 
-	if (server.dirty_resources) {
-		int i = 0;
-		struct resource * r = NULL;
+	if (server.dirty_resources.count) {
+		int64_t i = server.dirty_resources.count;
+		jers_object *o;
 
-		dirtyResources = malloc(sizeof(struct resource *) * (HASH_COUNT(server.resTable) + 1));
+		dirtyResources = malloc(sizeof(struct resource *) * (i + 1));
+		dirtyResources[i] = NULL;
 
-		for (r = server.resTable; r != NULL; r = r->hh.next) {
-			if (r->obj.dirty) {
-				dirtyResources[i++] = r;
-				r->obj.dirty = 0;
-				r->internal_state |= JERS_FLAG_FLUSHING;
-			}
+		for (o = server.dirty_resources.head; o != NULL; o = o->dirty_next) {
+			struct resource *r = dirtyObject(o, struct resource);
+			dirtyResources[--i] = r;
+			r->obj.dirty = 0;
+			r->internal_state |= JERS_FLAG_FLUSHING;
 		}
 
-		dirtyResources[i] = NULL;
-		server.flush_resources = i;
+		server.flush_resources = server.dirty_resources.count;
 	}
 
-	server.dirty_jobs = server.dirty_queues = server.dirty_resources = 0;
+	memset(&server.dirty_jobs, 0, sizeof(struct dirtyList));
+	memset(&server.dirty_queues, 0, sizeof(struct dirtyList));
+	memset(&server.dirty_resources, 0, sizeof(struct dirtyList));
+
+	takeDeletes();
+
+	if (server.state_format == STATE_FORMAT_LOG)
+		objectStoreBeginSave();
 
 	startTime = getTimeMS();
 
+	/* Filling in a new object store formats every object, which is left to a forked save */
+	int thread = server.save_mode == SAVE_MODE_THREAD;
+
+	if (thread && server.state_format == STATE_FORMAT_LOG && objectStoreFull) {
+		print_msg(JERS_LOG_INFO, "Saving every object to the new object store - Using a forked save");
+		thread = 0;
+	}
+
+	if (thread) {
+		saveThreadStart(dirtyJobs, dirtyQueues, dirtyResources);
+
+		if (block) {
+			print_msg(JERS_LOG_INFO, "Waiting for background save to complete (blocking)");
+			stateSaveToDisk(1);
+		}
+
+		return;
+	}
+
 	server.flush.pid = fork();
 
 	if (server.flush.pid == -1) {
@@ -1124,6 +2705,31 @@ void stateSaveToDisk(int block) {
 	}
 
 	if (server.flush.pid == 0) {
+		if (server.state_format == STATE_FORMAT_SNAPSHOT) {
+			/* The snapshot records the journal position itself, so the journal isn't marked */
+			int status = stateSaveSnapshot();
+
+			if (status == 0 && (server.truncate_journals || checkpoint.active))
+				stateTruncateJournals(server.journal.datetime);
+
+			if (status != 0)
+				print_msg(JERS_LOG_WARNING, "Background save: Failed.\n");
+
+			_exit(status);
+		}
+
+		if (server.state_format == STATE_FORMAT_LOG) {
+			int status = stateSaveObjectStore(dirtyJobs, dirtyQueues, dirtyResources);
+
+			if (status == 0 && (server.truncate_journals || checkpoint.active))
+				stateTruncateJournals(server.journal.datetime);
+
+			if (status != 0)
+				print_msg(JERS_LOG_WARNING, "Background save: Failed.\n");
+
+			_exit(status);
+		}
+
 		int status = stateSaveToDiskChild(dirtyJobs, dirtyQueues, dirtyResources);
 		free(dirtyJobs);
 		free(dirtyQueues);
@@ -1140,6 +2746,11 @@ void stateSaveToDisk(int block) {
 				server.flush_jobs, server.flush_queues, server.flush_resources);
 
 			fdatasync(server.journal.fd);
+
+			if (stateSaveCommit(server.journal.fd, server.journal.datetime, server.journal.len) != 0)
+				print_msg(JERS_LOG_WARNING, "Background save: Failed to save commit position: %s\n", strerror(errno));
+			else if (checkpoint.active)
+				stateTruncateJournals(server.journal.datetime);
 		} else {
 			print_msg(JERS_LOG_WARNING, "Background save: Failed.\n");
 		}
@@ -1156,6 +2767,38 @@ void stateSaveToDisk(int block) {
 	return;
 }
 
+/* Request a checkpoint. It's started with the next background save, straight away unless
+ * a save is still running */
+int stateCheckpoint(void) {
+	if (server.nosave) {
+		print_msg(JERS_LOG_WARNING, "NO SAVE ENABLED - Not running checkpoint");
+		return 1;
+	}
+
+	checkpoint.requested = 1;
+
+	/* The first call collects a save that has finished */
+	stateSaveToDisk(0);
+
+	if (checkpoint.requested && server.flush.pid == 0 && !saveThread.running)
+		stateSaveToDisk(0);
+
+	return 0;
+}
+
+/* Wait for a background save (and an object store compaction) that's in progress to finish.
+ * Deletions are only made by a save, so one is run for any still queued */
+void stateSaveWait(void) {
+	if (server.flush.pid || saveThread.running)
+		stateSaveToDisk(1);
+
+	if (pendingDeletes.used)
+		stateSaveToDisk(1);
+
+	if (objectStoreCompacting)
+		objectStoreCompactDone(1);
+}
+
 /* Create a directory if it doesn't exist */
 void createDir(const char *path) {
 	struct stat buf;
@@ -1277,51 +2920,86 @@ void stateInit(void) {
 	sprintf(tmp, "%s/resources", server.state_dir);
 	createDir(tmp);
 
+	if (server.journal_archive_dir)
+		createDir(server.journal_archive_dir);
+
 	flushStateDirs();
 
 	/* Load the 'high' jobid hint */
 	server.start_jobid = stateLoadJobID();
 }
 
-/* Read through the current state files converting the commands
- *  to the appropriate job/queue/res files */
+/* Read a whole state file into memory, NULL terminated */
+static char *readStateFile(const char *fileName) {
+	struct stat buf;
+	char *data = NULL;
+	size_t len = 0;
+	int fd = open(fileName, O_RDONLY | O_CLOEXEC);
 
-struct job * stateLoadJob(const char * fileName) {
-	FILE * f = NULL;
-	char * line = NULL;
-	size_t line_size = 0;
-	ssize_t len;
-	jobid_t jobid = 0;
-	char * temp;
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &buf) != 0 || (data = malloc(buf.st_size + 1)) == NULL)
+		goto fail;
+
+	while (len < (size_t)buf.st_size) {
+		ssize_t rc = read(fd, data + len, buf.st_size - len);
 
-	f = fopen(fileName, "r");
+		if (rc == -1 && errno == EINTR)
+			continue;
+
+		if (rc <= 0)
+			goto fail;
 
-	if (!f) {
-		error_die("Failed to open job file %s: %s\n", fileName, strerror(errno));
+		len += rc;
 	}
 
-	temp = strrchr(fileName, '/');
+	data[len] = '\0';
+	close(fd);
 
-	if (temp == NULL) {
-		error_die("Failed to determine jobid from filename %s", fileName);
+	return data;
+
+fail:
+	free(data);
+	close(fd);
+	return NULL;
+}
+
+/* Split the next line from 'data', returning NULL once there are none left */
+static char *nextLine(char **data) {
+	char *line = *data;
+	char *end;
+
+	if (*line == '\0')
+		return NULL;
+
+	if ((end = strchr(line, '\n')) != NULL) {
+		*end = '\0';
+		*data = end + 1;
+	} else {
+		*data = line + strlen(line);
 	}
 
-	jobid = atoi(temp + 1); // + 1 to move past the '/'
+	return line;
+}
+
+/* Create the objects from their key/value lines. 'data' is modified as it's parsed,
+ * 'source' is the file it came from, for any error messages */
+
+static struct job * parseJob(jobid_t jobid, char *data, const char *source) {
+	char * line;
 
 	struct job * j = calloc(sizeof(struct job), 1);
 	j->jobid = jobid;
 	j->obj.type = JERS_OBJECT_JOB;
 
-	while((len = getline(&line, &line_size, f)) != -1) {
+	while ((line = nextLine(&data)) != NULL) {
 
 		char *key, *value;
 		int index = 0;
 
-		if (line[len - 1] == '\n')
-			line[len - 1] = '\0';
-
 		if (loadKeyValue(line, &key, &value, &index))
-			error_die("Failed to parse job file: %s", fileName);
+			error_die("Failed to parse job %d from %s", jobid, source);
 
 		if (!key || !value)
 			continue;
@@ -1403,54 +3081,258 @@ struct job * stateLoadJob(const char * fileName) {
 		} else if (strcmp(key, "FLAGS") == 0) {
 			strtoint64(value, &j->flags);
 		} else if (strcmp(key, "REVISION") == 0) {
-			strtoint64(value, &j->obj.revision);
-		} else if (strcmp(key, "USAGE_UTIME_SEC") == 0) {
-			strtoint64(value, &j->usage.ru_utime.tv_sec);
-		} else if (strcmp(key, "USAGE_UTIME_USEC") == 0) {
-			strtoint64(value, &j->usage.ru_utime.tv_usec);
-		} else if (strcmp(key, "USAGE_STIME_SEC") == 0) {
-			strtoint64(value, &j->usage.ru_stime.tv_sec);
-		} else if (strcmp(key, "USAGE_STIME_USEC") == 0) {
-			strtoint64(value, &j->usage.ru_stime.tv_usec);
-		} else if (strcmp(key, "USAGE_MAXRSS") == 0) {
-			strtoint64(value, &j->usage.ru_maxrss);
-		} else if (strcmp(key, "USAGE_MINFLT") == 0) {
-			strtoint64(value, &j->usage.ru_minflt);
-		} else if (strcmp(key, "USAGE_MAJFLT") == 0) {
-			strtoint64(value, &j->usage.ru_majflt);
-		} else if (strcmp(key, "USAGE_INBLOCK") == 0) {
-			strtoint64(value, &j->usage.ru_inblock);
-		} else if (strcmp(key, "USAGE_OUBLOCK") == 0) {
-			strtoint64(value, &j->usage.ru_oublock);
-		} else if (strcmp(key, "USAGE_NVCSW") == 0) {
-			strtoint64(value, &j->usage.ru_nvcsw);
-		} else if (strcmp(key, "USAGE_NIVCSW") == 0) {
-			strtoint64(value, &j->usage.ru_nivcsw);
+			strtoint64(value, &j->obj.revision);
+		} else if (strcmp(key, "USAGE_UTIME_SEC") == 0) {
+			strtoint64(value, &j->usage.ru_utime.tv_sec);
+		} else if (strcmp(key, "USAGE_UTIME_USEC") == 0) {
+			strtoint64(value, &j->usage.ru_utime.tv_usec);
+		} else if (strcmp(key, "USAGE_STIME_SEC") == 0) {
+			strtoint64(value, &j->usage.ru_stime.tv_sec);
+		} else if (strcmp(key, "USAGE_STIME_USEC") == 0) {
+			strtoint64(value, &j->usage.ru_stime.tv_usec);
+		} else if (strcmp(key, "USAGE_MAXRSS") == 0) {
+			strtoint64(value, &j->usage.ru_maxrss);
+		} else if (strcmp(key, "USAGE_MINFLT") == 0) {
+			strtoint64(value, &j->usage.ru_minflt);
+		} else if (strcmp(key, "USAGE_MAJFLT") == 0) {
+			strtoint64(value, &j->usage.ru_majflt);
+		} else if (strcmp(key, "USAGE_INBLOCK") == 0) {
+			strtoint64(value, &j->usage.ru_inblock);
+		} else if (strcmp(key, "USAGE_OUBLOCK") == 0) {
+			strtoint64(value, &j->usage.ru_oublock);
+		} else if (strcmp(key, "USAGE_NVCSW") == 0) {
+			strtoint64(value, &j->usage.ru_nvcsw);
+		} else if (strcmp(key, "USAGE_NIVCSW") == 0) {
+			strtoint64(value, &j->usage.ru_nivcsw);
+		}
+	}
+
+	if (j->queue == NULL) {
+		error_die("Error loading job %d from %s - No queue specified", j->jobid, source);
+	}
+
+	if (j->state == 0)
+		j->state = JERS_JOB_PENDING;
+
+	return j;
+}
+
+static struct queue * parseQueue(const char *name, char *data, const char *source) {
+	struct queue * q;
+	char * line;
+
+	q = calloc(sizeof(struct queue), 1);
+	q->name = strdup(name);
+	q->job_limit = JERS_QUEUE_DEFAULT_LIMIT;
+	q->priority = JERS_QUEUE_DEFAULT_PRIORITY;
+	q->state = JERS_QUEUE_DEFAULT_STATE;
+	q->obj.type = JERS_OBJECT_QUEUE;
+	q->nice = UNSET_32;
+
+	while ((line = nextLine(&data)) != NULL) {
+		char * key = NULL, *value = NULL;
+		int index;
+
+		if (loadKeyValue(line, &key, &value, &index))
+			error_die("stateLoadQueue: Error parsing queue %s from %s\n", name, source);
+
+		if (!key || !value)
+			continue;
+
+		if (strcmp(key, "DESC") == 0) {
+			q->desc = strdup(value);
+		} else if (strcmp(key, "JOBLIMIT") == 0) {
+			q->job_limit = atoi(value);
+		} else if (strcmp(key, "PRIORITY") == 0) {
+			q->priority = atoi(value);
+		} else if (strcmp(key, "DEFAULT") == 0) {
+			q->def = atoi(value);
+		} else if (strcmp(key, "HOST") == 0) {
+			q->host = strdup(value);
+		} else if (strcmp(key, "REVISION") == 0) {
+			strtoint64(value, &q->obj.revision);
+		} else if (strcmp(key, "NICE") == 0) {
+			q->nice = atoi(value);
+		} else {
+			print_msg(JERS_LOG_WARNING, "stateLoadQueue: skipping unknown config '%s' for queue %s\n", key, name);
+		}
+	}
+
+	if (q->host == NULL) {
+		error_die("Error loading queue %s from disk. Expected to find HOST key in %s", q->name, source);
+	}
+
+	return q;
+}
+
+static struct resource * parseResource(const char *name, char *data, const char *source) {
+	struct resource * r;
+	char * line;
+
+	r = calloc(sizeof(struct resource), 1);
+	r->name = strdup(name);
+	r->obj.type = JERS_OBJECT_RESOURCE;
+
+	while ((line = nextLine(&data)) != NULL) {
+
+		char * key = NULL, *value = NULL;
+		int index;
+
+		if (loadKeyValue(line, &key, &value, &index))
+			error_die("stateLoadRes: Error parsing resource %s from %s\n", name, source);
+
+		if (!key || !value)
+			continue;
+
+		if (strcmp(key, "COUNT") == 0) {
+			r->count = atoi(value);
+		} else if (strcmp(key, "REVISION") == 0) {
+			strtoint64(value, &r->obj.revision);
+		} else {
+			print_msg(JERS_LOG_WARNING, "stateLoadRes: skipping unknown config '%s' for resource %s\n", key, name);
 		}
 	}
 
-	if (len == -1 && feof(f) == 0) {
-		error_die("Error reading job file %s:%s\n", fileName, strerror(errno));
+	return r;
+}
+
+/* Read through the current state files converting the commands
+ *  to the appropriate job/queue/res files */
+
+struct job * stateLoadJob(const char * fileName) {
+	jobid_t jobid = 0;
+	char * temp;
+	char * data;
+	struct job * j;
+
+	data = readStateFile(fileName);
+
+	if (!data) {
+		error_die("Failed to read job file %s: %s\n", fileName, strerror(errno));
 	}
 
-	if (j->queue == NULL) {
-		error_die("Error loading job %d from file - No queue specified", j->jobid);
+	temp = strrchr(fileName, '/');
+
+	if (temp == NULL) {
+		error_die("Failed to determine jobid from filename %s", fileName);
 	}
 
-	if (j->state == 0)
-		j->state = JERS_JOB_PENDING;
+	jobid = atoi(temp + 1); // + 1 to move past the '/'
 
-	free(line);
-	fclose(f);
+	j = parseJob(jobid, data, fileName);
+
+	free(data);
 
 	return j;
 }
 
+/* Parallel job loading - The jobs are parsed by a set of worker threads, each taking
+ * batches of the items to load. Parsing only reads the queue and resource tables,
+ * which are already loaded and not changed until the jobs are added. The parsed jobs
+ * are then added from the calling thread in one pass. */
+
+#define LOAD_BATCH 256
+
+typedef struct job *(*jobParser)(void *items, size_t i, buff_t *scratch);
+
+struct loadWorker {
+	pthread_t thread;
+	struct jobLoad *load;
+	buff_t scratch;
+};
+
+struct jobLoad {
+	void *items;
+	size_t count;
+	size_t next;			// Next item to be taken by a worker
+	jobParser parse;
+	struct job **jobs;
+};
+
+static void *loadWorkerMain(void *arg) {
+	struct loadWorker *w = arg;
+	struct jobLoad *load = w->load;
+	size_t start, i;
+
+	while ((start = __atomic_fetch_add(&load->next, LOAD_BATCH, __ATOMIC_RELAXED)) < load->count) {
+		size_t end = start + LOAD_BATCH < load->count ? start + LOAD_BATCH : load->count;
+
+		for (i = start; i < end; i++)
+			load->jobs[i] = load->parse(load->items, i, &w->scratch);
+	}
+
+	return NULL;
+}
+
+static int loadThreadCount(size_t count) {
+	size_t threads = loadThreads();
+
+	/* No point starting threads that won't get a batch */
+	if (threads > (count + LOAD_BATCH - 1) / LOAD_BATCH)
+		threads = (count + LOAD_BATCH - 1) / LOAD_BATCH;
+
+	return threads > 1 ? threads : 1;
+}
+
+/* Parse and add 'count' jobs, reporting the time taken by each phase */
+static void loadJobs(void *items, size_t count, jobParser parse) {
+	struct loadWorker workers[MAX_LOAD_THREADS];
+	struct jobLoad load = {0};
+	int threads = loadThreadCount(count);
+	int64_t start = getTimeMS(), parsed;
+	size_t i;
+	int t;
+
+	load.items = items;
+	load.count = count;
+	load.parse = parse;
+	load.jobs = malloc(sizeof(struct job *) * (count + 1));
+
+	if (load.jobs == NULL)
+		error_die("Failed to allocate memory for loading %ld jobs: %s", count, strerror(errno));
+
+	for (t = 0; t < threads; t++) {
+		workers[t].load = &load;
+		buffNew(&workers[t].scratch, 0);
+	}
+
+	/* This thread works through the jobs as well */
+	for (t = 1; t < threads; t++) {
+		int rc = pthread_create(&workers[t].thread, NULL, loadWorkerMain, &workers[t]);
+
+		if (rc != 0)
+			error_die("Failed to create load thread: %s", strerror(rc));
+	}
+
+	loadWorkerMain(&workers[0]);
+
+	for (t = 1; t < threads; t++)
+		pthread_join(workers[t].thread, NULL);
+
+	for (t = 0; t < threads; t++)
+		buffFree(&workers[t].scratch);
+
+	parsed = getTimeMS();
+
+	for (i = 0; i < count; i++)
+		addJob(load.jobs[i], 0);
+
+	free(load.jobs);
+
+	print_msg(JERS_LOG_INFO, "Loaded %ld jobs. Parsed in %ldms using %d threads, added in %ldms",
+		count, parsed - start, threads, getTimeMS() - parsed);
+}
+
+static struct job *parseJobFile(void *items, size_t i, buff_t *scratch) {
+	UNUSED(scratch);
+	return stateLoadJob(((char **)items)[i]);
+}
+
 int stateLoadJobs(void) {
 	int rc;
-	size_t i;
 	char pattern[PATH_MAX];
 	glob_t jobFiles;
+	int64_t start = getTimeMS();
 
 #ifdef USE_SYSTEMD
 	sd_notify(0, "STATUS=Loading jobs...");
@@ -1472,32 +3354,25 @@ int stateLoadJobs(void) {
 		error_die("Failed to glob() job files from %s : %s\n", pattern, strerror(errno));
 	}
 
-	print_msg(JERS_LOG_INFO, "Loading %ld jobs from disk", jobFiles.gl_pathc);
-
-	for (i = 0; i < jobFiles.gl_pathc; i++) {
-		struct job * j = stateLoadJob(jobFiles.gl_pathv[i]);
-		addJob(j, 0);
-	}
+	print_msg(JERS_LOG_INFO, "Loading %ld jobs from disk. Found in %ldms", jobFiles.gl_pathc, getTimeMS() - start);
 
-	print_msg(JERS_LOG_INFO, "Loaded %ld jobs", jobFiles.gl_pathc);
+	loadJobs(jobFiles.gl_pathv, jobFiles.gl_pathc, parseJobFile);
 
 	globfree(&jobFiles);
 	return 0;
 }
 
 struct queue * stateLoadQueue(const char * fileName) {
-	FILE * f;
 	char * name = NULL;
 	char * ext;
+	char * data;
 	struct queue * q;
-	char * line = NULL;
-	size_t lineSize = 0;
 	char * fileNameCpy = strdup(fileName);
 
-	f = fopen(fileName, "r");
+	data = readStateFile(fileName);
 
-	if (!f) {
-		error_die("stateLoadQueue: Failed to open queue file %s : %s", fileName, strerror(errno));
+	if (!data) {
+		error_die("stateLoadQueue: Failed to read queue file %s : %s", fileName, strerror(errno));
 	}
 
 	/* Derive the name from the filename */
@@ -1516,58 +3391,9 @@ struct queue * stateLoadQueue(const char * fileName) {
 
 	*ext = 0;
 
-	q = calloc(sizeof(struct queue), 1);
-	q->name = strdup(name);
-	q->job_limit = JERS_QUEUE_DEFAULT_LIMIT;
-	q->priority = JERS_QUEUE_DEFAULT_PRIORITY;
-	q->state = JERS_QUEUE_DEFAULT_STATE;
-	q->obj.type = JERS_OBJECT_QUEUE;
-	q->nice = UNSET_32;
-
-	/* Read the contents and get the details */
-	ssize_t len;
-	while((len = getline(&line, &lineSize, f)) != -1) {
-		char * key = NULL, *value = NULL;
-		int index;
-
-		if (line[len - 1] == '\n')
-			line[len - 1] = '\0';
-
-		if (loadKeyValue(line, &key, &value, &index))
-			error_die("stateLoadQueue: Error parsing queue file: %s\n", fileName);
-
-		if (!key || !value)
-			continue;
-
-		if (strcmp(key, "DESC") == 0) {
-			q->desc = strdup(value);
-		} else if (strcmp(key, "JOBLIMIT") == 0) {
-			q->job_limit = atoi(value);
-		} else if (strcmp(key, "PRIORITY") == 0) {
-			q->priority = atoi(value);
-		} else if (strcmp(key, "DEFAULT") == 0) {
-			q->def = atoi(value);
-		} else if (strcmp(key, "HOST") == 0) {
-			q->host = strdup(value);
-		} else if (strcmp(key, "REVISION") == 0) {
-			strtoint64(value, &q->obj.revision);
-		} else if (strcmp(key, "NICE") == 0) {
-			q->nice = atoi(value);
-		} else {
-			print_msg(JERS_LOG_WARNING, "stateLoadQueue: skipping unknown config '%s' for queue %s\n", key, name);
-		}
-	}
-
-	if (len == -1 && feof(f) == 0)
-		error_die("Error reading queue file %s: %s\n", fileName, strerror(errno));
-
-	fclose(f);
-	free(line);
-
-	if (q->host == NULL) {
-		error_die("Error loading queue %s from disk. Expected to find HOST key in %s", q->name, fileName);
-	}
+	q = parseQueue(name, data, fileName);
 
+	free(data);
 	free(fileNameCpy);
 
 	return q;
@@ -1580,6 +3406,7 @@ int stateLoadQueues(void) {
 	size_t i;
 	char pattern[PATH_MAX];
 	glob_t qFiles;
+	int64_t start = getTimeMS();
 
 #ifdef USE_SYSTEMD
 	sd_notify(0, "STATUS=Loading queues...");
@@ -1610,25 +3437,23 @@ int stateLoadQueues(void) {
 			error_die("Failed to add queue '%s'", q->name);
 	}
 
-	print_msg(JERS_LOG_INFO, "Loaded %ld queues from disk", qFiles.gl_pathc);
+	print_msg(JERS_LOG_INFO, "Loaded %ld queues from disk in %ldms", qFiles.gl_pathc, getTimeMS() - start);
 
 	globfree(&qFiles);
 	return 0;
 }
 
 struct resource * stateLoadResource(const char * file_name) {
-	FILE * f;
 	char * name = NULL;
 	char * ext;
+	char * data;
 	struct resource * r;
-	char * line = NULL;
-	size_t lineSize = 0;
 	char * file_name_cpy = strdup(file_name);
 
-	f = fopen(file_name, "r");
+	data = readStateFile(file_name);
 
-	if (!f) {
-		error_die("stateLoadRes: Failed to open resource file %s : %s", file_name, strerror(errno));
+	if (!data) {
+		error_die("stateLoadRes: Failed to read resource file %s : %s", file_name, strerror(errno));
 	}
 
 	/* Derive the name from the filename */
@@ -1647,41 +3472,9 @@ struct resource * stateLoadResource(const char * file_name) {
 
 	*ext = 0;
 
-	r = calloc(sizeof(struct resource), 1);
-	r->name = strdup(name);
-	r->obj.type = JERS_OBJECT_RESOURCE;
-
-	/* Read the contents and get the details */
-	ssize_t len;
-	while((len = getline(&line, &lineSize, f)) != -1) {
-
-		char * key = NULL, *value = NULL;
-		int index;
-
-		if (line[len - 1] == '\n')
-			line[len - 1] = '\0';
-
-		if (loadKeyValue(line, &key, &value, &index))
-			error_die("stateLoadRes: Error parsing resource file: %s\n", file_name);
-
-		if (!key || !value)
-			continue;
-
-		if (strcmp(key, "COUNT") == 0) {
-			r->count = atoi(value);
-		} else if (strcmp(key, "REVISION") == 0) {
-			strtoint64(value, &r->obj.revision);
-		} else {
-			print_msg(JERS_LOG_WARNING, "stateLoadRes: skipping unknown config '%s' for resource %s\n", key, name);
-		}
-	}
-
-	if (len == -1 && feof(f) == 0) {
-		error_die("Error reading resource file %s: %s\n", file_name, strerror(errno));
-	}
+	r = parseResource(name, data, file_name);
 
-	fclose(f);
-	free(line);
+	free(data);
 	free(file_name_cpy);
 
 	return r;
@@ -1692,6 +3485,7 @@ int stateLoadResources(void) {
 	size_t i;
 	char pattern[PATH_MAX];
 	glob_t resFiles;
+	int64_t start = getTimeMS();
 
 #ifdef USE_SYSTEMD
 	sd_notify(0, "STATUS=Loading resources...");
@@ -1721,12 +3515,229 @@ int stateLoadResources(void) {
 			error_die("Failed to add resource %s", r->name);
 	}
 
-	print_msg(JERS_LOG_INFO, "Loaded %ld resources.", resFiles.gl_pathc);
+	print_msg(JERS_LOG_INFO, "Loaded %ld resources in %ldms", resFiles.gl_pathc, getTimeMS() - start);
 
 	globfree(&resFiles);
 	return 0;
 }
 
+/* The objects are parsed in place, so need a copy outside the mapping */
+static void copySnapshotObject(const struct snapshotObject *o, buff_t *b, char **key, char **value) {
+	buffClear(b, 0);
+	buffAdd(b, o->key, o->key_len);
+	buffAdd(b, "", 1);
+	buffAdd(b, o->data, o->data_len);
+	buffAdd(b, "", 1);
+
+	*key = b->data;
+	*value = b->data + o->key_len + 1;
+}
+
+static struct job *parseSnapshotJob(void *items, size_t i, buff_t *scratch) {
+	char *key, *value;
+
+	copySnapshotObject((struct snapshotObject *)items + i, scratch, &key, &value);
+
+	return parseJob(atoi(key), value, "snapshot");
+}
+
+/* Load the queues, resources and jobs from the snapshot, recording the journal position
+ * it was taken at for stateReplayJournal(). Returns 1 if there isn't a snapshot.
+ * The records are all read and checked first, with the jobs then parsed in parallel */
+
+int stateLoadSnapshot(void) {
+	char path[PATH_MAX];
+	struct snapshotReader r;
+	struct snapshotObject o;
+	struct item_list jobs;
+	buff_t scratch;
+	int64_t queues = 0, resources = 0;
+	int64_t start = getTimeMS();
+	int rc;
+
+#ifdef USE_SYSTEMD
+	sd_notify(0, "STATUS=Loading snapshot...");
+#endif
+
+	sprintf(path, "%s/snapshot", server.state_dir);
+
+	if (snapshotReaderOpen(&r, path) != 0) {
+		if (errno == ENOENT) {
+			print_msg(JERS_LOG_WARNING, "No snapshot found at %s - Loading from the state directories", path);
+			return 1;
+		}
+
+		error_die("Failed to open snapshot %s: %s", path, strerror(errno));
+	}
+
+	print_msg(JERS_LOG_INFO, "Loading snapshot %s", path);
+
+	listNew(&jobs, sizeof(struct snapshotObject));
+	buffNew(&scratch, 0);
+
+	while ((rc = snapshotReaderNext(&r, &o)) == SNAPSHOT_OBJECT) {
+		char *key, *value;
+
+		switch (o.type) {
+			case SNAPSHOT_RESOURCE: {
+				copySnapshotObject(&o, &scratch, &key, &value);
+				struct resource *res = parseResource(key, value, path);
+
+				if (addRes(res, 0))
+					error_die("Failed to add resource %s", res->name);
+
+				resources++;
+				break;
+			}
+
+			case SNAPSHOT_QUEUE: {
+				copySnapshotObject(&o, &scratch, &key, &value);
+				struct queue *q = parseQueue(key, value, path);
+
+				if (addQueue(q, 0))
+					error_die("Failed to add queue '%s'", q->name);
+
+				queues++;
+				break;
+			}
+
+			case SNAPSHOT_JOB:
+				listAdd(&jobs, &o);
+				break;
+
+			default:
+				error_die("Unknown object type %u at offset %ld in snapshot %s", o.type, r.offset, path);
+		}
+	}
+
+	if (rc == SNAPSHOT_CORRUPT)
+		error_die("Snapshot %s is damaged or incomplete - Invalid record at offset %ld", path, r.offset);
+
+	buffFree(&scratch);
+
+	print_msg(JERS_LOG_INFO, "Read snapshot in %ldms. Loaded %ld queues and %ld resources, %ld jobs to load",
+		getTimeMS() - start, queues, resources, jobs.count);
+
+	loadJobs(jobs.items, jobs.count, parseSnapshotJob);
+	listFree(&jobs);
+
+	server.start_jobid = r.header.start_jobid;
+
+	server.recovery.snapshot = 1;
+	strcpy(server.recovery.snapshot_journal, r.header.journal);
+	server.recovery.snapshot_offset = r.header.journal_offset;
+	server.recovery.snapshot_record = r.header.journal_record;
+	server.recovery.snapshot_inode = r.header.journal_inode;
+
+	print_msg(JERS_LOG_INFO, "Loaded snapshot in %ldms. Taken at journal.%s offset %ld",
+		getTimeMS() - start, r.header.journal, r.header.journal_offset);
+
+	snapshotReaderClose(&r);
+
+	return 0;
+}
+
+/* Load the latest version of each queue, resource and job from the object store,
+ * recording the journal position of its last commit for stateReplayJournal().
+ * Returns 1 if nothing has been saved to the store yet, in which case the first
+ * save writes out every object */
+
+int stateLoadObjectStore(void) {
+	char dir[PATH_MAX];
+	struct objstoreIndex idx;
+	struct objstoreEntry *e, *tmp;
+	struct item_list jobs;
+	buff_t scratch;
+	int64_t queues = 0, resources = 0;
+	int64_t start = getTimeMS();
+
+#ifdef USE_SYSTEMD
+	sd_notify(0, "STATUS=Loading object store...");
+#endif
+
+	sprintf(dir, "%s/%s", server.state_dir, OBJSTORE_DIR);
+
+	if (objstoreLoad(&idx, dir, 0) != 0)
+		error_die("Failed to load object store %s: %s", dir, strerror(errno));
+
+	/* Anything after the last commit is dropped here, before it's appended to */
+	if (objstoreOpen(&objectStore, dir, &idx) != 0)
+		error_die("Failed to open object store %s: %s", dir, strerror(errno));
+
+	if (!idx.committed) {
+		print_msg(JERS_LOG_WARNING, "No saved objects in %s - Loading from the state directories", dir);
+		objstoreIndexFree(&idx);
+		objectStoreFull = 1;
+		return 1;
+	}
+
+	if (idx.uncommitted)
+		print_msg(JERS_LOG_WARNING, "Ignored %ld bytes from incomplete saves in %s", idx.uncommitted, dir);
+
+	listNew(&jobs, sizeof(struct snapshotObject));
+	buffNew(&scratch, 0);
+
+	HASH_ITER(hh, idx.objects[SNAPSHOT_RESOURCE], e, tmp) {
+		char *key, *value;
+
+		if (e->deleted)
+			continue;
+
+		copySnapshotObject(&e->o, &scratch, &key, &value);
+		struct resource *res = parseResource(key, value, dir);
+
+		if (addRes(res, 0))
+			error_die("Failed to add resource %s", res->name);
+
+		resources++;
+	}
+
+	HASH_ITER(hh, idx.objects[SNAPSHOT_QUEUE], e, tmp) {
+		char *key, *value;
+
+		if (e->deleted)
+			continue;
+
+		copySnapshotObject(&e->o, &scratch, &key, &value);
+		struct queue *q = parseQueue(key, value, dir);
+
+		if (addQueue(q, 0))
+			error_die("Failed to add queue '%s'", q->name);
+
+		queues++;
+	}
+
+	HASH_ITER(hh, idx.objects[SNAPSHOT_JOB], e, tmp) {
+		if (!e->deleted)
+			listAdd(&jobs, &e->o);
+	}
+
+	buffFree(&scratch);
+
+	print_msg(JERS_LOG_INFO, "Read object store in %ldms. %ld records in %ld segments. Loaded %ld queues and %ld resources, %ld jobs to load",
+		getTimeMS() - start, idx.records, idx.segment_count, queues, resources, jobs.count);
+
+	loadJobs(jobs.items, jobs.count, parseSnapshotJob);
+	listFree(&jobs);
+
+	server.start_jobid = idx.commit.start_jobid;
+
+	server.recovery.snapshot = 1;
+	strcpy(server.recovery.snapshot_journal, idx.commit.journal);
+	server.recovery.snapshot_offset = idx.commit.journal_offset;
+	server.recovery.snapshot_record = idx.commit.journal_record;
+	server.recovery.snapshot_inode = idx.commit.journal_inode;
+
+	objectStoreLive = idx.live;
+
+	print_msg(JERS_LOG_INFO, "Loaded object store in %ldms. Saved at journal.%s offset %ld",
+		getTimeMS() - start, idx.commit.journal, idx.commit.journal_offset);
+
+	objstoreIndexFree(&idx);
+
+	return 0;
+}
+
 static inline void decrement_state(struct job *j) {
 	switch (j->state) {
 		case JERS_JOB_RUNNING:
@@ -1737,6 +3748,7 @@ static inline void decrement_state(struct job *j) {
 		case JERS_JOB_PENDING:
 			server.stats.jobs.pending--;
 			j->queue->stats.pending--;
+			removeCandidate(j);
 			break;
 
 		case JERS_JOB_DEFERRED:
@@ -1783,19 +3795,17 @@ static inline void increment_state(struct job *j) {
 		case JERS_JOB_PENDING:
 			server.stats.jobs.pending++;
 			j->queue->stats.pending++;
-			server.candidate_recalc = 1;
+			addCandidate(j);
 			break;
 
 		case JERS_JOB_DEFERRED:
 			server.stats.jobs.deferred++;
 			j->queue->stats.deferred++;
-			server.candidate_recalc = 1;
 			break;
 
 		case JERS_JOB_HOLDING:
 			server.stats.jobs.holding++;
 			j->queue->stats.holding++;
-			server.candidate_recalc = 1;
 			break;
 
 		case JERS_JOB_COMPLETED:
@@ -1843,22 +3853,16 @@ void changeJobState(struct job *j, int new_state, struct queue *new_queue, int d
 void updateObject(jers_object * obj, int dirty) {
 	obj->revision++;
 
-	if (dirty) {
-		obj->dirty = 1;
-
-		switch(obj->type) {
-			case JERS_OBJECT_JOB: server.dirty_jobs = 1; break;
-			case JERS_OBJECT_QUEUE: server.dirty_queues = 1; break;
-			case JERS_OBJECT_RESOURCE: server.dirty_resources = 1; break;
-		}
-	}
+	if (dirty)
+		markDirty(obj);
 }
 
 void flush_journal(int force) {
-	if (!force && !server.flush.dirty)
+	if ((!force && !server.flush.dirty) || server.journal.fd < 0)
 		return;
 
-	fdatasync(server.journal.fd);
+	/* Flushed by the syncer thread, so we don't wait on the disk */
+	syncerRequest(server.journal.fd, 0);
 	server.flush.lastflush = time(NULL);
 	server.flush.dirty = 0;
 }
@@ -0,0 +1,249 @@
+/* Copyright (c) 2018 Evan Wyatt
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ *    be used to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include "server.h"
+#include "syncer.h"
+
+/* Journal syncer thread.
+ *
+ * The main thread writes the journal records itself, but hands the fdatasync() off
+ * to this thread so the event loop never waits on the disk. Requests are processed
+ * in order, with consecutive requests for the same file sharing a single flush.
+ *
+ * Each request is given a sequence number. Once a request has been flushed, the
+ * main thread is woken via an eventfd and told the last sequence number completed,
+ * which is used to release the responses held for group commit.
+ *
+ * A failed flush is fatal. The kernel may have already dropped the pages it failed to
+ * write, so a later flush can't be trusted to have saved them. Stopping means the held
+ * responses are never sent, and the restart replays only what actually reached the disk */
+
+static pthread_t syncThread;
+static pthread_mutex_t syncLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t syncCond = PTHREAD_COND_INITIALIZER;
+
+static struct syncRequest *syncHead = NULL;
+static struct syncRequest *syncTail = NULL;
+static uint64_t syncCompleted = 0;
+static int syncError = 0;		// errno of the first failed flush
+static int syncShutdownFlag = 0;
+static int syncRunning = 0;
+
+static uint64_t syncNextSeq = 0;
+static struct connectionType syncNotify;
+
+/* Returns 0, or the errno if the flush failed */
+static int syncFile(struct syncRequest *req) {
+	int status = fdatasync(req->fd) != 0 ? errno : 0;
+
+	if (req->close)
+		close(req->fd);
+
+	return status;
+}
+
+static void *syncerMain(void *arg) {
+	UNUSED(arg);
+
+	pthread_mutex_lock(&syncLock);
+
+	while (1) {
+		struct syncRequest *req;
+		uint64_t done = 0;
+		int error = 0;
+
+		while (syncHead == NULL && !syncShutdownFlag)
+			pthread_cond_wait(&syncCond, &syncLock);
+
+		/* Finish off anything queued before shutting down */
+		if (syncHead == NULL)
+			break;
+
+		req = syncHead;
+		syncHead = syncTail = NULL;
+		pthread_mutex_unlock(&syncLock);
+
+		while (req) {
+			struct syncRequest *next = req->next;
+
+			/* The next request will flush this file anyway */
+			if (next == NULL || next->fd != req->fd || req->close) {
+				int status = syncFile(req);
+
+				if (status && error == 0)
+					error = status;
+			}
+
+			done = req->seq;
+			free(req);
+			req = next;
+		}
+
+		pthread_mutex_lock(&syncLock);
+		syncCompleted = done;
+
+		if (error && syncError == 0)
+			syncError = error;
+
+		pthread_mutex_unlock(&syncLock);
+
+		uint64_t one = 1;
+
+		if (write(syncNotify.socket, &one, sizeof(one)) != sizeof(one) && errno != EAGAIN)
+			print_msg(JERS_LOG_WARNING, "Failed to signal journal sync completion: %s", strerror(errno));
+
+		pthread_mutex_lock(&syncLock);
+	}
+
+	pthread_mutex_unlock(&syncLock);
+
+	return NULL;
+}
+
+int syncerInit(void) {
+	sigset_t all, old;
+
+	syncNotify.type = SYNC_NOTIFY;
+	syncNotify.socket = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	syncNotify.event_fd = server.event_fd;
+	syncNotify.ptr = NULL;
+
+	if (syncNotify.socket < 0) {
+		print_msg(JERS_LOG_WARNING, "Failed to create journal syncer eventfd: %s", strerror(errno));
+		return 1;
+	}
+
+	if (pollSetReadable(&syncNotify) != 0) {
+		print_msg(JERS_LOG_WARNING, "Failed to add journal syncer to event polling: %s", strerror(errno));
+		return 1;
+	}
+
+	/* Signals are left to the main thread */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+
+	if (pthread_create(&syncThread, NULL, syncerMain, NULL) != 0) {
+		pthread_sigmask(SIG_SETMASK, &old, NULL);
+		print_msg(JERS_LOG_WARNING, "Failed to start journal syncer thread");
+		return 1;
+	}
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	syncRunning = 1;
+
+	return 0;
+}
+
+/* Flush everything still queued and stop the syncer thread */
+void syncerShutdown(void) {
+	if (!syncRunning)
+		return;
+
+	pthread_mutex_lock(&syncLock);
+	syncShutdownFlag = 1;
+	pthread_cond_signal(&syncCond);
+	pthread_mutex_unlock(&syncLock);
+
+	pthread_join(syncThread, NULL);
+	syncRunning = 0;
+
+	pollRemoveSocket(&syncNotify);
+	close(syncNotify.socket);
+}
+
+/* Queue the file to be flushed to disk, optionally closing it afterwards.
+ * Returns the sequence number that will be reported once it's done.
+ * Before the syncer is started (or after it's stopped) the flush is done directly */
+uint64_t syncerRequest(int fd, int close_fd) {
+	struct syncRequest *req;
+
+	syncNextSeq++;
+
+	if (!syncRunning) {
+		struct syncRequest direct = {fd, close_fd, syncNextSeq, NULL};
+		int status = syncFile(&direct);
+
+		if (status)
+			error_die("Failed to flush journal to disk: %s", strerror(status));
+
+		journalSynced(syncNextSeq);
+		return syncNextSeq;
+	}
+
+	req = malloc(sizeof(struct syncRequest));
+
+	if (req == NULL)
+		error_die("Failed to allocate memory for journal sync request: %s", strerror(errno));
+
+	req->fd = fd;
+	req->close = close_fd;
+	req->seq = syncNextSeq;
+	req->next = NULL;
+
+	pthread_mutex_lock(&syncLock);
+
+	if (syncTail)
+		syncTail->next = req;
+	else
+		syncHead = req;
+
+	syncTail = req;
+
+	pthread_cond_signal(&syncCond);
+	pthread_mutex_unlock(&syncLock);
+
+	return syncNextSeq;
+}
+
+void syncerHandleNotify(struct connectionType *connection) {
+	uint64_t count, done;
+	int error;
+
+	if (read(connection->socket, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		print_msg(JERS_LOG_WARNING, "Failed to read journal sync notification: %s", strerror(errno));
+
+	pthread_mutex_lock(&syncLock);
+	done = syncCompleted;
+	error = syncError;
+	pthread_mutex_unlock(&syncLock);
+
+	/* Don't release the output waiting on a flush that failed */
+	if (error)
+		error_die("Failed to flush journal to disk: %s", strerror(error));
+
+	journalSynced(done);
+}
@@ -0,0 +1,357 @@
+/* Copyright (c) 2018 Evan Wyatt
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ *    be used to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+#include "server.h"
+#include "uring.h"
+
+/* A minimal io_uring backend, used to batch the socket reads and writes
+ * from each event loop iteration into a single system call, and to submit
+ * journal writes together with their fdatasync.
+ *
+ * Epoll is still used to find out which sockets are ready. Everything submitted
+ * is waited for before returning, so buffers never need to outlive the call
+ * and an operation on a socket that isn't ready just fails with EAGAIN. */
+
+#ifdef USE_IO_URING
+
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+static struct {
+	int fd;
+	unsigned int entries;
+	unsigned int queued;     // SQEs filled in, but not yet submitted
+
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	struct io_uring_sqe *sqes;
+
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *sq_ring;
+	size_t sq_ring_size;
+	void *cq_ring;
+	size_t cq_ring_size;
+	size_t sqes_size;
+} ring = {.fd = -1};
+
+static int uringEnter(unsigned int to_submit, unsigned int min_complete) {
+	return syscall(__NR_io_uring_enter, ring.fd, to_submit, min_complete, IORING_ENTER_GETEVENTS, NULL, 0);
+}
+
+int uringInit(unsigned int entries) {
+	struct io_uring_params p;
+
+	memset(&p, 0, sizeof(p));
+
+	ring.fd = syscall(__NR_io_uring_setup, entries, &p);
+
+	if (ring.fd < 0)
+		return 1;
+
+	/* Writing at the current file position needs IORING_FEAT_RW_CUR_POS */
+	if (!(p.features & IORING_FEAT_RW_CUR_POS)) {
+		close(ring.fd);
+		ring.fd = -1;
+		errno = ENOTSUP;
+		return 1;
+	}
+
+	ring.entries = p.sq_entries;
+	ring.sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	ring.cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring.cq_ring_size > ring.sq_ring_size)
+			ring.sq_ring_size = ring.cq_ring_size;
+
+		ring.cq_ring_size = ring.sq_ring_size;
+	}
+
+	ring.sq_ring = mmap(NULL, ring.sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+
+	if (ring.sq_ring == MAP_FAILED)
+		goto failed;
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		ring.cq_ring = ring.sq_ring;
+	} else {
+		ring.cq_ring = mmap(NULL, ring.cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+
+		if (ring.cq_ring == MAP_FAILED)
+			goto failed;
+	}
+
+	ring.sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring.sqes = mmap(NULL, ring.sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+
+	if (ring.sqes == MAP_FAILED)
+		goto failed;
+
+	ring.sq_head = (unsigned int *)((char *)ring.sq_ring + p.sq_off.head);
+	ring.sq_tail = (unsigned int *)((char *)ring.sq_ring + p.sq_off.tail);
+	ring.sq_mask = (unsigned int *)((char *)ring.sq_ring + p.sq_off.ring_mask);
+	ring.sq_array = (unsigned int *)((char *)ring.sq_ring + p.sq_off.array);
+
+	ring.cq_head = (unsigned int *)((char *)ring.cq_ring + p.cq_off.head);
+	ring.cq_tail = (unsigned int *)((char *)ring.cq_ring + p.cq_off.tail);
+	ring.cq_mask = (unsigned int *)((char *)ring.cq_ring + p.cq_off.ring_mask);
+	ring.cqes = (struct io_uring_cqe *)((char *)ring.cq_ring + p.cq_off.cqes);
+
+	ring.queued = 0;
+
+	return 0;
+
+failed:
+	uringFree();
+	return 1;
+}
+
+void uringFree(void) {
+	if (ring.sqes && ring.sqes != MAP_FAILED)
+		munmap(ring.sqes, ring.sqes_size);
+
+	if (ring.cq_ring && ring.cq_ring != MAP_FAILED && ring.cq_ring != ring.sq_ring)
+		munmap(ring.cq_ring, ring.cq_ring_size);
+
+	if (ring.sq_ring && ring.sq_ring != MAP_FAILED)
+		munmap(ring.sq_ring, ring.sq_ring_size);
+
+	if (ring.fd >= 0)
+		close(ring.fd);
+
+	memset(&ring, 0, sizeof(ring));
+	ring.fd = -1;
+}
+
+int uringActive(void) {
+	return ring.fd >= 0;
+}
+
+static struct io_uring_sqe *uringGetSqe(void) {
+	unsigned int head = __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+	unsigned int tail = *ring.sq_tail + ring.queued;
+
+	if (tail - head >= ring.entries)
+		return NULL;
+
+	unsigned int index = tail & *ring.sq_mask;
+	struct io_uring_sqe *sqe = &ring.sqes[index];
+
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	ring.sq_array[index] = index;
+	ring.queued++;
+
+	return sqe;
+}
+
+static void uringPrepRW(struct io_uring_sqe *sqe, int op, int fd, const void *buf, size_t len, off_t offset, void *data) {
+	sqe->opcode = op;
+	sqe->fd = fd;
+	sqe->addr = (unsigned long)buf;
+	sqe->len = len;
+	sqe->off = offset;
+	sqe->user_data = (unsigned long)data;
+}
+
+int uringQueueRecv(int fd, void *buf, size_t len, void *data) {
+	struct io_uring_sqe *sqe = uringGetSqe();
+
+	if (sqe == NULL)
+		return 1;
+
+	uringPrepRW(sqe, IORING_OP_RECV, fd, buf, len, 0, data);
+	sqe->msg_flags = MSG_DONTWAIT;
+
+	return 0;
+}
+
+int uringQueueSend(int fd, const void *buf, size_t len, void *data) {
+	struct io_uring_sqe *sqe = uringGetSqe();
+
+	if (sqe == NULL)
+		return 1;
+
+	uringPrepRW(sqe, IORING_OP_SEND, fd, buf, len, 0, data);
+	sqe->msg_flags = MSG_DONTWAIT | MSG_NOSIGNAL;
+
+	return 0;
+}
+
+int uringSubmitWait(void (*complete)(void *data, int res)) {
+	unsigned int outstanding = ring.queued;
+
+	if (outstanding == 0)
+		return 0;
+
+	__atomic_store_n(ring.sq_tail, *ring.sq_tail + ring.queued, __ATOMIC_RELEASE);
+	ring.queued = 0;
+
+	unsigned int to_submit = outstanding;
+
+	while (outstanding) {
+		int ret = uringEnter(to_submit, outstanding);
+
+		if (ret < 0) {
+			if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+				continue;
+
+			error_die("io_uring_enter failed: %s", strerror(errno));
+		}
+
+		to_submit -= ret;
+
+		unsigned int head = *ring.cq_head;
+		unsigned int tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+
+		while (head != tail) {
+			struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+
+			if (complete)
+				complete((void *)(unsigned long)cqe->user_data, cqe->res);
+
+			head++;
+			outstanding--;
+		}
+
+		__atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+	}
+
+	return 0;
+}
+
+static void storeResult(void *data, int res) {
+	*(int *)data = res;
+}
+
+ssize_t uringWriteFile(int fd, const void *buf, size_t len, int datasync) {
+	int write_res = 0, sync_res = 0;
+	struct io_uring_sqe *sqe;
+
+	/* Only the journal operations can be submitted here, as the completions of any
+	 * socket operations would need their own callback. Socket operations are queued and
+	 * submitted within a single step of the event loop, so this shouldn't happen */
+	if (ring.queued) {
+		ssize_t written = write(fd, buf, len);
+
+		if (written != -1 && datasync)
+			fdatasync(fd);
+
+		return written;
+	}
+
+	sqe = uringGetSqe();
+	uringPrepRW(sqe, IORING_OP_WRITE, fd, buf, len, (off_t)-1, &write_res);
+
+	if (datasync) {
+		sqe->flags |= IOSQE_IO_LINK;
+
+		sqe = uringGetSqe();
+		uringPrepRW(sqe, IORING_OP_FSYNC, fd, NULL, 0, 0, &sync_res);
+		sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+	}
+
+	uringSubmitWait(storeResult);
+
+	if (write_res < 0) {
+		errno = -write_res;
+		return -1;
+	}
+
+	/* A short write cancels the linked sync, so do it here */
+	if (datasync && sync_res < 0) {
+		if (sync_res != -ECANCELED)
+			print_msg(JERS_LOG_WARNING, "io_uring fdatasync on journal failed: %s", strerror(-sync_res));
+
+		fdatasync(fd);
+	}
+
+	return write_res;
+}
+
+#else
+
+/* Built without io_uring support - Everything falls back to the epoll/syscall paths */
+
+int uringInit(unsigned int entries) {
+	UNUSED(entries);
+	errno = ENOTSUP;
+	return 1;
+}
+
+void uringFree(void) {
+}
+
+int uringActive(void) {
+	return 0;
+}
+
+int uringQueueRecv(int fd, void *buf, size_t len, void *data) {
+	UNUSED(fd);
+	UNUSED(buf);
+	UNUSED(len);
+	UNUSED(data);
+	return 1;
+}
+
+int uringQueueSend(int fd, const void *buf, size_t len, void *data) {
+	UNUSED(fd);
+	UNUSED(buf);
+	UNUSED(len);
+	UNUSED(data);
+	return 1;
+}
+
+int uringSubmitWait(void (*complete)(void *data, int res)) {
+	UNUSED(complete);
+	return 0;
+}
+
+ssize_t uringWriteFile(int fd, const void *buf, size_t len, int datasync) {
+	UNUSED(fd);
+	UNUSED(buf);
+	UNUSED(len);
+	UNUSED(datasync);
+	errno = ENOTSUP;
+	return -1;
+}
+
+#endif
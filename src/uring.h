@@ -0,0 +1,56 @@
+/* Copyright (c) 2018 Evan Wyatt
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ *    be used to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _uring_h
+#define _uring_h
+
+#include <sys/types.h>
+
+#define IO_BACKEND_EPOLL 0
+#define IO_BACKEND_URING 1
+
+int uringInit(unsigned int entries);
+void uringFree(void);
+int uringActive(void);
+
+/* Queue operations to be submitted together by uringSubmitWait().
+ * These return non-zero if the operation couldn't be queued, in which case the
+ * caller should perform it directly instead. Socket operations never block. */
+int uringQueueRecv(int fd, void *buf, size_t len, void *data);
+int uringQueueSend(int fd, const void *buf, size_t len, void *data);
+
+/* Submit everything queued in a single system call, waiting for them all to finish.
+ * complete() is called with the 'data' and result (bytes or -errno) of each operation */
+int uringSubmitWait(void (*complete)(void *data, int res));
+
+/* Write to a file at its current position, optionally followed by a linked fdatasync.
+ * Written without the ring if any socket operations are queued */
+ssize_t uringWriteFile(int fd, const void *buf, size_t len, int datasync);
+
+#endif
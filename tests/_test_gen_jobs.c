@@ -1,4 +1,4 @@
-/* This code is embedded it test_generateCandidatePool.c
+/* This code is embedded it test_candidateOrder.c
  * Jobs are compared by:
  *      - queue priority
  *      - job priority
@@ -14,6 +14,7 @@ j->state = JERS_JOB_PENDING;
 
 HASH_ADD_INT(server.jobTable, jobid, j);
 server.stats.jobs.pending++;
+addCandidate(j);
 
 j = calloc(1, sizeof (struct job));
 j->jobid = 10;
@@ -23,6 +24,7 @@ j->state = JERS_JOB_PENDING;
 
 HASH_ADD_INT(server.jobTable, jobid, j);
 server.stats.jobs.pending++;
+addCandidate(j);
 
 j = calloc(1, sizeof (struct job));
 j->jobid = 12;
@@ -32,6 +34,7 @@ j->state = JERS_JOB_PENDING;
 
 HASH_ADD_INT(server.jobTable, jobid, j);
 server.stats.jobs.pending++;
+addCandidate(j);
 
 j = calloc(1, sizeof (struct job));
 j->jobid = 32;
@@ -41,6 +44,7 @@ j->state = JERS_JOB_PENDING;
 
 HASH_ADD_INT(server.jobTable, jobid, j);
 server.stats.jobs.pending++;
+addCandidate(j);
 
 j = calloc(1, sizeof (struct job));
 j->jobid = 500;
@@ -50,6 +54,7 @@ j->state = JERS_JOB_PENDING;
 
 HASH_ADD_INT(server.jobTable, jobid, j);
 server.stats.jobs.pending++;
+addCandidate(j);
 
 j = calloc(1, sizeof (struct job));
 j->jobid = 1020;
@@ -59,6 +64,7 @@ j->state = JERS_JOB_PENDING;
 
 HASH_ADD_INT(server.jobTable, jobid, j);
 server.stats.jobs.pending++;
+addCandidate(j);
 
 /* Add some decoy jobs in there as well. (deleted and non pending) */
 j = calloc(1, sizeof (struct job));
@@ -70,6 +76,7 @@ j->state = JERS_JOB_PENDING;
 j->internal_state |= JERS_FLAG_DELETED;
 
 HASH_ADD_INT(server.jobTable, jobid, j);
+addCandidate(j);
 
 j = calloc(1, sizeof (struct job));
 j->jobid = 86;
@@ -3,6 +3,7 @@
 time_t __now = time(NULL);
 struct job * j;
 struct queue q = {.name = "test_queue"};
+initCandidates(&q);
 
 j = calloc(1, sizeof (struct job));
 j->jobid = 5;
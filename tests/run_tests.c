@@ -27,6 +27,9 @@ void test_jobs(void);
 void test_state(void);
 void test_sched(void);
 void test_list(void);
+void test_journal(void);
+void test_snapshot(void);
+void test_objstore(void);
 
 struct test_case {
 	const char *name;
@@ -45,6 +48,9 @@ struct test_case test_cases[] = {
 	{"State", test_state},
 	{"Sched", test_sched},
 	{"List", test_list},
+	{"Journal", test_journal},
+	{"Snapshot", test_snapshot},
+	{"Object store", test_objstore},
 };
 
 int main (int argc, char *argv[]) {
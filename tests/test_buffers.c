@@ -218,4 +218,60 @@ void test_buffers(void) {
 	buffRemove(&buff, BUFF_DEFAULT_SIZE, BUFF_DEFAULT_SIZE * 3);
 	TEST("buffRemove- with shrink", check_buffer(&buff, &expected));
 	free(largeBuffer);
-}
\ No newline at end of file
+
+	/* Removing from the front should only advance the start of the data */
+	data = "first\nsecond\nthird\n";
+	buffFree(&buff);
+	buffNew(&buff, 100);
+	buffAdd(&buff, data, strlen(data));
+	buffRemove(&buff, 6, 0);
+	buffRemove(&buff, 7, 0);
+	TEST("buffRemove - lazy", (buff.consumed != 13 || buff.size != 87 || buff.used != 6 || memcmp(buff.data, "third\n", 6)));
+
+	/* Adding more than the space left at the end reclaims the consumed space, without growing */
+	data = "0123456789012345678901234567890123456789012345678901234567890123456789012345678901234567890";
+	buffAdd(&buff, data, strlen(data));
+
+	expected.data = "third\n0123456789012345678901234567890123456789012345678901234567890123456789012345678901234567890";
+	expected.used = strlen(expected.data);
+	expected.size = 100;
+	TEST("buffRemove - reclaimed on add", (buff.consumed != 0 || buff.size != 100 || check_buffer(&buff, &expected)));
+
+	/* Once enough has been consumed, the remaining data is moved to the front */
+	size = BUFF_COMPACT_THRESHOLD + 10;
+	largeBuffer = malloc(size);
+	memset(largeBuffer, 'A', size);
+	memcpy(largeBuffer + BUFF_COMPACT_THRESHOLD, "remaining!", 10);
+
+	buffAdd(&buff, largeBuffer, size);
+	buffRemove(&buff, BUFF_COMPACT_THRESHOLD - 1, 0);
+	TEST("buffRemove - below compact threshold", (buff.consumed != BUFF_COMPACT_THRESHOLD - 1 || buff.used != 11));
+
+	buffRemove(&buff, 1, 0);
+	expected.data = "remaining!";
+	expected.used = 10;
+	expected.size = 10;
+	TEST("buffRemove - compacted", (buff.consumed != 0 || check_buffer(&buff, &expected)));
+	free(largeBuffer);
+
+	/* Removing everything resets to the start of the buffer */
+	data = "Hello World.";
+	buffFree(&buff);
+	buffNew(&buff, 100);
+	buffAdd(&buff, data, strlen(data));
+	buffRemove(&buff, 6, 0);
+	buffRemove(&buff, 6, 0);
+	TEST("buffRemove - all", (buff.consumed != 0 || buff.used != 0 || buff.size != 100));
+	buffFree(&buff);
+
+	/* Formatted output, including output larger than the buffer */
+	char long_desc[100];
+	memset(long_desc, 'A', sizeof(long_desc) - 1);
+	long_desc[sizeof(long_desc) - 1] = '\0';
+
+	buffNew(&buff, 16);
+	buffPrintf(&buff, "%s %d\n", "JOBLIMIT", 10);
+	buffPrintf(&buff, "DESC %s\n", long_desc);
+	TEST("buffPrintf", (buff.used != 12 + 5 + 99 + 1 || memcmp(buff.data, "JOBLIMIT 10\nDESC ", 17) || memcmp(buff.data + 17, long_desc, 99) || buff.data[116] != '\n'));
+	buffFree(&buff);
+}
@@ -0,0 +1,243 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <jers_tests.h>
+#include <journal.h>
+
+static const char *messages[] = {
+	"{\"JOB_ADD\":{\"VERSION\":1,\"FIELDS\":{\"JOBNAME\":\"one\"}}}",
+	"{\"JOB_MOD\":{\"VERSION\":1,\"FIELDS\":{\"JOBID\":1}}}",
+	"",
+};
+
+static const char *commands[] = {"JOB_ADD", "JOB_MOD", "REPLAY_COMPLETE"};
+
+/* Write a journal in 'format' with the test records to a temporary file */
+static int write_journal(char *path, int format, int end_marker, size_t padding) {
+	buff_t b;
+	int fd;
+
+	strcpy(path, "/tmp/jers_test_journal.XXXXXX");
+
+	if ((fd = mkstemp(path)) < 0)
+		return 1;
+
+	if (format == JOURNAL_FORMAT_BINARY)
+		journalWriteHeader(fd);
+
+	buffNew(&b, 0);
+
+	for (int i = 0; i < 3; i++) {
+		struct journalEntry e = {0};
+
+		e.marker = i == 0 ? '*' : ' ';
+		e.time_ms = 1546300800123 + i;
+		e.uid = 1000 + i;
+		e.command = commands[i];
+		e.jobid = i;
+		e.revision = i + 1;
+		e.payload = messages[i];
+		e.payload_len = strlen(messages[i]);
+
+		if (journalFormatRecord(&b, format, &e) != 0)
+			return 1;
+	}
+
+	if (end_marker)
+		journalFormatEnd(&b, format);
+
+	if (write(fd, b.data, b.used) != (ssize_t)b.used)
+		return 1;
+
+	/* Zero filled space, as preallocated by jersd */
+	if (padding && ftruncate(fd, lseek(fd, 0, SEEK_CUR) + padding) != 0)
+		return 1;
+
+	buffFree(&b);
+	close(fd);
+
+	return 0;
+}
+
+static int check_records(const char *path, int format, int expected_rc) {
+	struct journalReader r;
+	struct journalEntry e;
+	int rc, i = 0;
+
+	if (journalReaderOpen(&r, path) != 0)
+		return 1;
+
+	if (r.format != format) {
+		DEBUG("Journal format mismatch. Expected: %d Got: %d\n", format, r.format);
+		return 1;
+	}
+
+	while ((rc = journalReaderNext(&r, &e)) == JOURNAL_RECORD) {
+		if (i >= 3 || strcmp(e.command, commands[i]) != 0 || e.uid != (uid_t)(1000 + i) || e.jobid != (uint32_t)i ||
+			e.revision != i + 1 || e.time_ms != 1546300800123 + i || e.marker != (i == 0 ? '*' : ' ') ||
+			e.payload_len != strlen(messages[i]) || memcmp(e.payload, messages[i], e.payload_len) != 0) {
+			DEBUG("Record %d did not match\n", i);
+			return 1;
+		}
+
+		i++;
+	}
+
+	journalReaderClose(&r);
+
+	if (rc != expected_rc) {
+		DEBUG("Expected the journal to finish with %d, got %d after %d records\n", expected_rc, rc, i);
+		return 1;
+	}
+
+	return i == 3 ? 0 : 1;
+}
+
+static int journal_test_roundtrip(int format) {
+	char path[64];
+	int status;
+
+	if (write_journal(path, format, 0, 4096) != 0)
+		return 1;
+
+	status = check_records(path, format, JOURNAL_END);
+	unlink(path);
+
+	return status;
+}
+
+static int journal_test_end_marker(int format) {
+	struct journalReader r;
+	struct journalEntry e;
+	char path[64];
+	int status = 0;
+
+	if (write_journal(path, format, 1, 0) != 0)
+		return 1;
+
+	journalReaderOpen(&r, path);
+
+	while (journalReaderNext(&r, &e) == JOURNAL_RECORD) {}
+
+	if (r.eoj == 0 || r.record != 3)
+		status = 1;
+
+	journalReaderClose(&r);
+	unlink(path);
+
+	return status;
+}
+
+/* Chop the last record in half, as if we crashed part way through writing it */
+static int journal_test_torn(int format) {
+	struct journalReader r;
+	struct journalEntry e;
+	char path[64];
+	int rc, status = 0;
+	off_t last = 0;
+
+	if (write_journal(path, format, 0, 0) != 0)
+		return 1;
+
+	journalReaderOpen(&r, path);
+
+	while (journalReaderNext(&r, &e) == JOURNAL_RECORD)
+		last = e.offset;
+
+	journalReaderClose(&r);
+
+	if (truncate(path, last + 20) != 0)
+		return 1;
+
+	journalReaderOpen(&r, path);
+
+	while ((rc = journalReaderNext(&r, &e)) == JOURNAL_RECORD) {}
+
+	if (rc != JOURNAL_TORN || r.record != 2 || r.offset != last || r.torn_len != 20) {
+		DEBUG("Torn record not detected. rc:%d records:%ld offset:%ld\n", rc, r.record, r.offset);
+		status = 1;
+	}
+
+	journalReaderClose(&r);
+	unlink(path);
+
+	return status;
+}
+
+/* A damaged record with a valid length is caught by the CRC */
+static int journal_test_crc(void) {
+	struct journalReader r;
+	struct journalEntry e;
+	char path[64];
+	int status;
+	FILE *f;
+
+	if (write_journal(path, JOURNAL_FORMAT_BINARY, 0, 4096) != 0)
+		return 1;
+
+	/* Flip a byte in the first message */
+	if ((f = fopen(path, "r+")) == NULL)
+		return 1;
+
+	fseek(f, sizeof(struct journalFileHeader) + sizeof(struct journalRecord) + 5, SEEK_SET);
+	fputc('X', f);
+	fclose(f);
+
+	journalReaderOpen(&r, path);
+	status = journalReaderNext(&r, &e) != JOURNAL_TORN || r.offset != sizeof(struct journalFileHeader);
+	journalReaderClose(&r);
+	unlink(path);
+
+	return status;
+}
+
+/* The first record is marked as commited */
+static int journal_test_last_commit(int format) {
+	struct journalReader r;
+	struct journalEntry e;
+	char path[64];
+	off_t second = -1;
+	int status = 0;
+
+	if (write_journal(path, format, 0, 4096) != 0)
+		return 1;
+
+	journalReaderOpen(&r, path);
+	journalReaderNext(&r, &e);
+	second = r.offset;
+	journalReaderClose(&r);
+
+	journalReaderOpen(&r, path);
+
+	if (journalLastCommit(&r, 0) != second) {
+		DEBUG("Last commit not found. Expected: %ld\n", second);
+		status = 1;
+	}
+
+	/* Nothing is marked after the first record */
+	if (journalLastCommit(&r, second) != -1) {
+		DEBUG("Found a commit after the first record\n");
+		status = 1;
+	}
+
+	journalReaderClose(&r);
+	unlink(path);
+
+	return status;
+}
+
+void test_journal(void) {
+	TEST("crc32c - Check value", crc32c(0, "123456789", 9) != 0xE3069283);
+	TEST("Command ids", journalCommandId("JOB_ADD") == 0 || strcmp(journalCommandName(journalCommandId("JOB_ADD")), "JOB_ADD") != 0 || journalCommandId("JOB_GET") != 0);
+	TEST("Text - Write and read back", journal_test_roundtrip(JOURNAL_FORMAT_TEXT));
+	TEST("Binary - Write and read back", journal_test_roundtrip(JOURNAL_FORMAT_BINARY));
+	TEST("Text - End of journal marker", journal_test_end_marker(JOURNAL_FORMAT_TEXT));
+	TEST("Binary - End of journal marker", journal_test_end_marker(JOURNAL_FORMAT_BINARY));
+	TEST("Text - Partially written record", journal_test_torn(JOURNAL_FORMAT_TEXT));
+	TEST("Binary - Partially written record", journal_test_torn(JOURNAL_FORMAT_BINARY));
+	TEST("Binary - CRC mismatch", journal_test_crc());
+	TEST("Text - Last commit", journal_test_last_commit(JOURNAL_FORMAT_TEXT));
+	TEST("Binary - Last commit", journal_test_last_commit(JOURNAL_FORMAT_BINARY));
+}
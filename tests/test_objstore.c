@@ -0,0 +1,277 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <glob.h>
+
+#include <jers_tests.h>
+#include <objstore.h>
+
+static void add_object(buff_t *b, uint32_t type, const char *key, const char *data) {
+	size_t start = snapshotBeginObject(b, type, key);
+	buffAdd(b, data, strlen(data));
+	snapshotEndObject(b, start);
+}
+
+static void add_commit(buff_t *b, int64_t offset) {
+	struct objstoreCommit c = {0};
+
+	c.start_jobid = 1234;
+	strcpy(c.journal, "20190101");
+	c.journal_offset = offset;
+	objstoreFormatCommit(b, &c);
+}
+
+static int append(struct objstore *s, buff_t *b) {
+	int status = write(s->fd, b->data, b->used) != (ssize_t)b->used;
+
+	s->size += b->used;
+	buffClear(b, 0);
+
+	return status;
+}
+
+/* Two saves, the second replacing the queue and deleting a job */
+static int write_saves(struct objstore *s, int roll) {
+	buff_t b;
+
+	buffNew(&b, 0);
+
+	add_object(&b, SNAPSHOT_QUEUE, "queue1", "JOBLIMIT 10\n");
+	add_object(&b, SNAPSHOT_JOB, "1", "JOBNAME one\n");
+	add_object(&b, SNAPSHOT_JOB, "2", "JOBNAME two\n");
+	add_commit(&b, 100);
+
+	if (append(s, &b) || (roll && objstoreRoll(s)))
+		return 1;
+
+	add_object(&b, SNAPSHOT_QUEUE, "queue1", "JOBLIMIT 20\n");
+	objstoreFormatDelete(&b, SNAPSHOT_JOB, "2");
+	objstoreFormatDelete(&b, SNAPSHOT_JOB, "9");
+	add_commit(&b, 200);
+
+	if (append(s, &b) || (roll && objstoreRoll(s)))
+		return 1;
+
+	buffFree(&b);
+
+	return 0;
+}
+
+static struct objstoreEntry *find(struct objstoreIndex *idx, uint32_t type, const char *key) {
+	struct objstoreEntry *e;
+	HASH_FIND(hh, idx->objects[type], key, strlen(key), e);
+	return e;
+}
+
+/* Check the index holds the result of write_saves() */
+static int check_index(struct objstoreIndex *idx) {
+	struct objstoreEntry *e;
+
+	if (!idx->committed || idx->commit.journal_offset != 200 || idx->commit.start_jobid != 1234 || strcmp(idx->commit.journal, "20190101") != 0) {
+		DEBUG("Last commit did not match\n");
+		return 1;
+	}
+
+	e = find(idx, SNAPSHOT_QUEUE, "queue1");
+
+	if (e == NULL || e->deleted || e->o.data_len != 12 || memcmp(e->o.data, "JOBLIMIT 20\n", 12) != 0) {
+		DEBUG("Queue is not the latest version\n");
+		return 1;
+	}
+
+	e = find(idx, SNAPSHOT_JOB, "1");
+
+	if (e == NULL || e->deleted || memcmp(e->o.data, "JOBNAME one\n", 12) != 0) {
+		DEBUG("Job 1 missing\n");
+		return 1;
+	}
+
+	e = find(idx, SNAPSHOT_JOB, "2");
+
+	if (e == NULL || !e->deleted) {
+		DEBUG("Job 2 not deleted\n");
+		return 1;
+	}
+
+	return 0;
+}
+
+static int make_store(char *dir) {
+	strcpy(dir, "/tmp/jers_test_objstore.XXXXXX");
+	return mkdtemp(dir) == NULL;
+}
+
+static void remove_store(const char *dir) {
+	char pattern[PATH_MAX];
+	glob_t g;
+
+	sprintf(pattern, "%s/*", dir);
+
+	if (glob(pattern, 0, NULL, &g) == 0) {
+		for (size_t i = 0; i < g.gl_pathc; i++)
+			unlink(g.gl_pathv[i]);
+	}
+
+	globfree(&g);
+	rmdir(dir);
+}
+
+static int objstore_test_latest(void) {
+	char dir[PATH_MAX];
+	struct objstore s;
+	struct objstoreIndex idx;
+	int status;
+
+	if (make_store(dir) || objstoreOpen(&s, dir, NULL) || write_saves(&s, 0))
+		return 1;
+
+	objstoreClose(&s);
+
+	if (objstoreLoad(&idx, dir, 0) != 0)
+		return 1;
+
+	status = check_index(&idx) || idx.segment_count != 1 || idx.uncommitted != 0;
+
+	/* Only a deletion that replaced a saved version needs to be kept by compaction */
+	if (!find(&idx, SNAPSHOT_JOB, "2")->replaced || find(&idx, SNAPSHOT_JOB, "9")->replaced)
+		status = 1;
+
+	objstoreIndexFree(&idx);
+	remove_store(dir);
+
+	return status;
+}
+
+/* Records after the last commit are ignored, then dropped when the store is reopened */
+static int objstore_test_uncommitted(void) {
+	char dir[PATH_MAX];
+	struct objstore s;
+	struct objstoreIndex idx;
+	buff_t b;
+	int status = 0;
+
+	if (make_store(dir) || objstoreOpen(&s, dir, NULL) || write_saves(&s, 0))
+		return 1;
+
+	buffNew(&b, 0);
+	add_object(&b, SNAPSHOT_JOB, "3", "JOBNAME three\n");
+	add_commit(&b, 300);
+
+	/* Lose the end of the commit record */
+	b.used -= 4;
+
+	if (append(&s, &b))
+		return 1;
+
+	objstoreClose(&s);
+
+	if (objstoreLoad(&idx, dir, 0) != 0)
+		return 1;
+
+	if (check_index(&idx) || find(&idx, SNAPSHOT_JOB, "3") || idx.uncommitted == 0) {
+		DEBUG("Uncommitted record was loaded\n");
+		status = 1;
+	}
+
+	if (objstoreOpen(&s, dir, &idx) != 0 || s.size != idx.segments[0].committed)
+		status = 1;
+
+	objstoreIndexFree(&idx);
+
+	/* The next save follows the last complete one */
+	add_object(&b, SNAPSHOT_JOB, "4", "JOBNAME four\n");
+	add_commit(&b, 400);
+
+	if (append(&s, &b))
+		return 1;
+
+	objstoreClose(&s);
+	buffFree(&b);
+
+	if (objstoreLoad(&idx, dir, 0) != 0)
+		return 1;
+
+	if (find(&idx, SNAPSHOT_JOB, "4") == NULL || idx.commit.journal_offset != 400 || idx.uncommitted != 0) {
+		DEBUG("Save after an incomplete one was not loaded\n");
+		status = 1;
+	}
+
+	objstoreIndexFree(&idx);
+	remove_store(dir);
+
+	return status;
+}
+
+static int objstore_test_compact(void) {
+	char dir[PATH_MAX];
+	struct objstore s;
+	struct objstoreIndex idx;
+	off_t size;
+	int status;
+
+	if (make_store(dir) || objstoreOpen(&s, dir, NULL) || write_saves(&s, 1))
+		return 1;
+
+	if (s.segment != 3 || objstoreSealedSize(&s) == 0)
+		return 1;
+
+	if (objstoreCompact(dir, s.segment, &size) != 0 || size == 0)
+		return 1;
+
+	if (objstoreLoad(&idx, dir, 0) != 0)
+		return 1;
+
+	/* Just the compacted segment and the one being appended to remain */
+	status = idx.segment_count != 2 || idx.segments[0].segment != 2 || (off_t)idx.segments[0].size != size;
+
+	if (status)
+		DEBUG("Unexpected segments after compaction\n");
+
+	/* The deletion of a job that was never saved isn't needed */
+	if (check_index(&idx) || find(&idx, SNAPSHOT_JOB, "9") || idx.records != 3)
+		status = 1;
+
+	objstoreIndexFree(&idx);
+	objstoreClose(&s);
+	remove_store(dir);
+
+	return status;
+}
+
+static int objstore_test_header(void) {
+	char dir[PATH_MAX];
+	char path[PATH_MAX + 32];
+	struct objstore s;
+	struct objstoreIndex idx;
+	int status = 0;
+	FILE *f;
+
+	if (make_store(dir) || objstoreOpen(&s, dir, NULL) || write_saves(&s, 0))
+		return 1;
+
+	objstoreClose(&s);
+
+	/* Damage the header */
+	sprintf(path, "%s/segment.00000001", dir);
+	f = fopen(path, "r+");
+	fseek(f, offsetof(struct objstoreHeader, segment), SEEK_SET);
+	fputc('X', f);
+	fclose(f);
+
+	if (objstoreLoad(&idx, dir, 0) == 0) {
+		objstoreIndexFree(&idx);
+		status = 1;
+	}
+
+	remove_store(dir);
+
+	return status;
+}
+
+void test_objstore(void) {
+	TEST("Latest version of each object", objstore_test_latest());
+	TEST("Incomplete save ignored", objstore_test_uncommitted());
+	TEST("Compaction", objstore_test_compact());
+	TEST("Damaged segment header", objstore_test_header());
+}
@@ -3,15 +3,18 @@
 #include <jers_tests.h>
 #include <server.h>
 
-void generateCandidatePool(void);
 void releaseDeferred(void);
 void clear_jobtable(void);
 
-int test_generateCandidatePool(void) {
+int test_candidateOrder(void) {
 	int status = 0;
-	/* The expected order of jobs after the pool is generated */
+	/* The expected order the candidates are walked in */
 	jobid_t expected_order[] = {500, 12, 1020, 32, 10, 5};
 	int64_t expected_count = 6;
+	/* Order after job 12 is removed */
+	jobid_t expected_removed[] = {500, 1020, 32, 10, 5};
+	int64_t count = 0;
+	struct job *got[10];
 
 	/* Need some queues for queue sorting priorities */
 	struct queue q[] = {
@@ -20,30 +23,43 @@ int test_generateCandidatePool(void) {
 		{.name = "test_queue3", .priority = 5, .job_limit = 1}	 // Second
 	};
 
+	for (int i = 0; i < 3; i++) {
+		initCandidates(&q[i]);
+		HASH_ADD_STR(server.queueTable, name, (&q[i]));
+	}
+
 /* Add a whole bunch of jobs */
 #include <_test_gen_jobs.c>
 
-	generateCandidatePool();
+	startCandidates(1);
+
+	while ((j = nextCandidate()) != NULL) {
+		if (count < 10)
+			got[count] = j;
 
-	if (server.candidate_pool_jobs != expected_count) {
-		DEBUG("Incorrect number of jobs in candidate pool. Expected:%ld Got:%ld\n", expected_count, server.candidate_pool_jobs);
+		count++;
+		expandCandidate(j);
+	}
+
+	if (count != expected_count) {
+		DEBUG("Incorrect number of candidate jobs. Expected:%ld Got:%ld\n", expected_count, count);
 		status = 1;
 		goto end;
 	}
 
-	for (int i = 0; i < server.candidate_pool_jobs; i++) {
-		if (expected_order[i] != server.candidate_pool[i]->jobid) {
-			printf("Candidate pool is not in the expected order. Expected:\n");
-			for (int j = 0; j < expected_count; j++) {
-				printf("[%d] = %d\n", j, expected_order[j]);
+	for (int i = 0; i < count; i++) {
+		if (expected_order[i] != got[i]->jobid) {
+			printf("Candidates are not in the expected order. Expected:\n");
+			for (int k = 0; k < expected_count; k++) {
+				printf("[%d] = %d\n", k, expected_order[k]);
 			}
 
 			printf("Got:\n");
-			for (int j = 0; j < expected_count; j++) {
-				printf("[%d] = %d QueuePriority:%d Priority:%d\n", j,
-					   server.candidate_pool[j]->jobid,
-					   server.candidate_pool[j]->queue->priority,
-					   server.candidate_pool[j]->priority);
+			for (int k = 0; k < expected_count; k++) {
+				printf("[%d] = %d QueuePriority:%d Priority:%d\n", k,
+					   got[k]->jobid,
+					   got[k]->queue->priority,
+					   got[k]->priority);
 			}
 
 			status = 1;
@@ -51,11 +67,67 @@ int test_generateCandidatePool(void) {
 		}
 	}
 
+	/* Removing a job should leave the remaining candidates in order */
+	removeCandidate(findJob(12));
+
+	startCandidates(1);
+	count = 0;
+
+	while ((j = nextCandidate()) != NULL) {
+		if (count >= 5 || j->jobid != expected_removed[count]) {
+			DEBUG("Unexpected candidate %d at position %ld after removing job 12\n", j->jobid, count);
+			status = 1;
+			goto end;
+		}
+
+		count++;
+		expandCandidate(j);
+	}
+
+	/* Not expanding a candidate skips the rest of its queue */
+	startCandidates(1);
+	count = 0;
+
+	while ((j = nextCandidate()) != NULL) {
+		count++;
+
+		if (j->queue != &q[2])
+			expandCandidate(j);
+	}
+
+	if (count != 4) {
+		DEBUG("Expected 4 candidates when skipping a queue, got %ld\n", count);
+		status = 1;
+		goto end;
+	}
+
 end:
+	for (int i = 0; i < 3; i++) {
+		HASH_DEL(server.queueTable, (&q[i]));
+		heapFree(&q[i].pending);
+	}
+
 	clear_jobtable();
 	return status;
 }
 
+/* Each job in the deferred heap should be due no earlier than its parent */
+static int checkDeferredOrder(const char *when) {
+	for (size_t i = 1; i < server.deferred.count; i++) {
+		struct job *parent = server.deferred.items[(i - 1) / 2];
+		struct job *child = server.deferred.items[i];
+
+		if (child->defer_time < parent->defer_time) {
+			printf("Unexpected defer time order%s:\n", when);
+			printf("Parent - jobid:%u defer_time:%ld\n", parent->jobid, parent->defer_time);
+			printf("Child  - jobid:%u defer_time:%ld\n", child->jobid, child->defer_time);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
 int test_releaseDeferred(void) {
 	int status = 0;
 	jobid_t expected_pend[] = {5, 10, 32, 500};
@@ -69,53 +141,42 @@ int test_releaseDeferred(void) {
 
 	int64_t count = 0;
 
-	/* Check the jobs loaded into the deferred linked list in order */
-	for (struct job *j = server.deferred_list; j; j = j->deferred_next)
-	{
-		if (j->deferred_next) {
-			if (j->deferred_next->defer_time < j->defer_time) {
-				printf("Unexpected defer time order:\n");
-				printf("Current - jobid:%u defer_time:%ld\n", j->jobid, j->defer_time);
-				printf("Next    - jobid:%u defer_time:%ld\n", j->deferred_next->jobid, j->deferred_next->defer_time);
-				status = 1;
-				goto end;
-			}
-		}
-
-		count++;
+	/* Check the jobs loaded into the deferred heap in order */
+	if (checkDeferredOrder("") != 0) {
+		status = 1;
+		goto end;
 	}
 
+	count = server.deferred.count;
+
 	if (count != expected_defer_count)
 	{
-		printf("Unexpected number of jobs in deferred list, expected %ld, got %ld\n", expected_pend_count, count);
+		printf("Unexpected number of jobs in deferred list, expected %ld, got %ld\n", expected_defer_count, count);
 		status = 1;
 		goto end;
 	}
 
 	releaseDeferred();
 
-	/* After releasing the jobs, they should have been removed from the linked list */
-	for (struct job *j = server.deferred_list; j; j = j->deferred_next)
+	/* After releasing the jobs, they should have been removed from the heap */
+	for (size_t k = 0; k < server.deferred.count; k++)
 	{
+		struct job *d = server.deferred.items[k];
+
 		/* Check if it should be in the list at all */
 		for (int i = 0; i < expected_pend_count; i++) {
-			if (expected_pend[i] == j->jobid)
+			if (expected_pend[i] == d->jobid)
 			{
-				printf("Error - Released job %d was in the deferred list\n", j->jobid);
+				printf("Error - Released job %d was in the deferred list\n", d->jobid);
 				status = 1;
 				goto end;
 			}
 		}
+	}
 
-		if (j->deferred_next) {
-			if (j->deferred_next->defer_time < j->defer_time) {
-				printf("Unexpected defer time order (after release):\n");
-				printf("Current - jobid:%u defer_time:%ld\n", j->jobid, j->defer_time);
-				printf("Next    - jobid:%u defer_time:%ld\n", j->deferred_next->jobid, j->deferred_next->defer_time);
-				status = 1;
-				goto end;
-			}
-		}
+	if (checkDeferredOrder(" (after release)") != 0) {
+		status = 1;
+		goto end;
 	}
 
 	/* Check the expected jobs are now the only ones pending */
@@ -139,11 +200,178 @@ int test_releaseDeferred(void) {
 	/* Check the queue counts are correct */
 
 end:
+	heapFree(&q.pending);
+	heapFree(&server.deferred);
 	clear_jobtable();
 	return status;
 }
 
+int test_getPendReason(void) {
+	int status = 0;
+	agent a = {.logged_in = 1};
+	struct queue q = {.name = "test_queue", .job_limit = 1, .agent = &a};
+	struct job j = {.jobid = 1, .queue = &q, .state = JERS_JOB_PENDING};
+
+	server.max_run_jobs = UNLIMITED_JOBS;
+
+	struct {
+		const char *desc;
+		int expected;
+	} checks[] = {
+		{"Stopped queue", JERS_PEND_QUEUESTOPPED},
+		{"Agent down", JERS_PEND_AGENTDOWN},
+		{"Agent reconciling", JERS_PEND_RECON},
+		{"Eligible", JERS_PEND_NOREASON},
+		{"Queue full", JERS_PEND_QUEUEFULL},
+		{"Readonly", JERS_PEND_READONLY},
+	};
+
+	for (size_t i = 0; i < sizeof(checks) / sizeof(checks[0]); i++) {
+		switch (checks[i].expected) {
+			case JERS_PEND_QUEUESTOPPED: q.state = 0; a.logged_in = 0; break;
+			case JERS_PEND_AGENTDOWN: q.state = JERS_QUEUE_FLAG_STARTED; break;
+			case JERS_PEND_RECON: a.logged_in = 1; a.recon = 1; break;
+			case JERS_PEND_NOREASON: a.recon = 0; break;
+			case JERS_PEND_QUEUEFULL: q.stats.start_pending = 1; break;
+			case JERS_PEND_READONLY: server.readonly = 1; break;
+		}
+
+		int reason = getPendReason(&j);
+
+		if (reason != checks[i].expected) {
+			DEBUG("%s: Expected pend reason %d, got %d\n", checks[i].desc, checks[i].expected, reason);
+			status = 1;
+		}
+	}
+
+	server.readonly = 0;
+	return status;
+}
+
+int test_resourceWaiters(void) {
+	int status = 0;
+	agent a = {.logged_in = 1};
+	struct queue q = {.name = "test_queue", .job_limit = 10, .state = JERS_QUEUE_FLAG_STARTED, .agent = &a};
+	struct resource r = {.name = "test_res", .count = 1, .in_use = 1};
+	struct jobResource res = {.needed = 1, .res = &r};
+	struct job holder = {.jobid = 1, .queue = &q, .res_count = 1, .req_resources = &res};
+	struct job jobs[] = {
+		{.jobid = 10, .queue = &q, .priority = 50, .state = JERS_JOB_PENDING, .res_count = 1, .req_resources = &res},
+		{.jobid = 11, .queue = &q, .priority = 100, .state = JERS_JOB_PENDING, .res_count = 1, .req_resources = &res},
+		{.jobid = 12, .queue = &q, .priority = 75, .state = JERS_JOB_PENDING, .res_count = 1, .req_resources = &res},
+	};
+
+	server.max_run_jobs = UNLIMITED_JOBS;
+	initCandidates(&q);
+	initResourceWaiters(&r);
+	HASH_ADD_STR(server.queueTable, name, (&q));
+
+	for (int i = 0; i < 3; i++) {
+		addCandidate(&jobs[i]);
+		server.stats.jobs.pending++;
+	}
+
+	/* None of the jobs can start, so they should all be moved to the resource */
+	checkJobs();
+
+	if (q.pending.count != 0 || r.waiting.count != 3) {
+		DEBUG("Expected all jobs waiting on the resource. Candidates:%ld Waiting:%ld\n", q.pending.count, r.waiting.count);
+		status = 1;
+		goto end;
+	}
+
+	/* Releasing the resource should only wake the highest priority waiter */
+	deallocateRes(&holder);
+
+	if (q.pending.count != 1 || r.waiting.count != 2 || heapPeek(&q.pending) != &jobs[1] || jobs[1].waiting_res != NULL) {
+		DEBUG("Expected job 11 to be woken. Candidates:%ld Waiting:%ld\n", q.pending.count, r.waiting.count);
+		status = 1;
+		goto end;
+	}
+
+	/* Removing a waiting job takes it off the resource */
+	removeCandidate(&jobs[0]);
+
+	if (r.waiting.count != 1 || jobs[0].waiting_res != NULL) {
+		DEBUG("Expected job 10 to be removed from the resource wait list\n");
+		status = 1;
+		goto end;
+	}
+
+end:
+	HASH_DEL(server.queueTable, (&q));
+	heapFree(&q.pending);
+	heapFree(&r.waiting);
+	server.stats.jobs.pending = 0;
+	return status;
+}
+
+int test_resourceWaitersQueues(void) {
+	int status = 0;
+	agent a = {.logged_in = 1};
+	struct queue high = {.name = "high_queue", .priority = 200, .job_limit = 10, .state = JERS_QUEUE_FLAG_STARTED, .agent = &a};
+	struct queue low = {.name = "low_queue", .priority = 100, .job_limit = 10, .state = JERS_QUEUE_FLAG_STARTED, .agent = &a};
+	struct resource r = {.name = "test_res", .count = 1, .in_use = 1};
+	struct jobResource res = {.needed = 1, .res = &r};
+	struct job holder = {.jobid = 1, .queue = &low, .res_count = 1, .req_resources = &res};
+	struct job high_job = {.jobid = 10, .queue = &high, .state = JERS_JOB_PENDING, .res_count = 1, .req_resources = &res};
+	struct job low_job = {.jobid = 11, .queue = &low, .state = JERS_JOB_PENDING, .res_count = 1, .req_resources = &res};
+
+	server.max_run_jobs = UNLIMITED_JOBS;
+	initCandidates(&high);
+	initCandidates(&low);
+	initResourceWaiters(&r);
+	HASH_ADD_STR(server.queueTable, name, (&high));
+	HASH_ADD_STR(server.queueTable, name, (&low));
+	HASH_ADD_STR(server.resTable, name, (&r));
+
+	addCandidate(&high_job);
+	addCandidate(&low_job);
+	server.stats.jobs.pending = 2;
+
+	checkJobs();
+
+	if (r.waiting.count != 2 || heapPeek(&r.waiting) != &high_job) {
+		DEBUG("Expected both jobs waiting, job 10 first. Waiting:%ld\n", r.waiting.count);
+		status = 1;
+		goto end;
+	}
+
+	/* Lowering the queue priority should reorder the wait list */
+	high.priority = 50;
+	resortResourceWaiters();
+
+	if (heapPeek(&r.waiting) != &low_job) {
+		DEBUG("Expected job 11 first after lowering the queue priority of job 10\n");
+		status = 1;
+		goto end;
+	}
+
+	/* A waiter whose queue can't start it shouldn't take the released count */
+	low.state = 0;
+	deallocateRes(&holder);
+
+	if (r.waiting.count != 0 || heapPeek(&low.pending) != &low_job || heapPeek(&high.pending) != &high_job) {
+		DEBUG("Expected both jobs woken. Waiting:%ld Low:%ld High:%ld\n", r.waiting.count, low.pending.count, high.pending.count);
+		status = 1;
+		goto end;
+	}
+
+end:
+	HASH_DEL(server.queueTable, (&high));
+	HASH_DEL(server.queueTable, (&low));
+	HASH_DEL(server.resTable, (&r));
+	heapFree(&high.pending);
+	heapFree(&low.pending);
+	heapFree(&r.waiting);
+	server.stats.jobs.pending = 0;
+	return status;
+}
+
 void test_sched(void) {
-	TEST("generateCandidatePool", test_generateCandidatePool());
+	TEST("candidateOrder", test_candidateOrder());
 	TEST("releaseDeferred", test_releaseDeferred());
+	TEST("getPendReason", test_getPendReason());
+	TEST("resourceWaiters", test_resourceWaiters());
+	TEST("resourceWaitersQueues", test_resourceWaitersQueues());
 }
@@ -0,0 +1,163 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <jers_tests.h>
+#include <snapshot.h>
+
+static const char *keys[] = {"res1", "queue1", "1234"};
+static const char *objects[] = {"COUNT 2\nREVISION 1\n", "JOBLIMIT 10\nHOST localhost\n", "JOBNAME one\nQUEUENAME queue1\n"};
+static const uint32_t types[] = {SNAPSHOT_RESOURCE, SNAPSHOT_QUEUE, SNAPSHOT_JOB};
+
+/* Write a snapshot of the test objects, dropping 'trim' bytes from the end */
+static int write_snapshot(char *path, size_t trim, size_t *size) {
+	struct snapshotHeader h = {0};
+	buff_t b;
+	int fd;
+
+	strcpy(path, "/tmp/jers_test_snapshot.XXXXXX");
+
+	if ((fd = mkstemp(path)) < 0)
+		return 1;
+
+	h.start_jobid = 1234;
+	strcpy(h.journal, "20190101");
+	h.journal_offset = 4096;
+	h.journal_record = 12;
+
+	buffNew(&b, 0);
+	snapshotFormatHeader(&b, &h);
+
+	for (int i = 0; i < 3; i++) {
+		size_t start = snapshotBeginObject(&b, types[i], keys[i]);
+		buffAdd(&b, objects[i], strlen(objects[i]));
+		snapshotEndObject(&b, start);
+	}
+
+	snapshotFormatEnd(&b, 3);
+
+	if (size)
+		*size = b.used;
+
+	if (write(fd, b.data, b.used - trim) != (ssize_t)(b.used - trim))
+		return 1;
+
+	buffFree(&b);
+	close(fd);
+
+	return 0;
+}
+
+static int check_objects(const char *path, int expected_rc) {
+	struct snapshotReader r;
+	struct snapshotObject o;
+	int rc, i = 0;
+
+	if (snapshotReaderOpen(&r, path) != 0)
+		return 1;
+
+	if (r.header.start_jobid != 1234 || strcmp(r.header.journal, "20190101") != 0 || r.header.journal_offset != 4096 || r.header.journal_record != 12) {
+		DEBUG("Snapshot header did not match\n");
+		return 1;
+	}
+
+	while ((rc = snapshotReaderNext(&r, &o)) == SNAPSHOT_OBJECT) {
+		if (i >= 3 || o.type != types[i] || o.key_len != strlen(keys[i]) || memcmp(o.key, keys[i], o.key_len) != 0 ||
+			o.data_len != strlen(objects[i]) || memcmp(o.data, objects[i], o.data_len) != 0) {
+			DEBUG("Object %d did not match\n", i);
+			return 1;
+		}
+
+		i++;
+	}
+
+	snapshotReaderClose(&r);
+
+	if (rc != expected_rc) {
+		DEBUG("Expected the snapshot to finish with %d, got %d after %d objects\n", expected_rc, rc, i);
+		return 1;
+	}
+
+	return 0;
+}
+
+static int snapshot_test_roundtrip(void) {
+	char path[64];
+	int status;
+
+	if (write_snapshot(path, 0, NULL) != 0)
+		return 1;
+
+	status = check_objects(path, SNAPSHOT_DONE);
+	unlink(path);
+
+	return status;
+}
+
+/* A snapshot missing its end record wasn't completely written */
+static int snapshot_test_incomplete(void) {
+	char path[64];
+	int status;
+
+	if (write_snapshot(path, sizeof(struct snapshotRecord) + sizeof(int64_t), NULL) != 0)
+		return 1;
+
+	status = check_objects(path, SNAPSHOT_CORRUPT);
+	unlink(path);
+
+	return status;
+}
+
+static int snapshot_test_crc(void) {
+	char path[64];
+	size_t size;
+	int status;
+	FILE *f;
+
+	if (write_snapshot(path, 0, &size) != 0)
+		return 1;
+
+	/* Damage the data of the first object */
+	f = fopen(path, "r+");
+	fseek(f, sizeof(struct snapshotHeader) + sizeof(struct snapshotRecord) + strlen(keys[0]), SEEK_SET);
+	fputc('X', f);
+	fclose(f);
+
+	status = check_objects(path, SNAPSHOT_CORRUPT);
+	unlink(path);
+
+	return status;
+}
+
+static int snapshot_test_header(void) {
+	struct snapshotReader r;
+	char path[64];
+	int status = 0;
+	FILE *f;
+
+	if (write_snapshot(path, 0, NULL) != 0)
+		return 1;
+
+	/* Damage the header */
+	f = fopen(path, "r+");
+	fseek(f, offsetof(struct snapshotHeader, journal_offset), SEEK_SET);
+	fputc('X', f);
+	fclose(f);
+
+	if (snapshotReaderOpen(&r, path) == 0) {
+		snapshotReaderClose(&r);
+		status = 1;
+	}
+
+	unlink(path);
+
+	return status;
+}
+
+void test_snapshot(void) {
+	TEST("Write and read back", snapshot_test_roundtrip());
+	TEST("Missing end record", snapshot_test_incomplete());
+	TEST("CRC mismatch", snapshot_test_crc());
+	TEST("Damaged header", snapshot_test_header());
+}
@@ -1,14 +1,22 @@
 #include <stdio.h>
 #include <errno.h>
 #include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 
 #include <jers_tests.h>
 #include <server.h>
+#include <journal.h>
 
 void stateInit(void);
 int stateSaveJob(struct job *j);
 int stateSaveQueue(struct queue *q);
 int stateSaveResource(struct resource *r);
+void stateTruncateJournals(const char *datetime);
+int openStateFile(time_t now, int sequence);
 
 //struct jersServer server = {0};
 
@@ -414,6 +422,285 @@ void test_resource_states(void) {
 	TEST("state{Save/Load}Resource", test_resource_state(&r));
 }
 
+/* Objects should be linked onto the dirty list for their type once, newest first */
+static int test_dirty_list(void) {
+	struct job j1 = {0}, j2 = {0};
+	struct queue q = {0};
+	int status = 0;
+
+	j1.obj.type = j2.obj.type = JERS_OBJECT_JOB;
+	q.obj.type = JERS_OBJECT_QUEUE;
+
+	updateObject(&j1.obj, 0);
+	status |= server.dirty_jobs.count != 0;
+
+	updateObject(&j1.obj, 1);
+	updateObject(&q.obj, 1);
+	updateObject(&j2.obj, 1);
+	updateObject(&j1.obj, 1);
+
+	status |= server.dirty_jobs.count != 2;
+	status |= server.dirty_jobs.head != &j2.obj || j2.obj.dirty_next != &j1.obj || j1.obj.dirty_next != NULL;
+	status |= server.dirty_queues.count != 1 || server.dirty_queues.head != &q.obj;
+	status |= server.dirty_resources.count != 0;
+	status |= j1.obj.revision != 3;
+
+	memset(&server.dirty_jobs, 0, sizeof(struct dirtyList));
+	memset(&server.dirty_queues, 0, sizeof(struct dirtyList));
+
+	return status;
+}
+
+/* A failed journal write should keep the unwritten records and switch to readonly mode until they're written */
+static int test_journal_commit(void) {
+	char path[PATH_MAX];
+	int status = 0;
+
+	sprintf(path, "%s/journal.test", server.state_dir);
+
+	buffNew(&server.journal.pending, 0);
+	buffAdd(&server.journal.pending, "record\n", 7);
+
+	server.journal.fd = open("/dev/full", O_WRONLY);
+	status |= journalCommit() != 1;
+	status |= server.journal.pending.used != 7;
+	status |= server.readonly != READONLY_JOURNAL;
+	close(server.journal.fd);
+
+	server.journal.fd = open(path, O_CREAT | O_WRONLY | O_TRUNC, 0600);
+	status |= journalCommit() != 0;
+	status |= server.journal.pending.used != 0;
+	status |= server.readonly != 0;
+	close(server.journal.fd);
+
+	server.journal.fd = -1;
+	server.journal.commit_due = 0;
+	server.sched_pending = 0;
+	buffFree(&server.journal.pending);
+	unlink(path);
+
+	return status;
+}
+
+static void format_test_record(buff_t *b, int format, uid_t uid) {
+	const char *payload = "{\"JOB_ADD\":{\"VERSION\":1,\"FIELDS\":{\"JOBNAME\":\"torn\"}}}";
+	struct journalEntry e = {0};
+
+	e.marker = ' ';
+	e.time_ms = 1546300800123;
+	e.uid = uid;
+	e.command = "JOB_ADD";
+	e.jobid = 1;
+	e.revision = 1;
+	e.payload = payload;
+	e.payload_len = strlen(payload);
+
+	journalFormatRecord(b, format, &e);
+}
+
+/* A torn record, and anything written after it, is cleared when the journal is reopened.
+ * Otherwise a record later written over it could be followed by an old one */
+static int test_torn_journal(int format) {
+	char path[PATH_MAX];
+	struct journalReader r;
+	struct journalEntry e;
+	size_t torn, torn_len;
+	off_t start;
+	buff_t b;
+	int fd, status = 0;
+	int journal_format = server.journal_format;
+	time_t now = time(NULL);
+
+	server.journal_format = format;
+
+	/* Create the journal, then fill it in with a torn record followed by a complete one */
+	fd = openStateFile(now, 999);
+	start = server.journal.len;
+	sprintf(path, "%s/journal.%s", server.state_dir, server.journal.datetime);
+
+	buffNew(&b, 0);
+	format_test_record(&b, format, 1000);
+	torn = b.used;
+	format_test_record(&b, format, 1001);
+	torn_len = b.used - torn;
+	format_test_record(&b, format, 1002);
+
+	/* Part of the middle record never made it to disk */
+	memset(b.data + torn + torn_len / 4, 0, torn_len / 2);
+
+	if (pwrite(fd, b.data, b.used, start) != (ssize_t)b.used)
+		status = 1;
+
+	close(fd);
+
+	/* Reopen it and write a record the same length as the torn one */
+	fd = openStateFile(now, 999);
+	status |= server.journal.len != start + (off_t)torn;
+
+	buffClear(&b, 0);
+	format_test_record(&b, format, 2001);
+
+	if (b.used != torn_len || pwrite(fd, b.data, b.used, server.journal.len) != (ssize_t)b.used)
+		status = 1;
+
+	close(fd);
+
+	/* Only the first record and the new one should be read back */
+	if (journalReaderOpen(&r, path) != 0)
+		return 1;
+
+	status |= journalReaderNext(&r, &e) != JOURNAL_RECORD || e.uid != 1000;
+	status |= journalReaderNext(&r, &e) != JOURNAL_RECORD || e.uid != 2001;
+	status |= journalReaderNext(&r, &e) != JOURNAL_END;
+
+	journalReaderClose(&r);
+	buffFree(&b);
+	unlink(path);
+
+	server.journal_format = journal_format;
+	server.journal.len = server.journal.size = server.journal.limit = 0;
+	server.journal.record = 0;
+
+	return status;
+}
+
+/* Create a file in 'dir', last modified 'age' days ago */
+static void create_file(const char *dir, const char *name, const char *contents, int age) {
+	char path[PATH_MAX];
+	struct timeval times[2] = {{0}};
+	int fd;
+
+	sprintf(path, "%s/%s", dir, name);
+	fd = open(path, O_CREAT | O_TRUNC | O_WRONLY, 0600);
+
+	if (fd < 0 || write(fd, contents, strlen(contents)) != (ssize_t)strlen(contents)) {
+		printf("Failed to create test file %s: %s\n", path, strerror(errno));
+		exit(1);
+	}
+
+	close(fd);
+
+	times[0].tv_sec = times[1].tv_sec = time(NULL) - (time_t)age * 24 * 60 * 60;
+	utimes(path, times);
+}
+
+static int file_exists(const char *dir, const char *name) {
+	char path[PATH_MAX];
+
+	sprintf(path, "%s/%s", dir, name);
+
+	return access(path, F_OK) == 0;
+}
+
+static void remove_file(const char *dir, const char *name) {
+	char path[PATH_MAX];
+
+	sprintf(path, "%s/%s", dir, name);
+	unlink(path);
+}
+
+/* Check an archived journal decompresses back to 'contents' */
+static int cmp_archive(const char *dir, const char *name, const char *contents) {
+	char path[PATH_MAX];
+	char buf[64] = {0};
+	gzFile gz;
+
+	sprintf(path, "%s/%s", dir, name);
+
+	if ((gz = gzopen(path, "rb")) == NULL)
+		return 1;
+
+	gzread(gz, buf, sizeof(buf) - 1);
+	gzclose(gz);
+
+	return strcmp(buf, contents);
+}
+
+/* The journals before the one a save covers are removed, or archived if there's an archive directory */
+static int test_truncate_journals(void) {
+	char archive_dir[PATH_MAX];
+	const char *dir = server.state_dir;
+	int status = 0;
+
+	create_file(dir, "journal.20200101", "journal 1\n", 0);
+	create_file(dir, "journal.20200102", "journal 2\n", 0);
+	create_file(dir, "journal.20200103", "journal 3\n", 0);
+
+	stateTruncateJournals("20200102");
+
+	status |= file_exists(dir, "journal.20200101");
+	status |= !file_exists(dir, "journal.20200102");
+	status |= !file_exists(dir, "journal.20200103");
+
+	sprintf(archive_dir, "%s/archive", dir);
+	mkdir(archive_dir, 0700);
+	server.journal_archive_dir = archive_dir;
+
+	stateTruncateJournals("20200103");
+
+	status |= file_exists(dir, "journal.20200102");
+	status |= !file_exists(dir, "journal.20200103");
+	status |= !file_exists(archive_dir, "journal.20200102.gz");
+	status |= file_exists(archive_dir, "journal.20200102.gz.new");
+	status |= file_exists(archive_dir, "journal.20200101.gz");
+	status |= cmp_archive(archive_dir, "journal.20200102.gz", "journal 2\n");
+
+	/* The current journal is kept, even if it's the only one */
+	stateTruncateJournals("20200103");
+	status |= !file_exists(dir, "journal.20200103");
+
+	server.journal_archive_dir = NULL;
+
+	return status;
+}
+
+/* Archived journals older than journal_archive_days are removed once a journal is archived */
+static int test_expire_archived_journals(void) {
+	char archive_dir[PATH_MAX];
+	const char *dir = server.state_dir;
+	int status = 0;
+
+	sprintf(archive_dir, "%s/archive", dir);
+	server.journal_archive_dir = archive_dir;
+	server.journal_archive_days = 5;
+
+	create_file(archive_dir, "journal.20190101.gz", "", 10);
+	create_file(archive_dir, "journal.20190102.gz", "", 4);
+	create_file(archive_dir, "other.gz", "", 10);
+	create_file(dir, "journal.20200104", "journal 4\n", 0);
+
+	stateTruncateJournals("20200104");
+
+	status |= file_exists(dir, "journal.20200103");
+	status |= file_exists(archive_dir, "journal.20190101.gz");
+	status |= !file_exists(archive_dir, "journal.20190102.gz");
+	status |= !file_exists(archive_dir, "journal.20200102.gz");
+	status |= !file_exists(archive_dir, "journal.20200103.gz");
+	status |= !file_exists(archive_dir, "other.gz");
+
+	/* Nothing expires while they're kept forever */
+	server.journal_archive_days = 0;
+	create_file(archive_dir, "journal.20190101.gz", "", 10);
+	create_file(dir, "journal.20200105", "journal 5\n", 0);
+
+	stateTruncateJournals("20200105");
+
+	status |= !file_exists(archive_dir, "journal.20190101.gz");
+	status |= !file_exists(archive_dir, "journal.20200104.gz");
+
+	const char *files[] = {"journal.20190101.gz", "journal.20190102.gz", "journal.20200102.gz",
+		"journal.20200103.gz", "journal.20200104.gz", "other.gz"};
+
+	for (size_t i = 0; i < sizeof(files) / sizeof(files[0]); i++)
+		remove_file(archive_dir, files[i]);
+
+	remove_file(dir, "journal.20200105");
+	rmdir(archive_dir);
+	server.journal_archive_dir = NULL;
+
+	return status;
+}
+
 /* Test the saving and loading of state files */
 
 void test_state(void) {
@@ -433,4 +720,11 @@ void test_state(void) {
 	test_job_states();
 	test_queue_states();
 	test_resource_states();
+
+	TEST("updateObject - Dirty lists", test_dirty_list());
+	TEST("journalCommit - Failed write", test_journal_commit());
+	TEST("openStateFile - Torn text record", test_torn_journal(JOURNAL_FORMAT_TEXT));
+	TEST("openStateFile - Torn binary record", test_torn_journal(JOURNAL_FORMAT_BINARY));
+	TEST("stateTruncateJournals - Remove and archive", test_truncate_journals());
+	TEST("stateTruncateJournals - Expire archives", test_expire_archived_journals());
 }